@@ -0,0 +1,319 @@
+#!/usr/bin/env python3
+"""Times ccfsyncd's startup against a synthetic tree and a local Swift stand-in (swift_standin.py).
+
+Generates a tree under a temporary directory, seeds the stand-in's container so that part of the tree is already
+in sync, part has changed (some with the same size, some not) and some objects only exist remotely, then starts
+the daemon in the foreground and waits until every expected upload and delete has reached the stand-in.
+
+Results are printed one per line as
+
+  bench variant=<name> run=<n> name=<phase> elapsed_ms=<ms>
+
+where the phases are whatever the daemon logs as 'startup-phase name=... elapsed_ms=...', plus 'drain' (daemon
+start until the last expected request arrived) measured here, followed by a 'bench variant=<name> run=<n> stats ...'
+line with the stand-in's request counters and the object operations per second over the drain. The stats also
+have the daemon's CPU time up to the end of the drain (cpu_ms, user and system), the upload throughput over it
+(upload_mb_per_sec) and the CPU cycles the daemon spent per byte uploaded (cycles_per_byte, at the clock speed in
+/proc/cpuinfo or --cpu-mhz). With --json, a single JSON document is printed instead.
+
+Each --variant is a name and the config settings to run it with, so configurations can be compared on the same
+tree. Python's standard library has no HTTP/2 server, so to try http_version=2-prior-knowledge, point --h2-proxy at
+nghttpx: it's started in front of the stand-in, speaking h2c (and HTTP/1.1) to the daemon.
+
+Examples:
+  extras/bench/run_bench.py --daemon src/ccfsyncd --files 100000 --depth 3 --fanout 10 --runs 2 --hash-cache
+
+  # Small-object ops/sec over HTTP/1.1 and HTTP/2, with 20ms of latency per request
+  extras/bench/run_bench.py --files 20000 --size-mu 6 --in-sync 0 --changed 0 --latency-ms 20 \\
+      --h2-proxy nghttpx -o transfer_engine=multi -o max_inflight=200 \\
+      --variant h1:http_version=1.1 --variant h2:http_version=2-prior-knowledge
+
+  # CPU per byte uploaded on a few big files, with curl's default upload buffer and a bigger one
+  extras/bench/run_bench.py --files 8 --size-mu 20 --min-size 268435456 --max-size 536870912 --in-sync 0 \
+      --changed 0 --remote-only 0 -o slo_threshold=0 \
+      --variant 64k:upload_buffer_size=65536 --variant 2m:upload_buffer_size=2097152
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import random
+import re
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+import urllib.request
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+PHASE_RE = re.compile(r"startup-phase name=(\S+) elapsed_ms=(\d+)")
+
+
+def file_size(rng, args):
+    """Log-normal sizes, clamped - lots of small files and a long tail, like most real trees"""
+    size = int(rng.lognormvariate(args.size_mu, args.size_sigma))
+    return max(args.min_size, min(args.max_size, size))
+
+
+def make_tree(root, args):
+    """Creates the tree and returns (name, size, md5) for every file, name being relative to root"""
+    rng = random.Random(args.seed)
+    dirs = [""]
+    for _ in range(args.depth):
+        dirs = [os.path.join(d, "d%02d" % i) for d in dirs for i in range(args.fanout)]
+    files = []
+    for i in range(args.files):
+        name = os.path.join(rng.choice(dirs), "f%07d.dat" % i)
+        path = os.path.join(root, name)
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        data = rng.randbytes(file_size(rng, args)) if hasattr(rng, "randbytes") else os.urandom(file_size(rng, args))
+        with open(path, "wb") as f:
+            f.write(data)
+        files.append((name, len(data), hashlib.md5(data).hexdigest()))
+    return files
+
+
+def write_seed(path, files, args):
+    """Seeds the container. Returns the (uploads, deletes) the daemon should make"""
+    rng = random.Random(args.seed + 1)
+    uploads = 0
+    with open(path, "w") as f:
+        for name, size, md5 in files:
+            r = rng.random()
+            if r < args.in_sync:
+                obj = {"name": name, "bytes": size, "hash": md5}
+            elif r < args.in_sync + args.changed:
+                # Half with the same size, so they have to be hashed to find out
+                same_size = rng.random() < 0.5
+                obj = {"name": name, "bytes": size if same_size else size + 1, "hash": "0" * 32}
+                uploads += 1
+            else:
+                uploads += 1
+                continue
+            f.write(json.dumps(obj) + "\n")
+        for i in range(args.remote_only):
+            f.write(json.dumps({"name": "gone/r%07d.dat" % i, "bytes": 1, "hash": "0" * 32}) + "\n")
+    return uploads, args.remote_only
+
+
+def write_config(path, workdir, monitor_dir, port, args, variant_options):
+    opts = {
+        "username": "bench", "apikey": "bench", "region": "LON", "container": "bench",
+        "monitor_dir": monitor_dir,
+        "auth-endpoint": "http://127.0.0.1:%d/v2.0/tokens" % port,
+        "pid_file": os.path.join(workdir, "ccfsyncd.pid"),
+        "logfile": os.path.join(workdir, "ccfsyncd.log"),
+        "use_syslog": "false", "foreground": "true", "use_servicenet": "false",
+        "verbose": "false", "debug": "false",
+    }
+    if args.hash_cache:
+        opts["hash_cache"] = os.path.join(workdir, "hash.cache")
+    for o in args.option + variant_options:
+        k, v = o.split("=", 1)
+        opts[k] = v
+    with open(path, "w") as f:
+        f.write("[main]\n")
+        for k, v in opts.items():
+            f.write("%s=%s\n" % (k, v))
+    return opts["logfile"]
+
+
+def cpu_seconds(pid):
+    """User and system CPU time pid has used so far"""
+    with open("/proc/%d/stat" % pid) as f:
+        # The command name is in brackets and may contain spaces - count fields from after it
+        fields = f.read().rsplit(")", 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+
+def cpu_hz(args):
+    if args.cpu_mhz:
+        return args.cpu_mhz * 1e6
+    try:
+        with open("/proc/cpuinfo") as f:
+            for line in f:
+                if line.startswith("cpu MHz"):
+                    return float(line.split(":")[1]) * 1e6
+    except OSError:
+        pass
+    return None
+
+
+def stats(port):
+    with urllib.request.urlopen("http://127.0.0.1:%d/_stats" % port) as r:
+        return json.loads(r.read())
+
+
+def free_port():
+    with socket.socket() as sock:
+        sock.bind(("127.0.0.1", 0))
+        return sock.getsockname()[1]
+
+
+def wait_for_port(port, timeout=10):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        try:
+            socket.create_connection(("127.0.0.1", port), 0.5).close()
+            return
+        except OSError:
+            time.sleep(0.05)
+    raise RuntimeError("nothing listening on port %d after %ds" % (port, timeout))
+
+
+def start_proxy(args, port, backend_port, workdir):
+    """nghttpx on port, in front of the stand-in, taking h2c and HTTP/1.1 in cleartext"""
+    proxy = subprocess.Popen([args.h2_proxy, "--frontend=127.0.0.1,%d;no-tls" % port,
+                              "--backend=127.0.0.1,%d" % backend_port, "--workers=1",
+                              "--errorlog-file=" + os.path.join(workdir, "proxy.log"),
+                              "--accesslog-file=/dev/null", "--frontend-http2-max-concurrent-streams=1000"],
+                             stdout=subprocess.DEVNULL)
+    wait_for_port(port)
+    return proxy
+
+
+def run_once(variant, n, workdir, monitor_dir, seed_file, expected, args):
+    name, options = variant
+    standin = [sys.executable, os.path.join(HERE, "swift_standin.py"), "--seed", seed_file,
+               "--latency-ms", str(args.latency_ms)]
+    proxy_port = free_port() if args.h2_proxy else None
+    if proxy_port:
+        standin += ["--public-url", "http://127.0.0.1:%d" % proxy_port]
+    server = subprocess.Popen(standin, stdout=subprocess.PIPE, text=True)
+    daemon = proxy = None
+    try:
+        port = int(server.stdout.readline())
+        endpoint_port = port
+        if proxy_port:
+            # The service catalog already points at proxy_port
+            proxy = start_proxy(args, proxy_port, port, workdir)
+            endpoint_port = proxy_port
+        config = os.path.join(workdir, "ccfsyncd.conf")
+        logfile = write_config(config, workdir, monitor_dir, endpoint_port, args, options)
+        if os.path.exists(logfile):
+            os.unlink(logfile)
+
+        start = time.monotonic()
+        daemon = subprocess.Popen([args.daemon, "-c", config], stdout=subprocess.DEVNULL)
+        uploads, deletes = expected
+        drain_ms = None
+        while time.monotonic() - start < args.timeout:
+            if daemon.poll() is not None:
+                raise RuntimeError("ccfsyncd exited with %d - see %s" % (daemon.returncode, logfile))
+            s = stats(port)
+            if s["put"] >= uploads and s["delete"] + s["delete_missing"] >= deletes:
+                drain_ms = int((time.monotonic() - start) * 1000)
+                cpu = cpu_seconds(daemon.pid)
+                break
+            time.sleep(0.05)
+        if drain_ms is None:
+            raise RuntimeError("timed out waiting for %d uploads and %d deletes - see %s" % (uploads, deletes, logfile))
+
+        # Give the daemon a moment to log anything that trails the last request
+        time.sleep(0.2)
+        phases = []
+        with open(logfile, errors="replace") as f:
+            for line in f:
+                m = PHASE_RE.search(line)
+                if m:
+                    phases.append((m.group(1), int(m.group(2))))
+        phases.append(("drain", drain_ms))
+        s = stats(port)
+        s["ops_per_sec"] = round((s["put"] + s["delete"] + s["delete_missing"] + s["copy"]) * 1000.0 / max(drain_ms, 1), 1)
+        s["cpu_ms"] = int(cpu * 1000)
+        s["upload_mb_per_sec"] = round(s["bytes_in"] / 1e6 * 1000.0 / max(drain_ms, 1), 1)
+        hz = cpu_hz(args)
+        if hz and s["bytes_in"]:
+            s["cycles_per_byte"] = round(cpu * hz / s["bytes_in"], 2)
+        return {"variant": name, "run": n, "phases": phases, "stats": s}
+    finally:
+        if daemon is not None and daemon.poll() is None:
+            daemon.send_signal(signal.SIGTERM)
+            try:
+                daemon.wait(30)
+            except subprocess.TimeoutExpired:
+                daemon.kill()
+        for p in (proxy, server):
+            if p is not None:
+                p.terminate()
+                p.wait()
+
+
+def parse_variant(spec):
+    """name:key=val,key=val"""
+    name, _, settings = spec.partition(":")
+    return name, [kv for kv in settings.split(",") if kv]
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__.split("\n")[0], epilog=__doc__.split("\n\n", 1)[1],
+                                formatter_class=argparse.RawDescriptionHelpFormatter)
+    p.add_argument("--daemon", default="src/ccfsyncd", help="ccfsyncd binary")
+    p.add_argument("--files", type=int, default=10000)
+    p.add_argument("--depth", type=int, default=2, help="directory levels")
+    p.add_argument("--fanout", type=int, default=10, help="subdirectories per directory")
+    p.add_argument("--size-mu", type=float, default=8.0, help="log-normal size distribution mu (e^8 ~ 3KB median)")
+    p.add_argument("--size-sigma", type=float, default=1.5)
+    p.add_argument("--min-size", type=int, default=0)
+    p.add_argument("--max-size", type=int, default=64 << 20)
+    p.add_argument("--in-sync", type=float, default=0.9, help="fraction of files already on the remote")
+    p.add_argument("--changed", type=float, default=0.05, help="fraction of files that differ on the remote")
+    p.add_argument("--remote-only", type=int, default=100, help="objects to delete from the remote")
+    p.add_argument("--latency-ms", type=float, default=0, help="latency the stand-in adds to every request")
+    p.add_argument("--hash-cache", action="store_true", help="use a hash cache (kept between runs)")
+    p.add_argument("-o", "--option", action="append", default=[], help="extra config file setting, key=value")
+    p.add_argument("--variant", action="append", type=parse_variant, default=[],
+                   help="name:key=value,... - a configuration to run, on top of -o (repeatable)")
+    p.add_argument("--h2-proxy", metavar="NGHTTPX", help="run this nghttpx binary in front of the stand-in")
+    p.add_argument("--cpu-mhz", type=float, help="clock speed for cycles_per_byte (default: from /proc/cpuinfo)")
+    p.add_argument("--runs", type=int, default=1)
+    p.add_argument("--seed", type=int, default=1)
+    p.add_argument("--timeout", type=float, default=3600)
+    p.add_argument("--keep", action="store_true", help="don't delete the work directory")
+    p.add_argument("--json", action="store_true", help="print results as one JSON document")
+    args = p.parse_args()
+
+    workdir = tempfile.mkdtemp(prefix="ccfsyncd-bench.")
+    try:
+        monitor_dir = os.path.join(workdir, "tree")
+        t = time.monotonic()
+        files = make_tree(monitor_dir, args)
+        seed_file = os.path.join(workdir, "seed.jsonl")
+        expected = write_seed(seed_file, files, args)
+        print("# %d files generated in %.1fs, expecting %d uploads and %d deletes per run" %
+              (len(files), time.monotonic() - t, expected[0], expected[1]), file=sys.stderr)
+
+        results = []
+        for variant in args.variant or [("default", [])]:
+            for n in range(args.runs):
+                r = run_once(variant, n, workdir, monitor_dir, seed_file, expected, args)
+                results.append(r)
+                if not args.json:
+                    prefix = "bench variant=%s run=%d" % (variant[0], n)
+                    for name, ms in r["phases"]:
+                        print("%s name=%s elapsed_ms=%d" % (prefix, name, ms))
+                    print("%s stats %s" % (prefix, " ".join("%s=%s" % kv for kv in sorted(r["stats"].items()))))
+                    sys.stdout.flush()
+                # Later runs of a variant shouldn't find the hash cache left by another one
+                if args.hash_cache and args.variant and n == args.runs - 1:
+                    try:
+                        os.unlink(os.path.join(workdir, "hash.cache"))
+                    except FileNotFoundError:
+                        pass
+        if args.json:
+            json.dump({"files": len(files), "expected_uploads": expected[0], "expected_deletes": expected[1],
+                       "args": {k: v for k, v in vars(args).items()}, "runs": results}, sys.stdout, indent=1)
+            print()
+    finally:
+        if args.keep:
+            print("# work directory kept: %s" % workdir, file=sys.stderr)
+        else:
+            shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,402 @@
+#!/usr/bin/env python3
+"""Minimal local stand-in for the bits of Rackspace identity and Cloud Files (Swift) that ccfsyncd talks to.
+
+Implements:
+  POST /v2.0/tokens                       - identity v2 token + service catalog
+  GET  /info                              - cluster capabilities (just bulk_delete)
+  GET  /v1/<account>/<container>          - JSON listing with marker, end_marker, prefix and limit (default 10000)
+  POST /v1/<account>?bulk-delete          - bulk delete middleware, JSON responses only
+  PUT  /v1/<account>/<container>/<object>?multipart-manifest=put
+                                          - static large object manifests, checked against their segments
+  DELETE /v1/<account>/<container>/<object>?multipart-manifest=delete
+                                          - an SLO and its segments, answered like a bulk delete
+  PUT/DELETE/COPY /v1/<account>/<container>/<object>
+  GET  /_stats                            - request counters, as JSON (not part of Swift)
+
+Objects only exist in memory: PUT bodies are read and MD5ed, then thrown away. Every container but *_segments
+shares one namespace, which is what gets listed; segments are kept apart. The container can be seeded from
+a JSON lines file of {"name", "bytes", "hash"} objects. The first line written to stdout is the port the server
+is listening on, so callers can pass --port 0.
+"""
+
+import argparse
+import bisect
+import hashlib
+import json
+import sys
+import threading
+import time
+import urllib.parse
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+LISTING_LIMIT = 10000
+BULK_DELETE_MAX = 10000
+
+
+class Store:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.objects = {}
+        self.names = []
+        self.segments = {}
+        # SLO name -> its segments' paths
+        self.manifests = {}
+        self.stats = {"auth": 0, "listing": 0, "put": 0, "delete": 0, "delete_missing": 0, "copy": 0, "bulk_delete": 0,
+                      "segment_put": 0, "segment_delete": 0, "manifest_put": 0, "manifest_delete": 0, "etag_mismatch": 0,
+                      "bytes_in": 0, "connections": 0, "unauthorised": 0}
+
+    def seed(self, path):
+        with open(path) as f:
+            for line in f:
+                o = json.loads(line)
+                self.objects[o["name"]] = (o["bytes"], o["hash"], o.get("content_type", "application/octet-stream"))
+        self.names = sorted(self.objects)
+
+    def put(self, name, size, md5, content_type, segments=None):
+        with self.lock:
+            if name not in self.objects:
+                bisect.insort(self.names, name)
+            self.objects[name] = (size, md5, content_type)
+            if segments is None:
+                self.manifests.pop(name, None)
+            else:
+                self.manifests[name] = segments
+
+    def put_segment(self, container, name, size, md5):
+        with self.lock:
+            self.segments["%s/%s" % (container, name)] = (size, md5)
+
+    def get_segment(self, path):
+        with self.lock:
+            return self.segments.get(path.lstrip("/"))
+
+    def delete_segment(self, container, name):
+        with self.lock:
+            return self.segments.pop("%s/%s" % (container, name), None) is not None
+
+    def segment_listing(self, container, prefix, marker, limit):
+        with self.lock:
+            start = "%s/%s" % (container, prefix or "")
+            names = sorted(k[len(container) + 1:] for k in self.segments if k.startswith(start))
+            names = [n for n in names if not marker or n > marker][:limit]
+            return [{"name": n, "bytes": self.segments["%s/%s" % (container, n)][0],
+                     "hash": self.segments["%s/%s" % (container, n)][1]} for n in names]
+
+    def delete(self, name):
+        with self.lock:
+            if name not in self.objects:
+                return False
+            del self.objects[name]
+            del self.names[bisect.bisect_left(self.names, name)]
+            self.manifests.pop(name, None)
+            return True
+
+    def delete_manifest(self, name):
+        """Deletes an SLO and its segments. Returns how many of those went, or None if name isn't an SLO"""
+        with self.lock:
+            segments = self.manifests.get(name)
+            if segments is None:
+                return None
+            deleted = sum(1 for path in segments if self.segments.pop(path.lstrip("/"), None) is not None)
+        return deleted + (1 if self.delete(name) else 0)
+
+    def get(self, name):
+        with self.lock:
+            return self.objects.get(name)
+
+    def listing(self, marker, end_marker, limit):
+        with self.lock:
+            i = bisect.bisect_right(self.names, marker) if marker else 0
+            out = []
+            while i < len(self.names) and len(out) < limit:
+                name = self.names[i]
+                if end_marker and name >= end_marker:
+                    break
+                size, md5, content_type = self.objects[name]
+                out.append({"name": name, "bytes": size, "hash": md5, "content_type": content_type,
+                            "last_modified": "2014-01-01T00:00:00.000000"})
+                i += 1
+            return out
+
+    def count(self, key, n=1):
+        with self.lock:
+            self.stats[key] += n
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    server_version = "swift-standin"
+
+    def setup(self):
+        super().setup()
+        self.server.store.count("connections")
+
+    def log_message(self, fmt, *args):
+        if self.server.verbose:
+            super().log_message(fmt, *args)
+
+    def reply(self, code, body=b"", headers=None):
+        self.send_response(code)
+        for k, v in (headers or {}).items():
+            self.send_header(k, v)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        if body and self.command != "HEAD":
+            self.wfile.write(body)
+
+    def read_body(self):
+        length = int(self.headers.get("Content-Length") or 0)
+        md5 = hashlib.md5()
+        while length > 0:
+            chunk = self.rfile.read(min(length, 1 << 20))
+            if not chunk:
+                break
+            md5.update(chunk)
+            length -= len(chunk)
+        return md5
+
+    def delay(self):
+        if self.server.latency:
+            time.sleep(self.server.latency)
+
+    def split_path(self):
+        """Returns (container, object) for /v1/<account>/<container>[/<object>], or None"""
+        url = urllib.parse.urlsplit(self.path)
+        parts = url.path.split("/", 4)
+        if len(parts) < 4 or parts[1] != "v1":
+            return None
+        obj = urllib.parse.unquote(parts[4]) if len(parts) > 4 else None
+        return urllib.parse.unquote(parts[3]), obj, urllib.parse.parse_qs(url.query)
+
+    def authorised(self):
+        token = self.headers.get("X-Auth-Token")
+        if token is not None and self.server.token_valid(token):
+            return True
+        self.server.store.count("unauthorised")
+        self.reply(401)
+        return False
+
+    def do_POST(self):
+        self.delay()
+        if self.path.rstrip("/").endswith("/tokens"):
+            self.read_body()
+            self.server.store.count("auth")
+            base = (self.server.public_url or "http://%s:%d" % self.server.server_address[:2]) + "/v1/AUTH_bench"
+            body = {"access": {
+                "token": {"id": self.server.new_token()},
+                "serviceCatalog": [{"name": "cloudFiles", "type": "object-store", "endpoints": [
+                    {"region": "LON", "publicURL": base, "internalURL": base}]}]}}
+            return self.reply(200, json.dumps(body).encode(), {"Content-Type": "application/json"})
+        url = urllib.parse.urlsplit(self.path)
+        if url.query == "bulk-delete" and self.server.bulk_delete and url.path.startswith("/v1/"):
+            return self.bulk_delete()
+        self.read_body()
+        self.reply(404)
+
+    def bulk_delete(self):
+        length = int(self.headers.get("Content-Length") or 0)
+        body = self.rfile.read(length).decode()
+        if not self.authorised():
+            return
+        paths = [line for line in body.split("\n") if line.strip()]
+        if len(paths) > BULK_DELETE_MAX:
+            result = {"Response Status": "413 Request Entity Too Large", "Errors": [], "Number Deleted": 0,
+                      "Number Not Found": 0, "Response Body": "Max delete failures exceeded"}
+        else:
+            deleted = not_found = 0
+            errors = []
+            for quoted in paths:
+                path = urllib.parse.unquote(quoted.strip()).lstrip("/")
+                container, _, obj = path.partition("/")
+                if not obj:
+                    errors.append([quoted, "400 Bad Request"])
+                elif self.server.store.delete(obj):
+                    deleted += 1
+                else:
+                    not_found += 1
+            self.server.store.count("bulk_delete")
+            self.server.store.count("delete", deleted)
+            self.server.store.count("delete_missing", not_found)
+            result = {"Response Status": "400 Bad Request" if errors else "200 OK", "Errors": errors,
+                      "Number Deleted": deleted, "Number Not Found": not_found, "Response Body": ""}
+        self.reply(200, json.dumps(result).encode(), {"Content-Type": "application/json"})
+
+    def do_GET(self):
+        self.delay()
+        if self.path == "/_stats":
+            with self.server.store.lock:
+                body = dict(self.server.store.stats, objects=len(self.server.store.names))
+            return self.reply(200, json.dumps(body).encode(), {"Content-Type": "application/json"})
+        if self.path == "/info":
+            info = {"swift": {"version": "standin"}}
+            if self.server.bulk_delete:
+                info["bulk_delete"] = {"max_deletes_per_request": BULK_DELETE_MAX, "max_failed_deletes": 1000}
+            return self.reply(200, json.dumps(info).encode(), {"Content-Type": "application/json"})
+        parsed = self.split_path()
+        if parsed is None:
+            return self.reply(404)
+        if not self.authorised():
+            return
+        container, obj, query = parsed
+        if obj:
+            return self.reply(405)
+        first = lambda k: query.get(k, [None])[0]
+        limit = min(int(first("limit") or LISTING_LIMIT), LISTING_LIMIT)
+        self.server.store.count("listing")
+        if container.endswith("_segments"):
+            listing = self.server.store.segment_listing(container, first("prefix"), first("marker"), limit)
+        else:
+            listing = self.server.store.listing(first("marker"), first("end_marker"), limit)
+        self.reply(200, json.dumps(listing).encode(), {"Content-Type": "application/json; charset=utf-8"})
+
+    def do_PUT(self):
+        self.delay()
+        parsed = self.split_path()
+        if parsed is None or not parsed[1]:
+            self.read_body()
+            return self.reply(404 if parsed is None else 201)
+        if not self.authorised():
+            return
+        container, obj, query = parsed
+        if query.get("multipart-manifest") == ["put"]:
+            return self.put_manifest(obj)
+        md5 = self.read_body()
+        size = int(self.headers.get("Content-Length") or 0)
+        self.server.store.count("bytes_in", size)
+        expected = self.headers.get("ETag")
+        if expected is not None and expected.strip('"').lower() != md5.hexdigest():
+            self.server.store.count("etag_mismatch")
+            return self.reply(422)
+        if container.endswith("_segments"):
+            self.server.store.put_segment(container, obj, size, md5.hexdigest())
+            self.server.store.count("segment_put")
+        else:
+            self.server.store.put(obj, size, md5.hexdigest(), self.headers.get("Content-Type", "application/octet-stream"))
+            self.server.store.count("put")
+        self.reply(201, headers={"Etag": md5.hexdigest()})
+
+    def put_manifest(self, obj):
+        length = int(self.headers.get("Content-Length") or 0)
+        try:
+            manifest = json.loads(self.rfile.read(length))
+        except ValueError:
+            return self.reply(400, b"Manifest must be valid JSON.\n")
+        etags = []
+        paths = []
+        size = 0
+        for seg in manifest:
+            found = self.server.store.get_segment(seg.get("path", ""))
+            if found is None or found[0] != seg.get("size_bytes") or found[1] != seg.get("etag"):
+                return self.reply(400, ("Errors:\n%s, Etag or size mismatch\n" % seg.get("path")).encode())
+            etags.append(found[1])
+            paths.append(seg["path"])
+            size += found[0]
+        # Like Swift, an SLO's ETag is the MD5 of its segments' ETags
+        etag = hashlib.md5("".join(etags).encode()).hexdigest()
+        self.server.store.put(obj, size, etag, self.headers.get("Content-Type") or "application/octet-stream", paths)
+        self.server.store.count("manifest_put")
+        self.reply(201, headers={"Etag": '"%s"' % etag})
+
+    def do_DELETE(self):
+        self.delay()
+        parsed = self.split_path()
+        if parsed is None or not parsed[1]:
+            return self.reply(404)
+        if not self.authorised():
+            return
+        container, obj, query = parsed
+        if container.endswith("_segments"):
+            if self.server.store.delete_segment(container, obj):
+                self.server.store.count("segment_delete")
+                return self.reply(204)
+            return self.reply(404)
+        if query.get("multipart-manifest") == ["delete"]:
+            return self.delete_manifest(container, obj)
+        if self.server.store.delete(obj):
+            self.server.store.count("delete")
+            return self.reply(204)
+        self.server.store.count("delete_missing")
+        self.reply(404)
+
+    def delete_manifest(self, container, obj):
+        # Like Swift, the outcome is in the body - and anything but an SLO is refused
+        deleted = self.server.store.delete_manifest(obj)
+        if deleted is None:
+            error = "404 Not Found" if self.server.store.get(obj) is None else "Not an SLO manifest"
+            result = {"Response Status": "400 Bad Request", "Errors": [["/%s/%s" % (container, obj), error]],
+                      "Number Deleted": 0, "Number Not Found": 0, "Response Body": ""}
+        else:
+            self.server.store.count("manifest_delete")
+            result = {"Response Status": "200 OK", "Errors": [], "Number Deleted": deleted, "Number Not Found": 0,
+                      "Response Body": ""}
+        self.reply(200, json.dumps(result).encode(), {"Content-Type": "application/json"})
+
+    def do_COPY(self):
+        self.delay()
+        parsed = self.split_path()
+        if parsed is None or not parsed[1]:
+            return self.reply(404)
+        if not self.authorised():
+            return
+        src = self.server.store.get(parsed[1])
+        dest = self.headers.get("Destination", "")
+        if src is None or "/" not in dest:
+            return self.reply(404)
+        self.server.store.put(urllib.parse.unquote(dest.split("/", 1)[1]), *src)
+        self.server.store.count("copy")
+        self.reply(201)
+
+
+class StandinServer(ThreadingHTTPServer):
+    daemon_threads = True
+
+    def __init__(self, addr, store, latency, token_ttl, verbose, public_url=None):
+        super().__init__(addr, Handler)
+        self.public_url = public_url
+        self.bulk_delete = True
+        self.store = store
+        self.latency = latency
+        self.token_ttl = token_ttl
+        self.verbose = verbose
+        self.tokens = {}
+        self.token_lock = threading.Lock()
+
+    def new_token(self):
+        with self.token_lock:
+            token = "tk%d" % len(self.tokens)
+            self.tokens[token] = time.monotonic()
+            return token
+
+    def token_valid(self, token):
+        with self.token_lock:
+            issued = self.tokens.get(token)
+        return issued is not None and (not self.token_ttl or time.monotonic() - issued < self.token_ttl)
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    p.add_argument("--port", type=int, default=0)
+    p.add_argument("--bind", default="127.0.0.1")
+    p.add_argument("--seed", help="JSON lines file of objects to start the container with")
+    p.add_argument("--latency-ms", type=float, default=0, help="delay added to every request, to mimic a WAN")
+    p.add_argument("--token-ttl", type=float, default=0, help="seconds before tokens expire (0: never)")
+    p.add_argument("--public-url", help="scheme://host:port to put in the service catalog, e.g. a proxy in front of us")
+    p.add_argument("--no-bulk-delete", action="store_true", help="act like a cluster without bulk delete")
+    p.add_argument("--verbose", action="store_true")
+    args = p.parse_args()
+
+    store = Store()
+    if args.seed:
+        store.seed(args.seed)
+    server = StandinServer((args.bind, args.port), store, args.latency_ms / 1000.0, args.token_ttl, args.verbose,
+                            args.public_url)
+    server.bulk_delete = not args.no_bulk_delete
+    print(server.server_address[1], flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    sys.exit(main())
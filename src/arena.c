@@ -0,0 +1,84 @@
+#include "ccfsync.h"
+
+/* A bump allocator for records that live and die together, like the objects of a container listing.
+ * Allocations are carved out of large blocks with no per-allocation header, and everything is released at once
+ * by arena_free(). An arena is not thread safe - give each thread its own, and arena_merge() them afterwards.
+ */
+
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+#define ARENA_ALIGN 8
+
+struct arena {
+  /* Most recently allocated block first */
+  GSList *blocks;
+  gchar *next;
+  gsize left;
+  gsize size;
+};
+
+struct arena *
+arena_new ()
+{
+  struct arena *arena = malloc (sizeof (struct arena));
+  arena->blocks = NULL;
+  arena->next = NULL;
+  arena->left = 0;
+  arena->size = 0;
+  return arena;
+}
+
+gpointer
+arena_alloc (struct arena *arena, gsize size)
+{
+  gpointer p;
+
+  size = (size + ARENA_ALIGN - 1) & ~(gsize) (ARENA_ALIGN - 1);
+  if (size > arena->left) {
+    /* Anything too big to share a block gets one of its own */
+    gsize block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    gchar *block = malloc (block_size);
+    if (block == NULL)
+      suicide ("Failed to allocate %lu bytes for listing records", (unsigned long) block_size);
+    arena->blocks = g_slist_prepend (arena->blocks, block);
+    arena->next = block;
+    arena->left = block_size;
+    arena->size += block_size;
+  }
+
+  p = arena->next;
+  arena->next += size;
+  arena->left -= size;
+  return p;
+}
+
+/* Moves all of src's memory into dst, and frees src. Whatever was left of src's current block is wasted */
+void
+arena_merge (struct arena *dst, struct arena *src)
+{
+  /* Keep dst's current block at the head, so it carries on filling it */
+  if (dst->blocks == NULL) {
+    dst->blocks = src->blocks;
+    dst->next = src->next;
+    dst->left = src->left;
+  }
+  else
+    dst->blocks->next = g_slist_concat (dst->blocks->next, src->blocks);
+  dst->size += src->size;
+  free_single_pointer (src);
+}
+
+/* Bytes held by the arena */
+gsize
+arena_size (struct arena *arena)
+{
+  return arena->size;
+}
+
+void
+arena_free (struct arena *arena)
+{
+  if (arena == NULL)
+    return;
+  g_slist_free_full (arena->blocks, free_single_pointer);
+  free_single_pointer (arena);
+}
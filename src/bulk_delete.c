@@ -0,0 +1,245 @@
+#include "ccfsync.h"
+
+/* Deletes objects in batches through Swift's bulk delete middleware (POST <account>?bulk-delete, with one
+ * /container/object per line), rather than one DELETE each. Whoever consumes files_to_delete takes one record as
+ * usual, then gathers whatever else turns up within BULK_DELETE_LINGER, up to the cluster's per-request limit.
+ * Anything the cluster reports as failed is handed back to be deleted (and retried) on its own.
+ *
+ * Whether the cluster supports it, and the limit, comes from its /info. Without bulk delete, or with
+ * bulk_delete=false, every object gets its own DELETE.
+ */
+
+/* How long to wait for more deletions to turn up before sending a batch */
+#define BULK_DELETE_LINGER (100 * 1000)
+
+/* Objects per request - 0 if we're not using bulk delete */
+static int bulk_delete_max = 0;
+
+/* Asks the cluster whether it has bulk delete, and how many objects it takes per request */
+void
+bulk_delete_init ()
+{
+  CURL *curl;
+  CURLcode res;
+  long http_code = 0;
+  struct string resp;
+  gchar *info_url, *v1;
+  json_t *root, *bulk, *max;
+  json_error_t error;
+
+  if (!cfg->bulk_delete)
+    return;
+
+  /* /info lives at the root of the cluster, next to /v1/<account> */
+  info_url = g_strdup (auth->endpoint);
+  if ((v1 = strstr (info_url, "/v1/")) != NULL)
+    *v1 = '\0';
+  v1 = info_url;
+  info_url = g_strconcat (v1, "/info", NULL);
+  free_single_pointer (v1);
+
+  if ((curl = curl_easy_init ()) == NULL) {
+    log_msg (LOG_ERR, "Failed to initialise curl!");
+    free_single_pointer (info_url);
+    return;
+  }
+
+  init_string (&resp);
+  shared_curl_attach (curl);
+  curl_easy_setopt (curl, CURLOPT_URL, info_url);
+  curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, write_data);
+  curl_easy_setopt (curl, CURLOPT_WRITEDATA, &resp);
+  res = curl_easy_perform (curl);
+  curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &http_code);
+  shared_curl_count (curl);
+  curl_easy_cleanup (curl);
+
+  if (res != CURLE_OK || http_code != 200)
+    log_msg (LOG_WARNING, "Failed to get cluster capabilities from %s (%s, HTTP %ld) - deleting objects one at a time", info_url,
+	     curl_easy_strerror (res), http_code);
+  else if ((root = json_loads (resp.data, 0, &error)) == NULL)
+    log_msg (LOG_WARNING, "Malformed cluster capabilities from %s: %s - deleting objects one at a time", info_url, error.text);
+  else {
+    bulk = json_object_get (root, "bulk_delete");
+    max = bulk != NULL ? json_object_get (bulk, "max_deletes_per_request") : NULL;
+    if (bulk == NULL)
+      log_msg (LOG_INFO, "Cluster doesn't support bulk delete - deleting objects one at a time");
+    else {
+      bulk_delete_max = json_is_integer (max) ? (int) json_integer_value (max) : 10000;
+      if (cfg->bulk_delete_max > 0 && cfg->bulk_delete_max < bulk_delete_max)
+	bulk_delete_max = cfg->bulk_delete_max;
+      log_msg (LOG_INFO, "Deleting objects in batches of up to %d", bulk_delete_max);
+    }
+    json_decref (root);
+  }
+
+  free_single_pointer (resp.data);
+  free_single_pointer (info_url);
+}
+
+int
+bulk_delete_enabled ()
+{
+  return bulk_delete_max > 1;
+}
+
+static gpointer
+queue_pop_until (GAsyncQueue * queue, gint64 deadline)
+{
+  gint64 left = deadline - g_get_monotonic_time ();
+
+  if (left <= 0)
+    return g_async_queue_try_pop (queue);
+#if GLIB_CHECK_VERSION(2, 31, 18)
+  return g_async_queue_timeout_pop (queue, left);
+#else
+  GTimeVal end;
+  g_get_current_time (&end);
+  g_time_val_add (&end, left);
+  return g_async_queue_timed_pop (queue, &end);
+#endif
+}
+
+/* Starts a batch with first (already popped off queue), and adds whatever else turns up on queue shortly after.
+ * Stops early at an exit record, or at an SLO (which has to be deleted on its own, to take its segments with it).
+ * That's returned (and not added), for the caller to deal with once the batch is. Returns NULL otherwise
+ */
+cf_file *
+bulk_delete_collect (GAsyncQueue * queue, cf_file * first, GPtrArray * batch)
+{
+  gint64 deadline = g_get_monotonic_time () + BULK_DELETE_LINGER;
+  cf_file *cf;
+
+  g_ptr_array_add (batch, first);
+  while (batch->len < (guint) bulk_delete_max && (cf = queue_pop_until (queue, deadline)) != NULL) {
+    if (cf->type == RECORD_EXIT)
+      return cf;
+    upload_forget (cf->name);
+    if (slo_known (cf->name))
+      return cf;
+    g_ptr_array_add (batch, cf);
+  }
+  return NULL;
+}
+
+/* The path of an object as the middleware wants it: /container/object, URL encoded */
+static gchar *
+bulk_delete_path (const gchar * name)
+{
+  gchar *container = g_uri_escape_string (cfg->container, NULL, FALSE);
+  gchar *object = g_uri_escape_string (name, "/", FALSE);
+  gchar *path = g_strconcat ("/", container, "/", object, NULL);
+
+  free_single_pointer (container);
+  free_single_pointer (object);
+  return path;
+}
+
+/* Builds the request body for a batch */
+gchar *
+bulk_delete_body (GPtrArray * batch)
+{
+  GString *body = g_string_new (NULL);
+  guint i;
+
+  for (i = 0; i < batch->len; i++) {
+    gchar *path = bulk_delete_path (((cf_file *) g_ptr_array_index (batch, i))->name);
+    g_string_append (body, path);
+    g_string_append_c (body, '\n');
+    free_single_pointer (path);
+  }
+  return g_string_free (body, FALSE);
+}
+
+/* Sets curl up to send a batch. body (from bulk_delete_body()), *url, *headers and resp must outlive the request */
+void
+bulk_delete_request_setup (CURL * curl, struct curl_slist **headers, gchar ** url, const gchar * token_header, const gchar * body,
+			   struct string *resp)
+{
+  *url = g_strconcat (auth->endpoint, "?bulk-delete", NULL);
+  *headers = curl_slist_append (NULL, token_header);
+  *headers = curl_slist_append (*headers, "Content-Type: text/plain");
+  *headers = curl_slist_append (*headers, "Accept: application/json");
+  curl_easy_setopt (curl, CURLOPT_HTTPHEADER, *headers);
+  curl_easy_setopt (curl, CURLOPT_URL, *url);
+  curl_easy_setopt (curl, CURLOPT_POST, 1L);
+  curl_easy_setopt (curl, CURLOPT_POSTFIELDS, body);
+  curl_easy_setopt (curl, CURLOPT_POSTFIELDSIZE, (long) strlen (body));
+  curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, write_data);
+  curl_easy_setopt (curl, CURLOPT_WRITEDATA, resp);
+}
+
+/* Works out from the response what happened to each object in batch. Deleted (and already gone) objects are
+ * destroyed, ones the cluster couldn't delete are moved to failed. Returns BULK_DELETE_DONE, or
+ * BULK_DELETE_AUTH/BULK_DELETE_RETRY if the request as a whole failed - batch is left alone then
+ */
+int
+bulk_delete_finish (GPtrArray * batch, long http_code, struct string *resp, GPtrArray * failed)
+{
+  json_t *root, *status, *errors, *entry;
+  json_error_t error;
+  GHashTable *failed_paths;
+  const char *status_str = NULL;
+  guint i;
+
+  if (http_code == 401)
+    return BULK_DELETE_AUTH;
+  if (http_code != 200) {
+    log_msg (LOG_WARNING, "Bulk delete of %u objects failed: HTTP %ld", batch->len, http_code);
+    return BULK_DELETE_RETRY;
+  }
+
+  /* The middleware answers 200 straight away and keeps the connection alive while it works, so the real outcome
+   * is in the body
+   */
+  if (resp->data == NULL || (root = json_loads (resp->data, 0, &error)) == NULL) {
+    log_msg (LOG_WARNING, "Malformed bulk delete response for %u objects", batch->len);
+    return BULK_DELETE_RETRY;
+  }
+  status = json_object_get (root, "Response Status");
+  if (json_is_string (status))
+    status_str = json_string_value (status);
+  errors = json_object_get (root, "Errors");
+  if (status_str != NULL && strncmp (status_str, "401", 3) == 0) {
+    json_decref (root);
+    return BULK_DELETE_AUTH;
+  }
+  /* With per-object failures the status is an error too, but the rest of the batch went. Without any, an error
+   * status means the whole request was rejected
+   */
+  if ((!json_is_array (errors) || json_array_size (errors) == 0) && (status_str == NULL || status_str[0] != '2')) {
+    log_msg (LOG_WARNING, "Bulk delete of %u objects failed: %s", batch->len, status_str != NULL ? status_str : "no status");
+    json_decref (root);
+    return BULK_DELETE_RETRY;
+  }
+
+  failed_paths = g_hash_table_new (g_str_hash, g_str_equal);
+  errors = json_object_get (root, "Errors");
+  for (i = 0; json_is_array (errors) && i < json_array_size (errors); i++) {
+    entry = json_array_get (errors, i);
+    if (json_is_array (entry) && json_is_string (json_array_get (entry, 0))) {
+      log_msg (LOG_DEBUG, "Bulk delete: failed to delete %s: %s", json_string_value (json_array_get (entry, 0)),
+	       json_is_string (json_array_get (entry, 1)) ? json_string_value (json_array_get (entry, 1)) : "unknown error");
+      g_hash_table_insert (failed_paths, (gpointer) json_string_value (json_array_get (entry, 0)), NULL);
+    }
+  }
+
+  for (i = 0; i < batch->len; i++) {
+    cf_file *cf = g_ptr_array_index (batch, i);
+    /* Errors has the paths URL encoded, but check the plain path too to be safe */
+    gchar *path = g_strconcat ("/", cfg->container, "/", cf->name, NULL);
+    gchar *escaped = bulk_delete_path (cf->name);
+    if (g_hash_table_lookup_extended (failed_paths, path, NULL, NULL) || g_hash_table_lookup_extended (failed_paths, escaped, NULL, NULL))
+      g_ptr_array_add (failed, cf);
+    else
+      destroy_cf_file (cf, NULL);
+    free_single_pointer (path);
+    free_single_pointer (escaped);
+  }
+
+  log_msg (LOG_DEBUG, "Bulk delete: %u of %u objects deleted", batch->len - failed->len, batch->len);
+  g_ptr_array_set_size (batch, 0);
+  g_hash_table_destroy (failed_paths);
+  json_decref (root);
+  return BULK_DELETE_DONE;
+}
@@ -16,6 +16,7 @@
 #include <curl/curl.h>
 #include <glib/gqueue.h>
 #include <jansson.h>
+#include <openssl/md5.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -29,6 +30,37 @@
 /* Maximum number of threads PER thread-type. */ 
 #define MAX_THREADS 10
 
+/* Number of objects CF returns per listing request */
+#define CF_LISTING_LIMIT 10000
+
+/* How the initial sync works out what to upload and delete */
+#define RECONCILE_HASH 0
+#define RECONCILE_MERGE 1
+#define TRANSFER_THREADS 0
+#define TRANSFER_MULTI 1
+/* Where filesystem events come from */
+#define MONITOR_INOTIFY 0
+#define MONITOR_FANOTIFY 1
+#define HTTP_VERSION_DEFAULT 0
+#define HTTP_VERSION_1_1 1
+#define HTTP_VERSION_2 2
+#define HTTP_VERSION_2_PRIOR_KNOWLEDGE 3
+/* bulk_delete_finish() results */
+#define BULK_DELETE_DONE 0
+#define BULK_DELETE_AUTH 1
+#define BULK_DELETE_RETRY 2
+/* retry_classify()/retry_decide() results */
+#define RETRY_DONE 0
+#define RETRY_AGAIN 1
+#define RETRY_REAUTH 2
+#define RETRY_FATAL 3
+/* Rate limit buckets */
+#define RATE_BYTES 0
+#define RATE_PUT 1
+#define RATE_DELETE 2
+#define RATE_COPY 3
+#define RATE_BUCKETS 4
+
 #define LOG_MEMDEBUG LOG_DEBUG+1
 struct string {
   size_t len;
@@ -42,33 +74,69 @@ struct auth {
   gchar *auth_msg;
 };
 
+/* What a record handed to a worker thread is for. RECORD_EXIT asks the thread to exit. Only used for internal purposes */
+enum record_type {
+  RECORD_FILE = 0,
+  RECORD_EXIT
+};
+
+/* An object on CloudFiles. Listings can run to millions of these, so they're kept small: the name is stored inline,
+ * the ETag as a binary MD5, content types are interned, and records from a listing are allocated from an arena
+ * (see arena.c) and freed in bulk. The local path is just monitor_dir + "/" + name, so it isn't stored.
+ */
 struct cf_file {
-  size_t len;
-  gchar *name;
-  gchar *content_type;
-  gchar *hash;
-  gchar *local_path;
-  /* When a struct where sentinel has the value 'exit', the delete thread will exit. Only used for internal purposes */ 
-  gchar *sentinel;
-  size_t size;
-  time_t last_modified;
+  guint64 len;
+  /* Interned with g_intern_string() - never free()d */
+  const gchar *content_type;
+  unsigned char md5[MD5_DIGEST_LENGTH];
+  /* FALSE if the ETag isn't a plain MD5 (or we don't know it) */
+  unsigned char has_hash;
+  /* enum record_type */
+  unsigned char type;
+  /* Set when the record lives in an arena, in which case destroy_cf_file() leaves it alone */
+  unsigned char in_arena;
+  /* Failed attempts at deleting it so far */
+  unsigned char attempts;
+  gchar name[];
 };
 
 typedef struct cf_file cf_file;
 
+/* The parts of a stat() we keep for a local file - enough to tell whether it's changed since */
+struct file_version {
+  guint64 dev;
+  guint64 ino;
+  guint64 size;
+  guint64 mtime_ns;
+  guint64 ctime_ns;
+};
+
 struct local_file {
-  gchar *name;
   /* Corresponding name on CloudFiles to handle
-  * things like /dir/anotherdir/file */
-  gchar *cf_name;
-  gchar *hash;
-  /* When a struct where sentinel has the value 'exit', the upload thread will exit. Only used for internal purposes */ 
-  gchar *sentinel;
-  struct stat *st;
+  * things like /dir/anotherdir/file. Points into name */
+  const gchar *cf_name;
+  struct file_version ver;
+  unsigned char md5[MD5_DIGEST_LENGTH];
+  unsigned char has_hash;
+  /* enum record_type */
+  unsigned char type;
+  /* Failed attempts at uploading it so far */
+  unsigned char attempts;
+  /* Full local path */
+  gchar name[];
 };
 
 typedef struct local_file local_file;
 
+/* An upload in progress - the file being sent, the MD5 of what's been sent so far, and the ETag CF answered with */
+struct upload_source {
+  int fd;
+  /* Where in the file the next read starts */
+  off_t offset;
+  MD5_CTX md5;
+  char etag[MD5_DIGEST_LENGTH * 2 + 1];
+};
+
 struct thread_data {
     int thread_id;
     gchar *dummy_ptr;
@@ -84,14 +152,31 @@ struct exclusions {
 struct cf_file_copy {
   gchar *old_name;
   gchar *new_name;
-  gchar *sentinel;
+  /* enum record_type */
+  int type;
+  /* Failed attempts at copying it so far */
+  unsigned char attempts;
   cf_file *cf_file;
 };
 
 
+/* Handed to the filesystem monitor thread. Set up by init_monitor() before the initial sync starts */
+struct monitor_dir_data {
+  struct exclusions *exclusions;
+  int fd;
+  int monitor_events;
+  /* dir <-> watch descriptor. NULL with fanotify, which has no watches */
+  struct watch_index *watches;
+  /* With fanotify: monitor_dir, for open_by_handle_at() */
+  int mount_fd;
+};
+
 struct move_event
 {
   unsigned int cookie;
+  int is_dir;
+  /* g_get_monotonic_time() by which its IN_MOVED_TO should have turned up */
+  gint64 expires;
   gchar *event_name;
   gchar *cf_name;
   gchar *full_local_path;
@@ -101,7 +186,7 @@ struct move_thread_data {
   struct move_event *me;
   int fd;
   int events_mask;
-  GHashTable *watches;
+  struct watch_index *watches;
   gchar *tmp_path;
   gchar *cf_tmp_path;
   struct monitor_dir_data *md;
@@ -121,9 +206,52 @@ struct config {
   gchar *config_file;
   gchar *exclusion_file;
   gchar *pid_file;
+  /* Where to persist file fingerprints between runs. NULL disables the cache */
+  gchar *hash_cache_file;
   int num_upload_threads;
   int num_delete_threads;
   int num_copy_threads;
+  int num_hash_threads;
+  /* Number of ranges of the container to list concurrently at startup */
+  int listing_partitions;
+  /* RECONCILE_HASH or RECONCILE_MERGE */
+  int reconcile_mode;
+  /* TRANSFER_THREADS or TRANSFER_MULTI */
+  int transfer_engine;
+  /* MONITOR_INOTIFY or MONITOR_FANOTIFY */
+  int monitor_backend;
+  /* Most requests the multi engine will have going at once */
+  int max_inflight;
+  /* HTTP_VERSION_* to ask for on object requests */
+  int http_version;
+  /* Most HTTP/2 streams the multi engine will open on one connection */
+  int http2_max_streams;
+  /* Whether to delete objects through the bulk delete middleware, when the cluster has it */
+  int bulk_delete;
+  /* Most objects per bulk delete request (0: as many as the cluster allows) */
+  int bulk_delete_max;
+  /* Files bigger than this (in bytes) are uploaded as Static Large Objects. 0 disables it */
+  gint64 slo_threshold;
+  /* Size of each SLO segment, in bytes */
+  gint64 slo_segment_size;
+  /* Segments of one file uploaded at once */
+  int slo_segment_threads;
+  /* Most attempts at any one request before giving up on it */
+  int retry_attempts;
+  /* Longest to wait between attempts, in seconds */
+  int retry_max_delay;
+  /* Indexed by RATE_*: bytes/sec uploaded, then PUTs, objects deleted and COPYs per second. 0 for no limit */
+  gint64 rate_limits[RATE_BUCKETS];
+  /* Size of curl's upload buffer, which is what each read from a file being uploaded fills */
+  long upload_buffer_size;
+  /* How long a path has to be left alone before a change to it is acted upon, in milliseconds */
+  int coalesce_quiet_period;
+  /* Longest a change is held back for, however busy the path is, in milliseconds */
+  int coalesce_max_delay;
+  /* Upload files once they've been closed after writing, rather than whenever they're written to */
+  int write_settle;
+  /* How long a file that's still open has to go without being written to before it's uploaded anyway, in seconds */
+  int write_idle_timeout;
   int foreground;
   int internal_connection;
   int syslog;
@@ -139,6 +267,8 @@ struct thread_inventory {
   pthread_t upload_thread[MAX_THREADS];
   pthread_t delete_thread[MAX_THREADS];
   pthread_t copy_thread[MAX_THREADS];
+  /* Only used with transfer_engine=multi, in place of all the above */
+  pthread_t multi_thread;
 
 };
 
@@ -147,33 +277,114 @@ extern struct auth *auth;
 extern config *cfg;
 /* Global thread-safe structures */
 extern pthread_mutex_t auth_in_progress_mutex;
-extern pthread_mutex_t watches_mutex;
-extern pthread_mutex_t move_events_mutex;
-extern pthread_mutex_t files_being_uploaded_mutex;
-extern GList *files_being_uploaded;
-extern GList *move_events;
 extern GAsyncQueue *files_to_upload;
 extern GAsyncQueue *files_to_delete;
 extern GAsyncQueue *files_to_copy;
 extern int exiting;
 extern int threaded;
-
-
-void list_files_cf(GHashTable **cf_files, gchar *marker, struct exclusions *exclusions);
-int get_cf_files_list (gchar * marker, struct string **resp);
+/* g_get_monotonic_time() when main() started */
+extern gint64 startup_time;
+/* Bumped every time we (re)authenticate */
+extern volatile gint auth_generation;
+
+
+/* arena.c - bump allocator for listing records */
+struct arena *arena_new();
+gpointer arena_alloc(struct arena *arena, gsize size);
+void arena_merge(struct arena *dst, struct arena *src);
+gsize arena_size(struct arena *arena);
+void arena_free(struct arena *arena);
+typedef void (*cf_listing_cb) (cf_file *f, void *data);
+void list_files_cf(GHashTable **cf_files, gchar *marker, struct exclusions *exclusions, struct arena *arena);
+long list_files_cf_range(const gchar *marker, const gchar *end_marker, struct exclusions *exclusions, int pipeline, struct arena *arena, cf_listing_cb cb, void *cb_data);
+void list_cf_dir(const gchar *cf_name, struct exclusions *exclusions, cf_listing_cb cb, void *cb_data);
+cf_file *new_cf_file(const gchar *name, struct arena *arena);
+cf_file *build_cf_file_from_json(json_t *obj, struct arena *arena);
 void get_token(char *authResp, int first_auth);
 size_t curl_devnull (void *ptr, size_t size, size_t nmemb, void *arg);
+/* curl_helpers.c - process-wide DNS/TLS session cache, and per-thread persistent curl handles */
+void shared_curl_init();
+void shared_curl_attach(CURL *curl);
+void shared_curl_count(CURL *curl);
+void shared_curl_log_stats();
+void shared_curl_cleanup();
+struct worker_conn *worker_conn_new(const char *kind, int thid);
+CURL *worker_conn_get(struct worker_conn *wc);
+void worker_conn_done(struct worker_conn *wc, CURLcode res);
+void worker_conn_free(struct worker_conn *wc);
+const gchar *worker_conn_name(struct worker_conn *wc);
+long worker_conn_retry_after(struct worker_conn *wc);
+long curl_retry_after(CURL *curl);
+void curl_set_http_version(CURL *curl);
+void curl_set_upload_buffer(CURL *curl);
+void log_http_version(CURL *curl, const char *who);
 void doAuth(int auth_type);
+void reauthenticate(const gchar *who);
+/* retry.c - backoff and the delay queue for failed requests */
+int retry_classify(long http_code);
+gint64 retry_delay(int attempts, long retry_after);
+int retry_decide(const gchar *who, long http_code, long expected, unsigned char *attempts, long retry_after, gint64 *delay);
+void retry_later(GAsyncQueue *queue, gpointer record, gint64 delay, GDestroyNotify destroy);
+void retry_init();
+void retry_stop();
+/* rate_limit.c - process-wide bandwidth and request rate limits */
+gint64 rate_limit_charge(int bucket, gint64 cost);
+void rate_limit_take(int bucket, gint64 cost);
+gint64 rate_limit_due(int bucket);
+void rate_limit_waited(int bucket, gint64 wait);
+void rate_limit_configure();
+void rate_limit_log_stats();
+void rate_limit_init();
+/* watch_index.c - inotify watch descriptors <-> directories */
+struct watch_index *watch_index_new();
+void watch_index_destroy(struct watch_index *wi);
+int watch_index_add_watch(struct watch_index *wi, int fd, const gchar *path, int mask);
+int watch_index_rm_watch(struct watch_index *wi, int fd, const gchar *path);
+void watch_index_forget_wd(struct watch_index *wi, int wd);
+gchar *watch_index_path(struct watch_index *wi, int wd);
+guint watch_index_size(struct watch_index *wi);
+guint watch_index_rm_tree(struct watch_index *wi, int fd, const gchar *path);
+/* move_table.c - pairing up the two halves of inotify move events */
+void move_table_init();
+void move_table_add(struct move_event *me);
+struct move_event *move_table_take(unsigned int cookie);
+void move_table_expire(int idle, void (*expired)(struct move_event *, void *), void *data);
+int move_table_timeout();
+void move_table_log_stats();
+/* coalesce.c - per-path coalescing of filesystem events into work items */
+void coalesce_upload(const gchar *cf_name);
+void coalesce_dirty(const gchar *cf_name);
+void coalesce_delete(const gchar *cf_name);
+void coalesce_move(const gchar *from, const gchar *to);
+void coalesce_done(const gchar *cf_name);
+void coalesce_init();
+void coalesce_stop();
+void coalesce_log_stats();
 void get_endpoint(char *authResp, int first_auth);
 GHashTable *list_files_local (char *dir, char *monitor_dir, struct exclusions *exclusions);
+GHashTable *index_local_files (GPtrArray *lfs);
+/* walk_tree.c - single-pass directory walker */
+typedef int (*walk_dir_cb) (const gchar *path, void *data);
+typedef int (*walk_file_cb) (gchar *path, struct stat *st, void *data);
+int walk_tree (const gchar *root, struct exclusions *exclusions, walk_dir_cb on_dir, walk_file_cb on_file, void *data);
 /* Compare files on local that's not on remote, returns a list of files to be uploaded. Populate global GQueues */
 GList *compare_remote(GHashTable *local, GHashTable *remote);
 void compare_local(GHashTable *remote, GHashTable *local);
+/* reconcile_merge.c - streaming merge-join of the local tree against the container listing */
+void reconcile_merge(struct exclusions *exclusions, walk_dir_cb on_dir, void *on_dir_data);
+/* initial_sync.c - lists CF while walking monitor_dir, and queues differences as soon as they're known */
+void initial_sync(struct exclusions *exclusions, walk_dir_cb on_dir, void *on_dir_data);
+/* event_buffer.c - holds back filesystem events until the initial sync is done */
+void event_buffer_start();
+int event_buffer_add(const gchar *path, int is_dir);
+int event_buffer_contains(const gchar *path);
+void event_buffer_flush(struct exclusions *exclusions);
 void handle_http_error(int http_code);
 void destroy_local_file(gpointer item);
 void daemonise();
 void destroy_move_event(struct move_event *me);
 void destroy_cf_file(gpointer item, gpointer user_data);
+void destroy_cf_file_notify(gpointer item);
 void cleanup_globals();
 void destroy_exclusions(struct exclusions *exclusions);
 void destroy_cf_file_copy(gpointer item);
@@ -184,33 +395,89 @@ void strip_char(char* str, char c);
 void *delete_file(void* data);
 void suidice(gchar *msg);
 void *handle_dir_move(void *data);
+void *handle_dir_moved_out(void *data);
+void *handle_dir_deleted(void *data);
 struct thread_inventory *spawn_threads();
 local_file *stat_local_file(gchar *file, gchar *base_dir);
+local_file *stat_local_file_nohash(gchar *file, gchar *base_dir);
+local_file *build_local_file(gchar *file, gchar *base_dir, struct stat *st);
+void file_version_from_stat(struct file_version *v, struct stat *st);
+int stat_unchanged(struct file_version *v, struct stat *st);
+int hash_local_file(local_file *lf);
+/* hash_pool.c - hashes a batch of local files in parallel */
+void hash_local_files(GPtrArray *lfs);
+int hash_file(gchar *file, unsigned char *md5);
+void md5_to_hex(unsigned char *md5, char *hex);
+int hex_to_md5(const gchar *hex, unsigned char *md5);
+/* hash_cache.c - persistent (dev, inode, size, mtime, ctime) -> MD5 cache */
+void hash_cache_init();
+int hash_cache_lookup(struct file_version *v, unsigned char *md5);
+void hash_cache_insert(struct file_version *v, unsigned char *md5);
+int hash_cache_save(int prune);
+void hash_cache_flush_maybe();
+void hash_cache_log_stats();
+void hash_cache_destroy();
 int regex_match (gchar *str, struct exclusions *exclusions);
 void *monitor_dir_inotify ();
+struct monitor_dir_data *init_monitor(struct exclusions *exclusions);
+int monitor_add_watch(const gchar *dir, void *data);
+void start_dir_thread(void *(*handler)(void *), struct monitor_dir_data *md, const gchar *path, const gchar *cf_path, struct move_event *me);
+/* monitor_fanotify.c - monitor_backend=fanotify */
+void init_monitor_fanotify(struct monitor_dir_data *md);
+void *monitor_dir_fanotify(void *data);
 void signal_handler(int sig);
+void signals_init();
 cf_file *build_cf_file_from_lf(gchar *name);
 GList *get_dirs(gchar *name, gchar *parent);
 void free_lfs(GList *to_be_free, GHashTable *local);
 void free_cfs(GList *to_be_free, GHashTable *remote);
 void suicide(gchar *fmt, ...);
 void *copy_file_and_remove(void *data);
+/* Request setup and completion, shared by the upload/delete/copy threads and transfer_multi.c */
+size_t read_and_hash(char *buffer, size_t size, size_t nitems, void *data);
+int upload_request_setup(CURL *curl, struct upload_source *src, struct curl_slist **headers, const gchar *token_header, const gchar *cf_url, local_file *lf);
+long upload_request_finish(local_file *lf, struct upload_source *src, struct curl_slist *headers, long http_code);
+void upload_release(local_file *lf);
+int upload_unchanged(local_file *lf);
+int upload_refresh(local_file *lf);
+void upload_remember(local_file *lf);
+void upload_forget(const gchar *cf_name);
+void delete_request_setup(CURL *curl, struct curl_slist **headers, const gchar *token_header, const gchar *cf_url, struct string *resp);
+long delete_manifest_result(const gchar *name, long http_code, struct string *resp);
+void copy_request_setup(CURL *curl, struct curl_slist **headers, const gchar *token_header, const gchar *cf_url, const gchar *dest_header);
+void copy_release(cf_file_copy *cfc);
+/* bulk_delete.c - batched deletes through the bulk delete middleware */
+void bulk_delete_init();
+int bulk_delete_enabled();
+cf_file *bulk_delete_collect(GAsyncQueue *queue, cf_file *first, GPtrArray *batch);
+gchar *bulk_delete_body(GPtrArray *batch);
+void bulk_delete_request_setup(CURL *curl, struct curl_slist **headers, gchar **url, const gchar *token_header, const gchar *body, struct string *resp);
+int bulk_delete_finish(GPtrArray *batch, long http_code, struct string *resp, GPtrArray *failed);
+/* slo_upload.c - segmented uploads of large files as Static Large Objects */
+int slo_wanted(guint64 size);
+int slo_hash_file(gchar *file, guint64 size, unsigned char *md5);
+int upload_slo(struct worker_conn *wc, local_file *lf, int thid);
+void slo_note(const gchar *name);
+void slo_forget(const gchar *name);
+int slo_known(const gchar *name);
+/* transfer_multi.c - event driven transfer engine on curl multi */
+void transfer_multi_start(pthread_t *thread);
 GList *get_cf_files_from_dir(gchar *dir, struct exclusions *exclusions);
 /* Frees the global list containing files in queue for upload */
-void destroy_files_being_uploaded();
 void *handle_dir_create(void *data);
-int add_watches_recursively(char *dir, int inotify_fd, GHashTable **watches, int monitor_events );
+int add_watches_recursively(char *dir, int inotify_fd, struct watch_index *watches, int monitor_events );
 size_t write_data (void *ptr, size_t size, size_t nmemb, void *arg);
-void signal_ignore(int sig);
 void init_string (struct string *s);
 int init_auth();
 void init_config (int argc, char *argv[]);
+void reload_config();
 int char_to_pos_int(gchar *str);
 void help(char *binary_name);
 struct exclusions *init_exclusions();
 void validate_config();
 void init_logging();
 int log_msg(int level, char *fmt, ...);
+void log_phase(const char *name, gint64 since);
 void drain_queue(GAsyncQueue *queue);
 void wait_threads (struct thread_inventory *thread_inventory);
 int delete_local_file (char *file);
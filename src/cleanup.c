@@ -69,7 +69,6 @@ destroy_cf_file_copy (gpointer item)
   cf_file_copy *cfc = item;
   free_single_pointer (cfc->old_name);
   free_single_pointer (cfc->new_name);
-  free_single_pointer (cfc->sentinel);
   free_single_pointer (cfc);
 }
 
@@ -82,12 +81,8 @@ destroy_local_file (gpointer item)
     log_msg(LOG_DEBUG, "Got passed a NULL lf object to free!");
     return;
   }
-  log_msg (LOG_MEMDEBUG, "Freeing local_file : %s", (char *) lf->cf_name);
-  free_single_pointer (lf->cf_name);
-  free_single_pointer (lf->st);
-  free_single_pointer (lf->hash);
-  free_single_pointer (lf->sentinel);
-  free_single_pointer (lf->name);
+  log_msg (LOG_MEMDEBUG, "Freeing local_file : %s", lf->cf_name);
+  /* The names are part of the same allocation */
   free_single_pointer (item);
 }
 
@@ -97,17 +92,19 @@ destroy_cf_file (gpointer item, gpointer user_data)
   cf_file *f = item;
   if (f == NULL)
     return;
-  log_msg (LOG_MEMDEBUG, "Freeing cf_file: '%s' - %s", f->content_type, f->hash);
-  free_single_pointer (f->content_type);
-  free_single_pointer (f->hash);
-  free_single_pointer (f->local_path);
-  free_single_pointer (f->sentinel);
+  /* Records from a listing are freed with their arena */
+  if (f->in_arena)
+    return;
+  log_msg (LOG_MEMDEBUG, "Freeing cf_file: '%s'", f->name);
+  /* The name is part of the same allocation, user_data is only there so we can be used as a GHFunc */
   free_single_pointer (item);
-  /* When we build a dummy object (misc.c), we need to free the name as well, since that's not a key in any hash maps or lists 
-   * delete_file() calls this
-   */
-  if (user_data != NULL)
-    free_single_pointer (user_data);
+}
+
+/* destroy_cf_file() as a GDestroyNotify - calling it through a one-argument pointer isn't safe */
+void
+destroy_cf_file_notify (gpointer item)
+{
+  destroy_cf_file (item, NULL);
 }
 
 void
@@ -125,14 +122,13 @@ cleanup_globals ()
 {
   g_async_queue_unref (files_to_delete);
   g_async_queue_unref (files_to_copy);
-  g_list_free_full (files_being_uploaded, (GDestroyNotify) free_single_pointer);
   free_single_pointer (auth->token);
   free_single_pointer (auth->endpoint);
   free_single_pointer (auth->token_header);
   free_single_pointer (auth);
+  hash_cache_destroy ();
+  shared_curl_cleanup ();
   curl_global_cleanup ();
-  pthread_mutex_destroy (&files_being_uploaded_mutex);
-  pthread_mutex_destroy (&move_events_mutex);
   pthread_mutex_destroy (&auth_in_progress_mutex);
   return;
 }
@@ -0,0 +1,383 @@
+#include "ccfsync.h"
+#include <time.h>
+
+/* Sits between the filesystem monitor and the work queues. Rather than every inotify event turning into a work item
+ * of its own, the latest intent for each path (upload it, delete it, or copy it over from where it was moved from)
+ * is kept here, keyed by its name on CF. Once a path has been left alone for coalesce_quiet_period it's sent on as
+ * one work item - or after coalesce_max_delay regardless, so a file that's written to all the time still gets
+ * uploaded now and then.
+ *
+ * With write_settle, a file that's being written to is only marked dirty. It's uploaded once whoever's writing it
+ * closes it, or once it's gone write_idle_timeout without being written to - it may be held open for good - rather
+ * than after every write that happens to be followed by a pause.
+ *
+ * A path stays here while it's being uploaded. Whatever happens to it meanwhile is recorded as usual, and once the
+ * upload's done (coalesce_done()) it's sent on again - once, however many events there were.
+ *
+ * A file move leaves two entries: the new name copies the object over from the old one, which is marked as moved
+ * away (and isn't sent on by itself). If either of them is changed again before the copy's sent, the copy turns into
+ * an upload of the new name and a delete of the old one.
+ */
+
+#define INTENT_NONE 0
+#define INTENT_UPLOAD 1
+#define INTENT_DELETE 2
+/* Copy over from partner */
+#define INTENT_MOVE 3
+/* Moved to partner, whose copy deletes this */
+#define INTENT_MOVED_AWAY 4
+/* Being written to: upload it once it's closed, or left idle */
+#define INTENT_DIRTY 5
+
+struct pending_path {
+  gchar *cf_name;
+  int intent;
+  gchar *partner;
+  /* g_get_monotonic_time() of the first event since it was last sent on, and when it's due to be */
+  gint64 first;
+  gint64 due;
+  /* In schedule, or NULL if it isn't due at all */
+  GSequenceIter *iter;
+  /* Sent on as an upload, which isn't done yet */
+  int in_flight;
+};
+
+static pthread_mutex_t coalesce_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t coalesce_cond;
+/* cf_name -> struct pending_path */
+static GHashTable *pending = NULL;
+/* Soonest due first */
+static GSequence *schedule = NULL;
+static int coalesce_stopped = FALSE;
+static unsigned long events_seen = 0;
+static unsigned long items_sent = 0;
+static unsigned long requeued = 0;
+
+static void
+destroy_pending (gpointer data)
+{
+  struct pending_path *p = data;
+
+  free_single_pointer (p->partner);
+  free_single_pointer (p->cf_name);
+  free_single_pointer (p);
+}
+
+static gint
+due_cmp (gconstpointer a, gconstpointer b, gpointer data)
+{
+  const struct pending_path *x = a, *y = b;
+  return x->due < y->due ? -1 : x->due > y->due;
+}
+
+static struct pending_path *
+get_pending (const gchar * cf_name)
+{
+  struct pending_path *p = g_hash_table_lookup (pending, cf_name);
+
+  if (p == NULL) {
+    p = calloc (1, sizeof (struct pending_path));
+    p->cf_name = g_strdup (cf_name);
+    g_hash_table_insert (pending, p->cf_name, p);
+  }
+  return p;
+}
+
+static void
+unschedule (struct pending_path *p)
+{
+  if (p->iter != NULL) {
+    g_sequence_remove (p->iter);
+    p->iter = NULL;
+  }
+}
+
+/* Pushes p's due time back to a quiet period from now (or the idle timeout, for a file still being written to) */
+static void
+reschedule (struct pending_path *p)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 wait = p->intent == INTENT_DIRTY ? (gint64) cfg->write_idle_timeout * G_USEC_PER_SEC
+    : (gint64) cfg->coalesce_quiet_period * 1000;
+
+  if (p->iter == NULL)
+    p->first = now;
+  p->due = MIN (now + wait, p->first + (gint64) cfg->coalesce_max_delay * 1000);
+  if (p->iter == NULL)
+    p->iter = g_sequence_insert_sorted (schedule, p, due_cmp, NULL);
+  else
+    g_sequence_sort_changed (p->iter, due_cmp, NULL);
+  if (p->iter == g_sequence_get_begin_iter (schedule))
+    pthread_cond_signal (&coalesce_cond);
+}
+
+static void
+forget (struct pending_path *p)
+{
+  unschedule (p);
+  g_hash_table_remove (pending, p->cf_name);
+}
+
+static void set_intent (struct pending_path *p, int intent, const gchar * partner);
+
+/* p was going to be copied over from its partner, but won't be now - so the partner needs deleting by itself */
+static void
+release_partner (struct pending_path *p)
+{
+  struct pending_path *from;
+
+  if (p->intent != INTENT_MOVE)
+    return;
+  from = g_hash_table_lookup (pending, p->partner);
+  if (from != NULL && from->intent == INTENT_MOVED_AWAY && strcmp (from->partner, p->cf_name) == 0)
+    set_intent (from, INTENT_DELETE, NULL);
+}
+
+static void
+set_intent (struct pending_path *p, int intent, const gchar * partner)
+{
+  release_partner (p);
+  p->intent = intent;
+  free_single_pointer (p->partner);
+  p->partner = partner != NULL ? g_strdup (partner) : NULL;
+  events_seen++;
+
+  /* Picked up again once the upload's done */
+  if (p->in_flight)
+    return;
+  if (intent == INTENT_MOVED_AWAY)
+    unschedule (p);
+  else
+    reschedule (p);
+}
+
+void
+coalesce_upload (const gchar * cf_name)
+{
+  pthread_mutex_lock (&coalesce_mutex);
+  if (!coalesce_stopped)
+    set_intent (get_pending (cf_name), INTENT_UPLOAD, NULL);
+  pthread_mutex_unlock (&coalesce_mutex);
+}
+
+/* cf_name is being written to (write_settle) */
+void
+coalesce_dirty (const gchar * cf_name)
+{
+  pthread_mutex_lock (&coalesce_mutex);
+  if (!coalesce_stopped)
+    set_intent (get_pending (cf_name), INTENT_DIRTY, NULL);
+  pthread_mutex_unlock (&coalesce_mutex);
+}
+
+void
+coalesce_delete (const gchar * cf_name)
+{
+  pthread_mutex_lock (&coalesce_mutex);
+  if (!coalesce_stopped)
+    set_intent (get_pending (cf_name), INTENT_DELETE, NULL);
+  pthread_mutex_unlock (&coalesce_mutex);
+}
+
+void
+coalesce_move (const gchar * from, const gchar * to)
+{
+  struct pending_path *old;
+
+  pthread_mutex_lock (&coalesce_mutex);
+  if (coalesce_stopped) {
+    pthread_mutex_unlock (&coalesce_mutex);
+    return;
+  }
+  old = g_hash_table_lookup (pending, from);
+  if (old != NULL) {
+    /* CF may not have what's at from yet (or is being sent it right now), so there's nothing safe to copy */
+    set_intent (old, INTENT_DELETE, NULL);
+    set_intent (get_pending (to), INTENT_UPLOAD, NULL);
+  }
+  else {
+    set_intent (get_pending (to), INTENT_MOVE, from);
+    set_intent (get_pending (from), INTENT_MOVED_AWAY, to);
+  }
+  pthread_mutex_unlock (&coalesce_mutex);
+}
+
+/* The upload of cf_name is done with, one way or another. If it changed meanwhile, it's sent on again */
+void
+coalesce_done (const gchar * cf_name)
+{
+  struct pending_path *p;
+
+  pthread_mutex_lock (&coalesce_mutex);
+  p = pending != NULL ? g_hash_table_lookup (pending, cf_name) : NULL;
+  /* Uploads that didn't come through here (e.g. from the initial sync) aren't in flight */
+  if (p != NULL && p->in_flight) {
+    p->in_flight = FALSE;
+    if (p->intent == INTENT_NONE)
+      forget (p);
+    else {
+      requeued++;
+      reschedule (p);
+    }
+  }
+  pthread_mutex_unlock (&coalesce_mutex);
+}
+
+/* Sends p on. Uploads are added to uploads rather than queued, since the file needs a stat() first and that's
+ * best done without the lock
+ */
+static void
+send_on (struct pending_path *p, GPtrArray * uploads)
+{
+  struct pending_path *from;
+  cf_file_copy *cfc;
+
+  unschedule (p);
+  items_sent++;
+
+  if (p->intent == INTENT_MOVE) {
+    from = g_hash_table_lookup (pending, p->partner);
+    if (from != NULL && from->intent == INTENT_MOVED_AWAY && strcmp (from->partner, p->cf_name) == 0) {
+      cfc = malloc (sizeof (cf_file_copy));
+      cfc->old_name = g_strdup (p->partner);
+      cfc->new_name = g_strdup (p->cf_name);
+      cfc->type = RECORD_FILE;
+      cfc->attempts = 0;
+      cfc->cf_file = build_cf_file_from_lf (p->partner);
+      g_async_queue_push (files_to_copy, cfc);
+      log_msg (LOG_DEBUG, "Coalescer: copying %s to %s", cfc->old_name, cfc->new_name);
+      forget (from);
+      forget (p);
+      return;
+    }
+    /* What was at the old name has changed since, so it's dealt with by itself */
+    p->intent = INTENT_UPLOAD;
+  }
+  /* Still open, but left alone for long enough */
+  if (p->intent == INTENT_DIRTY)
+    log_msg (LOG_DEBUG, "Coalescer: %s hasn't been written to for a while - uploading it while it's still open", p->cf_name);
+
+  if (p->intent == INTENT_DELETE) {
+    g_async_queue_push (files_to_delete, build_cf_file_from_lf (p->cf_name));
+    forget (p);
+  }
+  else {
+    p->intent = INTENT_NONE;
+    p->in_flight = TRUE;
+    g_ptr_array_add (uploads, g_strdup (p->cf_name));
+  }
+}
+
+static void
+queue_uploads (GPtrArray * uploads)
+{
+  local_file *lf;
+  gchar *cf_name;
+  guint i;
+
+  for (i = 0; i < uploads->len; i++) {
+    cf_name = g_ptr_array_index (uploads, i);
+    lf = stat_local_file_nohash (g_strconcat (cfg->monitor_dir, "/", cf_name, NULL), cfg->monitor_dir);
+    /* Gone again already - whatever removed it has told us about it too */
+    if (lf == NULL)
+      coalesce_done (cf_name);
+    else
+      g_async_queue_push (files_to_upload, lf);
+    free_single_pointer (cf_name);
+  }
+  g_ptr_array_set_size (uploads, 0);
+}
+
+static void *
+coalesce_thread (void *data)
+{
+  GPtrArray *uploads = g_ptr_array_new ();
+  GSequenceIter *head;
+  struct pending_path *p;
+  struct timespec ts;
+  gint64 now;
+
+  pthread_mutex_lock (&coalesce_mutex);
+  while (!coalesce_stopped) {
+    head = g_sequence_get_begin_iter (schedule);
+    if (g_sequence_iter_is_end (head)) {
+      pthread_cond_wait (&coalesce_cond, &coalesce_mutex);
+      continue;
+    }
+    p = g_sequence_get (head);
+    now = g_get_monotonic_time ();
+    if (p->due > now) {
+      /* g_get_monotonic_time() is CLOCK_MONOTONIC, which coalesce_cond waits on */
+      ts.tv_sec = p->due / G_USEC_PER_SEC;
+      ts.tv_nsec = (p->due % G_USEC_PER_SEC) * 1000;
+      pthread_cond_timedwait (&coalesce_cond, &coalesce_mutex, &ts);
+      continue;
+    }
+    /* Everything that's due, in one go */
+    while (!g_sequence_iter_is_end (head = g_sequence_get_begin_iter (schedule))
+	   && ((struct pending_path *) g_sequence_get (head))->due <= now)
+      send_on (g_sequence_get (head), uploads);
+
+    if (uploads->len > 0) {
+      pthread_mutex_unlock (&coalesce_mutex);
+      queue_uploads (uploads);
+      pthread_mutex_lock (&coalesce_mutex);
+    }
+  }
+  pthread_mutex_unlock (&coalesce_mutex);
+  g_ptr_array_free (uploads, TRUE);
+  return NULL;
+}
+
+void
+coalesce_init ()
+{
+  pthread_condattr_t attr;
+  pthread_attr_t thread_attr;
+  pthread_t thread;
+  int rc;
+
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&coalesce_cond, &attr);
+  pthread_condattr_destroy (&attr);
+  pending = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, destroy_pending);
+  schedule = g_sequence_new (NULL);
+
+  pthread_attr_init (&thread_attr);
+  pthread_attr_setdetachstate (&thread_attr, PTHREAD_CREATE_DETACHED);
+  rc = pthread_create (&thread, &thread_attr, coalesce_thread, NULL);
+  pthread_attr_destroy (&thread_attr);
+  if (rc != 0)
+    suicide ("Failed to spawn event coalescing thread. Error code: %d\n", rc);
+}
+
+/* We're exiting: changes that haven't been sent on yet are dropped, like everything else that's queued */
+void
+coalesce_stop ()
+{
+  gint dropped;
+
+  pthread_mutex_lock (&coalesce_mutex);
+  coalesce_stopped = TRUE;
+  dropped = schedule != NULL ? g_sequence_get_length (schedule) : 0;
+  if (schedule != NULL)
+    g_sequence_remove_range (g_sequence_get_begin_iter (schedule), g_sequence_get_end_iter (schedule));
+  if (pending != NULL)
+    g_hash_table_remove_all (pending);
+  pthread_cond_signal (&coalesce_cond);
+  pthread_mutex_unlock (&coalesce_mutex);
+
+  if (dropped > 0)
+    log_msg (LOG_INFO, "Dropped changes to %d paths that were waiting to settle", dropped);
+}
+
+void
+coalesce_log_stats ()
+{
+  pthread_mutex_lock (&coalesce_mutex);
+  if (events_seen > 0)
+    log_msg (LOG_INFO, "Coalesced %lu filesystem events into %lu uploads, deletes and copies (%lu sent again after changing mid-upload)",
+	     events_seen, items_sent, requeued);
+  pthread_mutex_unlock (&coalesce_mutex);
+}
@@ -1,6 +1,9 @@
 #include "ccfsync.h"
 
-/* Returns a list of files we have locally, but not on remote. Upload any local files not found, or different hash on CF */
+/* Returns a list of files we have locally, but not on remote. Upload any local files not found, or different hash on CF.
+ * Sizes are compared first: a file missing on CF or with a different size needs uploading whatever its hash is
+ * (the upload works it out on the way), so only files of the same size are read and hashed here.
+ */
 GList *
 compare_remote (GHashTable * local, GHashTable * remote)
 {
@@ -10,23 +13,29 @@ compare_remote (GHashTable * local, GHashTable * remote)
    * them for comparing in compare_local. So delay purging of files we don't need to upload
    */
   GList *to_be_free = NULL;
+  GPtrArray *to_hash = g_ptr_array_new ();
   gpointer key, itr_value, cf_file_ptr;
+  unsigned int i;
   g_hash_table_iter_init (&iter, local);
   while (g_hash_table_iter_next (&iter, &key, &itr_value)) {
     local_file *lf = (local_file *) itr_value;
+    /* Already queued for upload by initial_sync() while it was walking */
+    if (lf == NULL)
+      continue;
+    /* Changed since we started - event_buffer_flush() deals with it */
+    if (event_buffer_contains (lf->cf_name)) {
+      to_be_free = g_list_prepend (to_be_free, g_strdup (lf->cf_name));
+      continue;
+    }
     /* Check file names */
     if (g_hash_table_lookup_extended (remote, lf->cf_name, NULL, &cf_file_ptr)) {
-
-      /* Check hashes in case a file has been altered */
       cf_file *cf = (cf_file *) cf_file_ptr;
-      if (strncmp (cf->hash, lf->hash, strlen (cf->hash)) != 0) {
-	log_msg (LOG_DEBUG, "Hash mismatch between local '%s' and remote '%s' - need re-uploading!", lf->name, cf->local_path);
+      if (cf->len != lf->ver.size) {
+	log_msg (LOG_DEBUG, "Size mismatch between local '%s' and remote '%s' - need re-uploading!", lf->name, cf->name);
 	g_async_queue_push (files_to_upload, lf);
       }
-      else {
-	/* We no longer need this file - files needing uploaded are free'd when uploaded */
-	to_be_free = g_list_prepend (to_be_free, g_strdup (key));
-      }
+      else
+	g_ptr_array_add (to_hash, lf);
     }
     else {
       log_msg (LOG_DEBUG, "NOT found in remote: '%s' - need uploading", (char *) key);
@@ -36,6 +45,24 @@ compare_remote (GHashTable * local, GHashTable * remote)
 
   }
 
+  /* Same size - need to look at the contents */
+  hash_local_files (to_hash);
+  for (i = 0; i < to_hash->len; i++) {
+    local_file *lf = g_ptr_array_index (to_hash, i);
+    cf_file *cf = g_hash_table_lookup (remote, lf->cf_name);
+
+    /* Check hashes in case a file has been altered */
+    if (lf->has_hash && (!cf->has_hash || memcmp (cf->md5, lf->md5, MD5_DIGEST_LENGTH) != 0)) {
+      log_msg (LOG_DEBUG, "Hash mismatch between local '%s' and remote '%s' - need re-uploading!", lf->name, cf->name);
+      g_async_queue_push (files_to_upload, lf);
+    }
+    else {
+      /* We no longer need this file (or couldn't read it) - files needing uploaded are free'd when uploaded */
+      to_be_free = g_list_prepend (to_be_free, g_strdup (lf->cf_name));
+    }
+  }
+  g_ptr_array_free (to_hash, TRUE);
+
   return to_be_free;
 
 }
@@ -50,13 +77,14 @@ compare_local (GHashTable * remote, GHashTable * local)
   g_hash_table_iter_init (&iter, remote);
   while (g_hash_table_iter_next (&iter, &key, &itr_value)) {
     cf_file *cf = itr_value;
-    if (g_hash_table_lookup_extended (local, cf->local_path, NULL, NULL)) {
-      destroy_cf_file (cf, cf->name);
+    if (g_hash_table_lookup_extended (local, cf->name, NULL, NULL) || event_buffer_contains (cf->name)) {
+      destroy_cf_file (cf, NULL);
       continue;
     }
     else {
       log_msg (LOG_DEBUG, "Found file on remote NOT found in local: '%s' - deleting", (char *) key);
-      g_async_queue_push (files_to_delete, cf);
+      /* The listing's arena goes away long before the delete threads are done with it */
+      g_async_queue_push (files_to_delete, cf->in_arena ? build_cf_file_from_lf (cf->name) : cf);
     }
 
   }
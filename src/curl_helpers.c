@@ -1,4 +1,5 @@
 #include "ccfsync.h"
+#include <openssl/err.h>
 
 size_t 
 
@@ -56,3 +57,316 @@ handle_http_error (int http_code)
 
 }
 
+
+/* Every curl handle in the process - worker threads, the multi engine, listings and auth - is attached to one
+ * share, so a hostname is resolved and a TLS session negotiated once rather than per thread. A new connection
+ * then resumes the session (an abbreviated handshake) instead of doing a full one.
+ *
+ * Connections themselves are not shared: curl doesn't support sharing its connection cache between threads
+ * running concurrently. Each worker thread keeps its own connection alive instead (see worker_conn below).
+ */
+static CURLSH *share = NULL;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+static pthread_mutex_t share_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long share_connects = 0;
+static unsigned long share_handshakes = 0;
+static double share_handshake_time = 0;
+
+static void
+share_lock (CURL * handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+  pthread_mutex_lock (&share_locks[data]);
+}
+
+static void
+share_unlock (CURL * handle, curl_lock_data data, void *userptr)
+{
+  pthread_mutex_unlock (&share_locks[data]);
+}
+
+/* Must be called after curl_global_init(), before any threads use curl */
+void
+shared_curl_init ()
+{
+  int i;
+
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_init (&share_locks[i], NULL);
+
+  if ((share = curl_share_init ()) == NULL) {
+    log_msg (LOG_WARNING, "Failed to initialise curl share - every thread will resolve and handshake on its own");
+    return;
+  }
+  curl_share_setopt (share, CURLSHOPT_LOCKFUNC, share_lock);
+  curl_share_setopt (share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+  curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt (share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+void
+shared_curl_attach (CURL * curl)
+{
+  if (share != NULL)
+    curl_easy_setopt (curl, CURLOPT_SHARE, share);
+}
+
+/* Counts the connections and TLS handshakes a finished request needed */
+void
+shared_curl_count (CURL * curl)
+{
+  long connects = 0;
+  double connect_time = 0, appconnect_time = 0;
+
+  if (curl_easy_getinfo (curl, CURLINFO_NUM_CONNECTS, &connects) != CURLE_OK || connects == 0)
+    return;
+  curl_easy_getinfo (curl, CURLINFO_CONNECT_TIME, &connect_time);
+  curl_easy_getinfo (curl, CURLINFO_APPCONNECT_TIME, &appconnect_time);
+
+  pthread_mutex_lock (&share_stats_mutex);
+  share_connects += connects;
+  /* APPCONNECT is only set when there's been a TLS handshake */
+  if (appconnect_time > 0) {
+    share_handshakes++;
+    share_handshake_time += appconnect_time - connect_time;
+  }
+  pthread_mutex_unlock (&share_stats_mutex);
+}
+
+void
+shared_curl_log_stats ()
+{
+  pthread_mutex_lock (&share_stats_mutex);
+  if (share_handshakes > 0)
+    log_msg (LOG_INFO, "Connections: %lu opened, %lu TLS handshakes taking %.1fms on average", share_connects, share_handshakes,
+	     1000.0 * share_handshake_time / share_handshakes);
+  else
+    log_msg (LOG_INFO, "Connections: %lu opened, no TLS handshakes", share_connects);
+  pthread_mutex_unlock (&share_stats_mutex);
+}
+
+/* Once every handle is gone */
+void
+shared_curl_cleanup ()
+{
+  int i;
+
+  /* If a handle is somehow still attached, leave it (and the locks) be */
+  if (share != NULL && curl_share_cleanup (share) != CURLSHE_OK)
+    return;
+  share = NULL;
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_destroy (&share_locks[i]);
+}
+
+/* Asks for the configured HTTP version on an object request. Used by both transfer engines */
+void
+curl_set_http_version (CURL * curl)
+{
+  switch (cfg->http_version) {
+  case HTTP_VERSION_1_1:
+    curl_easy_setopt (curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_1_1);
+    break;
+#if LIBCURL_VERSION_NUM >= 0x072f00
+  case HTTP_VERSION_2:
+    /* HTTP/2 if the server offers it during the TLS handshake (ALPN), HTTP/1.1 if it doesn't */
+    curl_easy_setopt (curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+    break;
+#endif
+#if LIBCURL_VERSION_NUM >= 0x073100
+  case HTTP_VERSION_2_PRIOR_KNOWLEDGE:
+    curl_easy_setopt (curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+    break;
+#endif
+  default:
+    break;
+  }
+
+#if LIBCURL_VERSION_NUM >= 0x072b00
+  /* Rather than open another connection straight away, wait to see whether one that's being set up can take
+   * another stream
+   */
+  if (cfg->http_version == HTTP_VERSION_2 || cfg->http_version == HTTP_VERSION_2_PRIOR_KNOWLEDGE)
+    curl_easy_setopt (curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+}
+
+/* Uploads are read straight into curl's upload buffer, one read() per fill - so the bigger it is, the fewer
+ * syscalls, callbacks and MD5_Update()s per GB. curl's default is 64KB
+ */
+void
+curl_set_upload_buffer (CURL * curl)
+{
+#if LIBCURL_VERSION_NUM >= 0x073e00
+  curl_easy_setopt (curl, CURLOPT_UPLOAD_BUFFERSIZE, cfg->upload_buffer_size);
+#endif
+}
+
+/* Logs which HTTP version curl ended up using for a finished request, so a fallback to HTTP/1.1 is visible */
+void
+log_http_version (CURL * curl, const char *who)
+{
+#if LIBCURL_VERSION_NUM >= 0x073200
+  long version = 0;
+
+  if (cfg->http_version == HTTP_VERSION_DEFAULT || curl_easy_getinfo (curl, CURLINFO_HTTP_VERSION, &version) != CURLE_OK)
+    return;
+  if (version == CURL_HTTP_VERSION_2_0)
+    log_msg (LOG_INFO, "%s: Talking HTTP/2 to CF", who);
+  else if (cfg->http_version != HTTP_VERSION_1_1)
+    log_msg (LOG_WARNING, "%s: HTTP/2 was asked for, but CF (or whatever is in front of it) is talking HTTP/1.x", who);
+#endif
+}
+
+/* The Retry-After (in seconds) of a finished request, or 0 if it didn't have one */
+long
+curl_retry_after (CURL * curl)
+{
+#if LIBCURL_VERSION_NUM >= 0x074200
+  curl_off_t retry_after = 0;
+
+  if (curl_easy_getinfo (curl, CURLINFO_RETRY_AFTER, &retry_after) == CURLE_OK && retry_after > 0)
+    return (long) retry_after;
+#endif
+  return 0;
+}
+
+/* Every upload, delete and copy thread keeps one curl handle for its whole life, so that curl's connection cache
+ * can keep the connection (and TLS session) to CF alive between requests rather than handshaking for every object.
+ * The handle is reset before each request, and thrown away and rebuilt after a connection level error, or when
+ * we've reauthenticated since it was created (the endpoint may have moved).
+ */
+#define WORKER_CONN_LOG_INTERVAL 10000
+
+struct worker_conn {
+  CURL *curl;
+  /* "<kind> thread <thid>", for logging */
+  gchar *name;
+  /* Retry-After from the last response, in seconds (0 if there wasn't one) */
+  long retry_after;
+  /* auth_generation when the handle was created */
+  gint auth_generation;
+  const char *kind;
+  int thid;
+  unsigned long requests;
+  unsigned long connects;
+  unsigned long rebuilds;
+};
+
+struct worker_conn *
+worker_conn_new (const char *kind, int thid)
+{
+  struct worker_conn *wc = malloc (sizeof (struct worker_conn));
+  wc->curl = NULL;
+  wc->auth_generation = 0;
+  wc->kind = kind;
+  wc->thid = thid;
+  wc->name = g_strdup_printf ("%s thread %d", kind, thid);
+  wc->retry_after = 0;
+  wc->requests = 0;
+  wc->connects = 0;
+  wc->rebuilds = 0;
+  return wc;
+}
+
+static void
+worker_conn_log_stats (struct worker_conn *wc)
+{
+  if (wc->requests == 0)
+    return;
+  log_msg (LOG_INFO, "%s thread %d: %lu requests over %lu connections (%.1f%% reused), %lu handles rebuilt", wc->kind, wc->thid,
+	   wc->requests, wc->connects, 100.0 * (wc->requests - MIN (wc->connects, wc->requests)) / wc->requests, wc->rebuilds);
+}
+
+/* Returns the thread's handle with every option reset, ready for the next request. NULL if curl couldn't be
+ * initialised
+ */
+CURL *
+worker_conn_get (struct worker_conn *wc)
+{
+  gint generation = g_atomic_int_get (&auth_generation);
+
+  if (wc->curl != NULL && wc->auth_generation != generation) {
+    log_msg (LOG_DEBUG, "%s thread %d: Reauthenticated since the connection was made - reconnecting", wc->kind, wc->thid);
+    curl_easy_cleanup (wc->curl);
+    wc->curl = NULL;
+    wc->rebuilds++;
+  }
+
+  if (wc->curl == NULL) {
+    if ((wc->curl = curl_easy_init ()) == NULL) {
+      log_msg (LOG_ERR, "%s thread %d: Failed to initialise curl!", wc->kind, wc->thid);
+      return NULL;
+    }
+    wc->auth_generation = generation;
+  }
+  else
+    curl_easy_reset (wc->curl);
+
+  shared_curl_attach (wc->curl);
+  curl_easy_setopt (wc->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_set_http_version (wc->curl);
+  return wc->curl;
+}
+
+/* To be called after every request made with the handle from worker_conn_get() */
+void
+worker_conn_done (struct worker_conn *wc, CURLcode res)
+{
+  long connects = 0;
+
+  wc->requests++;
+  if (wc->requests == 1 && res == CURLE_OK)
+    log_http_version (wc->curl, wc->name);
+  wc->retry_after = res == CURLE_OK ? curl_retry_after (wc->curl) : 0;
+  if (curl_easy_getinfo (wc->curl, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK)
+    wc->connects += connects;
+  shared_curl_count (wc->curl);
+
+  switch (res) {
+  case CURLE_COULDNT_RESOLVE_HOST:
+  case CURLE_COULDNT_CONNECT:
+  case CURLE_SSL_CONNECT_ERROR:
+  case CURLE_SEND_ERROR:
+  case CURLE_RECV_ERROR:
+  case CURLE_GOT_NOTHING:
+  case CURLE_PARTIAL_FILE:
+  case CURLE_OPERATION_TIMEDOUT:
+    /* Don't trust anything about the handle's connections after this */
+    log_msg (LOG_DEBUG, "%s thread %d: Connection error (%s) - reconnecting for the next request", wc->kind, wc->thid, curl_easy_strerror (res));
+    curl_easy_cleanup (wc->curl);
+    wc->curl = NULL;
+    wc->rebuilds++;
+    break;
+  default:
+    break;
+  }
+
+  if (wc->requests % WORKER_CONN_LOG_INTERVAL == 0)
+    worker_conn_log_stats (wc);
+}
+
+const gchar *
+worker_conn_name (struct worker_conn *wc)
+{
+  return wc->name;
+}
+
+long
+worker_conn_retry_after (struct worker_conn *wc)
+{
+  return wc->retry_after;
+}
+
+/* Called by the thread as it exits */
+void
+worker_conn_free (struct worker_conn *wc)
+{
+  worker_conn_log_stats (wc);
+  if (wc->curl != NULL)
+    curl_easy_cleanup (wc->curl);
+  free_single_pointer (wc->name);
+  free_single_pointer (wc);
+
+  /* This is to work around a memory-leak in curl */
+  ERR_remove_thread_state (NULL);
+}
@@ -1,9 +1,62 @@
 #include "ccfsync.h"
 #include <pthread.h>
-#include <openssl/err.h>
+
+/* Sets curl up to DELETE cf_url. *headers (and resp) must outlive the request. resp is for an SLO's
+ * ?multipart-manifest=delete, whose outcome is in the body - NULL otherwise
+ */
+void
+delete_request_setup (CURL * curl, struct curl_slist **headers, const gchar * token_header, const gchar * cf_url, struct string *resp)
+{
+  *headers = curl_slist_append (NULL, token_header);
+  if (resp != NULL)
+    *headers = curl_slist_append (*headers, "Accept: application/json");
+  curl_easy_setopt (curl, CURLOPT_HTTPHEADER, *headers);
+  curl_easy_setopt (curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+  curl_easy_setopt (curl, CURLOPT_URL, cf_url);
+  if (resp != NULL) {
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, write_data);
+    curl_easy_setopt (curl, CURLOPT_WRITEDATA, resp);
+  }
+  else if (!cfg->debug)
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_devnull);
+}
+
+/* A DELETE with ?multipart-manifest=delete is answered with a 200 straight away, and how it went (segments and
+ * manifest) in the body, as for a bulk delete. Returns the code a plain DELETE of name would have got
+ */
+long
+delete_manifest_result (const gchar * name, long http_code, struct string *resp)
+{
+  json_t *root, *status;
+  json_error_t error;
+
+  if (http_code != 200)
+    return http_code;
+  if (resp->data == NULL || (root = json_loads (resp->data, 0, &error)) == NULL) {
+    log_msg (LOG_WARNING, "Malformed response to deleting SLO '%s'", name);
+    return 0;
+  }
+  status = json_object_get (root, "Response Status");
+  http_code = json_is_string (status) ? strtol (json_string_value (status), NULL, 10) : 0;
+  json_decref (root);
+
+  if (http_code >= 200 && http_code < 300) {
+    slo_forget (name);
+    return 204;
+  }
+  /* Most likely not an SLO after all (it was replaced with an ordinary object since we saw it). Have another go
+   * without the segments
+   */
+  if (http_code == 400) {
+    log_msg (LOG_DEBUG, "Deleting '%s' as an SLO failed - trying again as an ordinary object", name);
+    slo_forget (name);
+    return 0;
+  }
+  return http_code;
+}
 
 int
-do_delete (gchar * token_header, gchar * cf_url, int thid)
+do_delete (struct worker_conn *wc, gchar * token_header, gchar * cf_url, int thid, struct string *resp)
 {
 
   CURL *curl;
@@ -11,31 +64,131 @@ do_delete (gchar * token_header, gchar * cf_url, int thid)
   struct curl_slist *headerlist = NULL;
   long http_code = 0;
 
-  if ((curl = curl_easy_init ()) == NULL) {
-    log_msg (LOG_ERR, "Delete thread %d: Failed to initialise curl!", thid);
+  if ((curl = worker_conn_get (wc)) == NULL)
     return -1;
-  }
 
-  headerlist = curl_slist_append (headerlist, token_header);
-  curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headerlist);
-  curl_easy_setopt (curl, CURLOPT_CUSTOMREQUEST, "DELETE");
-  curl_easy_setopt (curl, CURLOPT_URL, cf_url);
-  if (!cfg->debug)
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_devnull);
+  delete_request_setup (curl, &headerlist, token_header, cf_url, resp);
 
+  rate_limit_take (RATE_DELETE, 1);
   res = curl_easy_perform (curl);
   curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &http_code);
 
   if (res != CURLE_OK)
     log_msg (LOG_ERR, "Delete thread %d: Request failed: %s", thid, curl_easy_strerror (res));
-  curl_easy_cleanup (curl);
+  worker_conn_done (wc, res);
 
   curl_slist_free_all (headerlist);
-  /* This is to work around a memory-leak in curl */
-  ERR_remove_thread_state (NULL);
   return http_code;
 }
 
+/* Makes one attempt at deleting a single object. If it should be tried again, cf goes on the delay queue, otherwise
+ * it's destroyed
+ */
+static void
+delete_one (struct worker_conn *wc, cf_file * cf, int thid)
+{
+  int http_code = 0;
+  gint64 delay;
+  gchar *cf_url = NULL;
+  struct string resp;
+  int slo = slo_known (cf->name);
+
+  Sasprintf (cf_url, "%s/%s/%s%s", auth->endpoint, cfg->container, cf->name, slo ? "?multipart-manifest=delete" : "");
+
+  log_msg (LOG_DEBUG, "\n\nDelete thread %d: Deleting '%s'", thid, cf->name);
+  log_msg (LOG_DEBUG, "Delete thread %d: Sending auth header: %s", thid, auth->token_header);
+  log_msg (LOG_DEBUG, "Delete thread %d: Using url: %s", thid, cf_url);
+
+  if (slo) {
+    init_string (&resp);
+    http_code = delete_manifest_result (cf->name, do_delete (wc, auth->token_header, cf_url, thid, &resp), &resp);
+    free_single_pointer (resp.data);
+  }
+  else
+    http_code = do_delete (wc, auth->token_header, cf_url, thid, NULL);
+  log_msg (LOG_DEBUG, "Delete thread %d: HTTP return code: %d", thid, http_code);
+  free_single_pointer (cf_url);
+
+  /* Already gone is as good as deleted */
+  if (http_code == 404)
+    http_code = 204;
+
+  switch (retry_decide (worker_conn_name (wc), http_code, 204, &cf->attempts, worker_conn_retry_after (wc), &delay)) {
+  case RETRY_AGAIN:
+    retry_later (files_to_delete, cf, delay, destroy_cf_file_notify);
+    return;
+  case RETRY_FATAL:
+    log_msg (LOG_ERR, "Delete thread %d: WARNING: File '%s' failed to delete off CF! HTTP return code: %d", thid, cf->name, http_code);
+    break;
+  default:
+    log_msg (LOG_DEBUG, "Delete thread %d: Deletion of '%s' successful", thid, cf->name);
+  }
+
+  destroy_cf_file (cf, NULL);
+}
+
+/* Sends a batch through the bulk delete middleware, retrying the whole batch (in place - it's not a record that
+ * can go on the delay queue) if the request fails outright. Whatever's left over at the end is deleted one at a time
+ */
+static void
+delete_batch (struct worker_conn *wc, GPtrArray * batch, int thid)
+{
+  GPtrArray *failed = g_ptr_array_new ();
+  gchar *body = bulk_delete_body (batch);
+  int result = BULK_DELETE_RETRY;
+  unsigned char attempts = 0;
+  gint64 delay;
+  guint i;
+
+  log_msg (LOG_DEBUG, "Delete thread %d: Bulk deleting %u objects", thid, batch->len);
+  while (TRUE) {
+    CURL *curl;
+    CURLcode res;
+    long http_code = 0;
+    struct curl_slist *headerlist = NULL;
+    gchar *url = NULL;
+    struct string resp;
+
+    if ((curl = worker_conn_get (wc)) == NULL)
+      break;
+    init_string (&resp);
+    bulk_delete_request_setup (curl, &headerlist, &url, auth->token_header, body, &resp);
+    /* The limit is on objects deleted, whichever way they go */
+    rate_limit_take (RATE_DELETE, batch->len);
+    res = curl_easy_perform (curl);
+    curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (res != CURLE_OK)
+      log_msg (LOG_ERR, "Delete thread %d: Bulk delete request failed: %s", thid, curl_easy_strerror (res));
+    worker_conn_done (wc, res);
+
+    result = bulk_delete_finish (batch, res == CURLE_OK ? http_code : 0, &resp, failed);
+    curl_slist_free_all (headerlist);
+    free_single_pointer (url);
+    free_single_pointer (resp.data);
+
+    if (result == BULK_DELETE_DONE)
+      break;
+    /* A 200 with a failed status in the body is still worth another go */
+    if (result == BULK_DELETE_AUTH)
+      http_code = 401;
+    else if (res != CURLE_OK || http_code == 200)
+      http_code = 0;
+    if (retry_decide (worker_conn_name (wc), http_code, 200, &attempts, worker_conn_retry_after (wc), &delay) != RETRY_AGAIN)
+      break;
+    g_usleep (delay);
+  }
+  free_single_pointer (body);
+
+  if (result != BULK_DELETE_DONE)
+    log_msg (LOG_WARNING, "Delete thread %d: Bulk delete failed - deleting %u objects one at a time", thid, batch->len);
+  for (i = 0; i < batch->len; i++)
+    delete_one (wc, g_ptr_array_index (batch, i), thid);
+  for (i = 0; i < failed->len; i++)
+    delete_one (wc, g_ptr_array_index (failed, i), thid);
+
+  g_ptr_array_free (failed, TRUE);
+}
+
 /* Blocks on popping the queue containing files to delete 
  * takes a struct thread_data containing the auth struct and container name
 */
@@ -44,73 +197,40 @@ delete_file (void *data)
 {
 
   thread_data *thd = (thread_data *) data;
+  struct worker_conn *wc = worker_conn_new ("Delete", thd->thread_id);
+  GPtrArray *batch = g_ptr_array_new ();
 
   log_msg (LOG_DEBUG, "Delete thread: %d spawned", thd->thread_id);
 
-  int retries = 5;
-  int was_deleted = FALSE;
-
   while (1) {
-    int http_code = 0;
     cf_file *cf = g_async_queue_pop (files_to_delete);
 
-    /* A sentinel-event is put on the queue when we're asked to exit. Kill the thread when we hit one of those */
-    if (cf->sentinel != NULL) {
-      if (strncmp (cf->sentinel, "exit", strlen ("exit")) == 0) {
-	log_msg (LOG_DEBUG, "Delete thread %d: asked to exit...", thd->thread_id);
-	destroy_cf_file (cf, NULL);
-	free_single_pointer (thd);
-	pthread_exit (EXIT_SUCCESS);
-      }
+    if (cf->type != RECORD_EXIT)
+      upload_forget (cf->name);
+
+    /* Gather up whatever else is waiting to be deleted, and send it all at once. SLOs go on their own */
+    if (cf->type != RECORD_EXIT && bulk_delete_enabled () && !slo_known (cf->name)) {
+      cf_file *left = bulk_delete_collect (files_to_delete, cf, batch);
+      if (batch->len > 1)
+	delete_batch (wc, batch, thd->thread_id);
+      else
+	delete_one (wc, cf, thd->thread_id);
+      g_ptr_array_set_size (batch, 0);
+      if (left == NULL)
+	continue;
+      cf = left;
+    }
+
+    /* An exit record is put on the queue when we're asked to exit. Kill the thread when we hit one of those */
+    if (cf->type == RECORD_EXIT) {
+      log_msg (LOG_DEBUG, "Delete thread %d: asked to exit...", thd->thread_id);
+      destroy_cf_file (cf, NULL);
+      g_ptr_array_free (batch, TRUE);
+      worker_conn_free (wc);
+      free_single_pointer (thd);
+      pthread_exit (EXIT_SUCCESS);
     }
 
-    gchar *cf_url = NULL;
-    gchar *token_header = NULL;
-
-    do {
-      Sasprintf (cf_url, "%s/%s/%s", auth->endpoint, cfg->container, cf->name);
-
-      log_msg (LOG_DEBUG, "\n\nDelete thread %d: Deleting '%s'", thd->thread_id, cf->name);
-      log_msg (LOG_DEBUG, "Delete thread %d: Sending auth header: %s", thd->thread_id, auth->token_header);
-      log_msg (LOG_DEBUG, "Delete thread %d: Using url: %s", thd->thread_id, cf_url);
-      log_msg (LOG_DEBUG, "Delete thread %d: Local file is '%s'", thd->thread_id, cf->local_path);
-
-      http_code = do_delete (auth->token_header, cf_url, thd->thread_id);
-      log_msg (LOG_DEBUG, "Delete thread %d: HTTP return code: %d", thd->thread_id, http_code);
-
-      if (http_code == 204) {
-	was_deleted = TRUE;
-        free_single_pointer (cf_url);
-	break;
-      }
-      else if (http_code == 401) {
-	log_msg (LOG_INFO, "Delete thread %d: Authentication error - token expired? Reauthenticating\n", thd->thread_id);
-
-	if (pthread_mutex_trylock (&auth_in_progress_mutex)) {
-	  doAuth (REAUTH);
-	  pthread_mutex_unlock (&auth_in_progress_mutex);
-	  log_msg (LOG_DEBUG, "Delete thread %d: Got new token: '%s'", thd->thread_id, auth->token);
-	}
-	else {
-	  log_msg (LOG_DEBUG, "Delete thread %d: Another thread is authenticating - sleeping 1 second and re-trying delete", thd->thread_id);
-	}
-      }
-      else {
-	log_msg (LOG_DEBUG, "Delete thread %d: Unhandled HTTP return code in file delete: %d file: %s\n", thd->thread_id, http_code, cf->name);
-      }
-
-      /* Need to prepare these for Sasprintf() again */
-      free_single_pointer (cf_url);
-      cf_url = NULL;
-      sleep (1);
-
-    } while (retries-- > 0);
-
-    if (!was_deleted)
-      log_msg (LOG_ERR, "Delete thread %d: WARNING: File '%s' failed to delete off CF! HTTP return code: %d", thd->thread_id, cf->name, http_code);
-    else
-      log_msg (LOG_DEBUG, "Delete thread %d: Deletion of '%s' successful", thd->thread_id, cf->name);
-
-    destroy_cf_file (cf, cf->name);
+    delete_one (wc, cf, thd->thread_id);
   }
 }
@@ -190,6 +190,7 @@ doAuth (int first_auth)
   if (!curl) {
     suicide ("Failed to init curl: %s\n", strerror (errno));
   }
+  shared_curl_attach (curl);
 
   headerlist = curl_slist_append (headerlist, (const char *) "Content-type: application/json");
   headerlist = curl_slist_append (headerlist, (const char *) "Accept: application/json");
@@ -224,6 +225,7 @@ doAuth (int first_auth)
   }
 
   curl_slist_free_all (headerlist);
+  shared_curl_count (curl);
   curl_easy_cleanup (curl);
 
 
@@ -241,6 +243,23 @@ doAuth (int first_auth)
     auth->token_header = NULL;
   }
   Sasprintf(auth->token_header, "X-Auth-Token: %s", auth->token);
+  g_atomic_int_inc (&auth_generation);
     
   return;
 }
+
+/* After a 401: gets a new token, unless another thread is already at it - in which case the caller just retries
+ * once that's done
+ */
+void
+reauthenticate (const gchar * who)
+{
+  log_msg (LOG_INFO, "%s: Authentication error - token expired? Reauthenticating", who);
+  if (pthread_mutex_trylock (&auth_in_progress_mutex) == 0) {
+    doAuth (REAUTH);
+    pthread_mutex_unlock (&auth_in_progress_mutex);
+    log_msg (LOG_DEBUG, "%s: Got new token: '%s'", who, auth->token);
+  }
+  else
+    log_msg (LOG_DEBUG, "%s: Another thread is authenticating - re-trying once it's done", who);
+}
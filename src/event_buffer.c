@@ -0,0 +1,150 @@
+#include "ccfsync.h"
+
+/* The filesystem monitor starts before the initial sync, so nothing changed during a (possibly long) startup is
+ * missed. Until the sync is done, the monitor doesn't act on events - it records the path each one happened to
+ * here instead. The initial sync leaves recorded paths (and anything below them) alone, and once it's finished,
+ * every recorded path is settled by looking at what's on disk at that point:
+ *  - a file is uploaded
+ *  - a directory has everything below it uploaded, and anything below it on CF that isn't on disk deleted
+ *  - anything that's gone is deleted (along with everything below it on CF, if it was a directory)
+ * That way nothing is ever acted on based on a listing that's older than the event. It's all handed to the coalescer,
+ * like any other event, so it can't race with whatever the monitor reports for the same path from then on.
+ */
+
+static pthread_mutex_t event_buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* CF name (path relative to monitor_dir) -> whether the event was on a directory. NULL when we're not buffering */
+static GHashTable *touched = NULL;
+
+void
+event_buffer_start ()
+{
+  pthread_mutex_lock (&event_buffer_mutex);
+  if (touched == NULL)
+    touched = g_hash_table_new_full (g_str_hash, g_str_equal, (GDestroyNotify) free_single_pointer, NULL);
+  pthread_mutex_unlock (&event_buffer_mutex);
+}
+
+/* Records an event on path (a full path under monitor_dir). Returns FALSE if we're not buffering, in which case the
+ * caller deals with it
+ */
+int
+event_buffer_add (const gchar * path, int is_dir)
+{
+  const gchar *cf_name = path + strlen (cfg->monitor_dir) + 1;
+  int buffered = FALSE;
+
+  pthread_mutex_lock (&event_buffer_mutex);
+  if (touched != NULL) {
+    /* Once a directory, always a directory - it needs its CF range looking at if it's gone */
+    if (!GPOINTER_TO_INT (g_hash_table_lookup (touched, cf_name)))
+      g_hash_table_insert (touched, g_strdup (cf_name), GINT_TO_POINTER (is_dir));
+    buffered = TRUE;
+  }
+  pthread_mutex_unlock (&event_buffer_mutex);
+
+  if (buffered)
+    log_msg (LOG_DEBUG, "Initial sync in progress - deferring event on %s", path);
+  return buffered;
+}
+
+/* TRUE if there's been an event on cf_name, or on any directory above it, since buffering started */
+int
+event_buffer_contains (const gchar * cf_name)
+{
+  int found = FALSE;
+  gchar *tmp, *slash;
+
+  pthread_mutex_lock (&event_buffer_mutex);
+  if (touched == NULL || g_hash_table_size (touched) == 0) {
+    pthread_mutex_unlock (&event_buffer_mutex);
+    return FALSE;
+  }
+
+  tmp = g_strdup (cf_name);
+  while (!found) {
+    found = g_hash_table_lookup_extended (touched, tmp, NULL, NULL);
+    if ((slash = strrchr (tmp, '/')) == NULL)
+      break;
+    *slash = '\0';
+  }
+  pthread_mutex_unlock (&event_buffer_mutex);
+
+  free_single_pointer (tmp);
+  return found;
+}
+
+static int
+settle_upload (gchar * path, struct stat *st, void *data)
+{
+  coalesce_upload (path + strlen (cfg->monitor_dir) + 1);
+  free_single_pointer (path);
+  (*(unsigned long *) data)++;
+  return 0;
+}
+
+static void
+settle_delete (cf_file * f, void *data)
+{
+  coalesce_delete (f->name);
+  destroy_cf_file (f, NULL);
+  (*(unsigned long *) data)++;
+}
+
+/* For a directory that's still there, but may have been replaced: deletes what's no longer on disk */
+static void
+settle_delete_missing (cf_file * f, void *data)
+{
+  struct stat st;
+  gchar *path = g_strconcat (cfg->monitor_dir, "/", f->name, NULL);
+
+  if (stat (path, &st) == 0 && S_ISREG (st.st_mode))
+    destroy_cf_file (f, NULL);
+  else
+    settle_delete (f, data);
+  free_single_pointer (path);
+}
+
+/* Stops buffering, and settles every path we've had an event on */
+void
+event_buffer_flush (struct exclusions *exclusions)
+{
+  GHashTable *paths;
+  GHashTableIter iter;
+  gpointer key, value;
+  struct stat st;
+  unsigned long uploads = 0, deletes = 0;
+
+  pthread_mutex_lock (&event_buffer_mutex);
+  paths = touched;
+  touched = NULL;
+  pthread_mutex_unlock (&event_buffer_mutex);
+
+  if (paths == NULL)
+    return;
+
+  g_hash_table_iter_init (&iter, paths);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    gchar *cf_name = key;
+    gchar *path = g_strconcat (cfg->monitor_dir, "/", cf_name, NULL);
+
+    if (stat (path, &st) == 0) {
+      if (S_ISREG (st.st_mode))
+	settle_upload (g_strdup (path), &st, &uploads);
+      else if (S_ISDIR (st.st_mode)) {
+	walk_tree (path, exclusions, NULL, settle_upload, &uploads);
+	/* The initial sync skipped its CF range too, and it may have been swapped for another directory */
+	list_cf_dir (cf_name, exclusions, settle_delete_missing, &deletes);
+      }
+    }
+    else if (GPOINTER_TO_INT (value))
+      list_cf_dir (cf_name, exclusions, settle_delete, &deletes);
+    else {
+      coalesce_delete (cf_name);
+      deletes++;
+    }
+    free_single_pointer (path);
+  }
+
+  log_msg (LOG_INFO, "Settled %u paths changed during the initial sync: %lu uploads, %lu deletes", g_hash_table_size (paths), uploads, deletes);
+  g_hash_table_destroy (paths);
+}
@@ -4,10 +4,11 @@
 void *
 handle_dir_create (void *data)
 {
-  /* Give any reasonably sized cp -rf chance to finish */
-  sleep (1);
   struct move_thread_data *mtd = data;
-  GHashTable *watches = mtd->watches;
+  struct watch_index *watches = mtd->watches;
+  /* Give any reasonably sized cp -rf chance to finish. fanotify reports everything below it anyway */
+  if (watches != NULL)
+    sleep (1);
   log_msg (LOG_DEBUG, "In handle_dir_create, dir created: '%s'", mtd->tmp_path);
 
   /* Get list of files in the newly created directory, and a list of files from CF and 
@@ -15,21 +16,27 @@ handle_dir_create (void *data)
    */
   GHashTable *files_in_dir = list_files_local (mtd->tmp_path, cfg->monitor_dir, mtd->exclusions);
   /* Add inotify watch to new directory asap */
-  int tmp = inotify_add_watch (mtd->fd, mtd->tmp_path, mtd->events_mask);
-  if (tmp < 0)
-    log_msg (LOG_ERR, "In handle_dir_create: Failed to set watch on '%s': %s Possible race condition hit!", mtd->tmp_path, strerror (errno));
-  g_hash_table_insert (watches, g_strdup (mtd->tmp_path), GINT_TO_POINTER (tmp));
-  pthread_mutex_unlock (&watches_mutex);
+  if (watches != NULL) {
+    int tmp = watch_index_add_watch (watches, mtd->fd, mtd->tmp_path, mtd->events_mask);
+    if (tmp < 0)
+      log_msg (LOG_ERR, "In handle_dir_create: Failed to set watch on '%s': %s Possible race condition hit!", mtd->tmp_path, strerror (errno));
 
-  add_watches_recursively (mtd->tmp_path, mtd->fd, &watches, mtd->events_mask);
+    add_watches_recursively (mtd->tmp_path, mtd->fd, watches, mtd->events_mask);
+  }
 
   /* Nothing to do here */
-  if (g_hash_table_size (files_in_dir) == 0) {
+  if (files_in_dir == NULL || g_hash_table_size (files_in_dir) == 0) {
+    if (files_in_dir != NULL)
+      g_hash_table_destroy (files_in_dir);
+    free_single_pointer (mtd->tmp_path);
+    free_single_pointer (mtd->cf_tmp_path);
+    free_single_pointer (mtd);
     pthread_exit (EXIT_SUCCESS);
   }
 
   GHashTable *cf_files = g_hash_table_new (g_str_hash, g_str_equal);
-  list_files_cf (&cf_files, NULL, mtd->exclusions);
+  struct arena *arena = arena_new ();
+  list_files_cf (&cf_files, NULL, mtd->exclusions, arena);
 
   /* compare_remote uploads files from new directory */
   GList *to_be_free_lf = compare_remote (files_in_dir, cf_files);
@@ -39,6 +46,7 @@ handle_dir_create (void *data)
   printf ("The directory %s was created.\n", mtd->tmp_path);
   g_hash_table_destroy (files_in_dir);
   g_hash_table_destroy (cf_files);
+  arena_free (arena);
   free_single_pointer (mtd->tmp_path);
   free_single_pointer (mtd->cf_tmp_path);
   free_single_pointer (mtd);
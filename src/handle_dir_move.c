@@ -2,63 +2,20 @@
 #include <sys/types.h>
 #include <sys/inotify.h>
 
-void *
-handle_dir_move (void *data)
+/* Moves the inotify watches on the directory in me (and everything below it) over to its new name */
+static void
+move_watches (struct move_thread_data *mtd, struct move_event *me)
 {
-
-  struct move_thread_data *mtd = data;
-  struct inotify_event *event = mtd->ev;
-  struct move_event *me = mtd->me;
-  GHashTable *watches = mtd->watches;
+  struct watch_index *watches = mtd->watches;
+  unsigned int j;
   int wd;
-  unsigned int j, k;
-
-  log_msg (LOG_DEBUG, "handle_dir_move thread spawned for dir: '%s'", mtd->tmp_path);
-
-  pthread_mutex_lock (&move_events_mutex);
-  for (k = 0; k < g_list_length (move_events); k++) {
-    me = g_list_nth_data (move_events, k);
-    if (me->cookie == event->cookie) {
-      log_msg (LOG_INFO, "DIRECTORY MOVE: Directory '%s' has moved to '%s'", me->cf_name, mtd->cf_tmp_path);
-    }
-  }
-  pthread_mutex_unlock (&move_events_mutex);
-
-  /* Recursively get a list of all files in the directories below the one we're moving, and add them to the copy queue */
-  GList *files_in_dir = get_cf_files_from_dir (me->cf_name, mtd->exclusions);
-  for (j = 0; j < g_list_length (files_in_dir); j++) {
-
-    gchar *file = g_list_nth_data (files_in_dir, j);
-    cf_file_copy *cfc = malloc (sizeof (cf_file_copy));
-    cfc->sentinel = g_strdup ("ok");
-    cfc->old_name = g_strdup (file);
-    gchar *tmp_base_name = file + strlen (me->cf_name);
-
-    cfc->new_name = NULL;
-
-    Sasprintf (cfc->new_name, "%s%s", mtd->cf_tmp_path, tmp_base_name);
-
-    log_msg (LOG_DEBUG, "In handle_dir_move: Handling file with old_name = '%s' new_name = '%s', will put on files_to_copy queue", cfc->old_name, cfc->new_name);
-    cfc->cf_file = build_cf_file_from_lf (cfc->old_name);
-    g_async_queue_push (files_to_copy, cfc);
-  }
-
-  g_list_free_full (files_in_dir, free_single_pointer);
 
   /* Remove watch for the old name directory */
-  pthread_mutex_lock (&watches_mutex);
-  gint *tmp_wd = g_hash_table_lookup (watches, me->full_local_path);
-  inotify_rm_watch (mtd->fd, GPOINTER_TO_INT (tmp_wd));
-  g_hash_table_remove (watches, me->full_local_path);
-  pthread_mutex_unlock (&watches_mutex);
-  log_msg (LOG_DEBUG, "In handle_dir_move: Removed watch for '%s' with wd %d", me->full_local_path, GPOINTER_TO_INT (tmp_wd));
+  gint tmp_wd = watch_index_rm_watch (watches, mtd->fd, me->full_local_path);
+  log_msg (LOG_DEBUG, "In handle_dir_move: Removed watch for '%s' with wd %d", me->full_local_path, tmp_wd);
 
   /* Add watch for the newly moved directory */
-  gint new_wd = inotify_add_watch (mtd->fd, mtd->tmp_path,
-				   IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVE);
-  pthread_mutex_lock (&watches_mutex);
-  g_hash_table_insert (watches, g_strdup (mtd->tmp_path), GINT_TO_POINTER (new_wd));
-  pthread_mutex_unlock (&watches_mutex);
+  gint new_wd = watch_index_add_watch (watches, mtd->fd, mtd->tmp_path, mtd->events_mask);
   log_msg (LOG_DEBUG, "In handle_dir_move: Added watch for '%s' with wd %d", mtd->tmp_path, (int) new_wd);
 
 
@@ -83,30 +40,59 @@ handle_dir_move (void *data)
 
 
     log_msg (LOG_DEBUG, "In handle_dir_move: Removing watch on '%s' which had wd = %d", old_tmp_dir, mtd->fd);
-    pthread_mutex_lock (&watches_mutex);
-    gint *tmp_wd_n = g_hash_table_lookup (watches, old_tmp_dir);
-    if ((inotify_rm_watch (mtd->fd, GPOINTER_TO_INT (tmp_wd_n))) < 0)
-      log_msg (LOG_ERR, "In handle_dir_move: Failed to remove inotify watch from directory '%s' : %s", old_tmp_dir, strerror (errno));
-
-    g_hash_table_remove (watches, old_tmp_dir);
+    if (watch_index_rm_watch (watches, mtd->fd, old_tmp_dir) < 0)
+      log_msg (LOG_DEBUG, "In handle_dir_move: No inotify watch on directory '%s' to remove", old_tmp_dir);
     free_single_pointer (old_tmp_dir);
 
     /* Add watch for the "new" sub-directory */
-    if ((wd = inotify_add_watch (mtd->fd, tmp_dir, IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVE)) < 0) {
+    if ((wd = watch_index_add_watch (watches, mtd->fd, tmp_dir, mtd->events_mask)) < 0) {
       log_msg (LOG_ERR, "In handle_dir_move: Failed to add watch on directory '%s' : %s Possible race condition hit!", tmp_dir, strerror (errno));
     }
     else {
       log_msg (LOG_DEBUG, "In handle_dir_move: Adding inotify watch for new sub-directory: '%s'  wd = %d", tmp_dir, wd);
-      g_hash_table_insert (watches, tmp_dir, GINT_TO_POINTER (wd));
     }
-    pthread_mutex_unlock (&watches_mutex);
-//    free_single_pointer(tmp_dir);
+    free_single_pointer (tmp_dir);
   }
   g_list_free_full (sub_dirs, free_single_pointer);
+}
 
-  pthread_mutex_lock (&move_events_mutex);
-  move_events = g_list_remove (move_events, me);
-  pthread_mutex_unlock (&move_events_mutex);
+void *
+handle_dir_move (void *data)
+{
+
+  struct move_thread_data *mtd = data;
+  /* The IN_MOVED_FROM half, paired up (and handed over) by the monitor */
+  struct move_event *me = mtd->me;
+  unsigned int j;
+
+  log_msg (LOG_DEBUG, "handle_dir_move thread spawned for dir: '%s'", mtd->tmp_path);
+  log_msg (LOG_INFO, "DIRECTORY MOVE: Directory '%s' has moved to '%s'", me->cf_name, mtd->cf_tmp_path);
+
+  /* Recursively get a list of all files in the directories below the one we're moving, and add them to the copy queue */
+  GList *files_in_dir = get_cf_files_from_dir (me->cf_name, mtd->exclusions);
+  for (j = 0; j < g_list_length (files_in_dir); j++) {
+
+    gchar *file = g_list_nth_data (files_in_dir, j);
+    cf_file_copy *cfc = malloc (sizeof (cf_file_copy));
+    cfc->type = RECORD_FILE;
+    cfc->attempts = 0;
+    cfc->old_name = g_strdup (file);
+    gchar *tmp_base_name = file + strlen (me->cf_name);
+
+    cfc->new_name = NULL;
+
+    Sasprintf (cfc->new_name, "%s%s", mtd->cf_tmp_path, tmp_base_name);
+
+    log_msg (LOG_DEBUG, "In handle_dir_move: Handling file with old_name = '%s' new_name = '%s', will put on files_to_copy queue", cfc->old_name, cfc->new_name);
+    cfc->cf_file = build_cf_file_from_lf (cfc->old_name);
+    g_async_queue_push (files_to_copy, cfc);
+  }
+
+  g_list_free_full (files_in_dir, free_single_pointer);
+
+  /* With fanotify, there are no watches to move */
+  if (mtd->watches != NULL)
+    move_watches (mtd, me);
 
   destroy_move_event (me);
 
@@ -116,3 +102,56 @@ handle_dir_move (void *data)
   free_single_pointer (mtd);
   return NULL;
 }
+
+static void
+coalesce_cf_delete (cf_file * f, void *data)
+{
+  coalesce_delete (f->name);
+  destroy_cf_file (f, NULL);
+  (*(unsigned long *) data)++;
+}
+
+/* Deletes everything on CF below the directory in mtd->me, and frees mtd */
+static unsigned long
+delete_dir_contents (struct move_thread_data *mtd)
+{
+  unsigned long deletes = 0;
+
+  list_cf_dir (mtd->me->cf_name, mtd->exclusions, coalesce_cf_delete, &deletes);
+  destroy_move_event (mtd->me);
+  free_single_pointer (mtd->tmp_path);
+  free_single_pointer (mtd->cf_tmp_path);
+  free_single_pointer (mtd);
+  return deletes;
+}
+
+/* The directory in mtd->me has been moved out of the tree, so everything that was in it is deleted. Its watches are
+ * already gone
+ */
+void *
+handle_dir_moved_out (void *data)
+{
+  struct move_thread_data *mtd = data;
+  gchar *cf_name = g_strdup (mtd->me->cf_name);
+  unsigned long deletes = delete_dir_contents (mtd);
+
+  log_msg (LOG_INFO, "DIRECTORY MOVE: Directory '%s' has moved out of %s - deleted its %lu files", cf_name, cfg->monitor_dir, deletes);
+  free_single_pointer (cf_name);
+  return NULL;
+}
+
+/* The directory in mtd->me has been deleted. What was in it should have been reported deleted first, but those
+ * events can't always be placed once the directory's gone, so whatever's left of it on CF is deleted too
+ */
+void *
+handle_dir_deleted (void *data)
+{
+  struct move_thread_data *mtd = data;
+  gchar *cf_name = g_strdup (mtd->me->cf_name);
+  unsigned long deletes = delete_dir_contents (mtd);
+
+  if (deletes > 0)
+    log_msg (LOG_INFO, "DIRECTORY DELETE: Directory '%s' was deleted - deleted %lu files left under it", cf_name, deletes);
+  free_single_pointer (cf_name);
+  return NULL;
+}
@@ -0,0 +1,418 @@
+#include "ccfsync.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <openssl/md5.h>
+
+/* Persistent cache of file fingerprints, so a restart doesn't have to read every byte under monitor_dir again.
+ *
+ * The on-disk format is a small header followed by fixed-size records sorted by (dev, inode). The file is
+ * mmap()ed read-only and binary searched in place, so loading it costs next to nothing regardless of its size.
+ * Anything hashed during this run goes into an in-memory overlay, which is merged with the mapped records and
+ * written out to a temporary file that's rename()d over the old one. The overlay being written is set aside as
+ * flushing while that happens, so lookups and inserts carry on without waiting for the disk.
+ */
+
+#define HASH_CACHE_MAGIC "CCFH"
+#define HASH_CACHE_VERSION 2
+/* Don't rewrite the cache more often than this (in seconds) when flushing after uploads */
+#define HASH_CACHE_FLUSH_INTERVAL 300
+
+struct hash_cache_header {
+  char magic[4];
+  guint32 version;
+  guint32 record_size;
+  guint32 reserved;
+  guint64 count;
+  /* Files above slo_threshold are cached with their SLO ETag, which depends on these */
+  gint64 slo_threshold;
+  gint64 slo_segment_size;
+};
+
+struct hash_cache_record {
+  guint64 dev;
+  guint64 ino;
+  guint64 size;
+  guint64 mtime_ns;
+  guint64 ctime_ns;
+  unsigned char md5[MD5_DIGEST_LENGTH];
+};
+
+static pthread_mutex_t hash_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Held for the whole of a save, so there's only one at a time. Nothing else changes the mapping */
+static pthread_mutex_t hash_cache_save_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void *map_base = NULL;
+static size_t map_len = 0;
+static const struct hash_cache_record *map_records = NULL;
+static guint64 map_count = 0;
+/* One byte per mapped record, set when the record is looked up this run. Used to prune stale entries */
+static guint8 *map_seen = NULL;
+/* Records hashed during this run, keyed on themselves (dev, inode) */
+static GHashTable *overlay = NULL;
+/* The overlay being written out by a save, if one is in progress. Newer than the mapping, older than overlay */
+static GHashTable *flushing = NULL;
+static int dirty = FALSE;
+static time_t last_flush = 0;
+static unsigned long hits = 0;
+static unsigned long misses = 0;
+
+
+static guint
+record_hash (gconstpointer key)
+{
+  const struct hash_cache_record *r = key;
+  return (guint) (r->ino ^ (r->ino >> 32) ^ (r->dev * 31));
+}
+
+static gboolean
+record_equal (gconstpointer a, gconstpointer b)
+{
+  const struct hash_cache_record *ra = a, *rb = b;
+  return ra->dev == rb->dev && ra->ino == rb->ino;
+}
+
+static int
+record_cmp (const void *a, const void *b)
+{
+  const struct hash_cache_record *ra = a, *rb = b;
+  if (ra->dev != rb->dev)
+    return ra->dev < rb->dev ? -1 : 1;
+  if (ra->ino != rb->ino)
+    return ra->ino < rb->ino ? -1 : 1;
+  return 0;
+}
+
+static void
+record_from_version (struct hash_cache_record *r, struct file_version *v)
+{
+  r->dev = v->dev;
+  r->ino = v->ino;
+  r->size = v->size;
+  r->mtime_ns = v->mtime_ns;
+  r->ctime_ns = v->ctime_ns;
+}
+
+/* Same file *and* unchanged since it was hashed */
+static int
+record_matches (const struct hash_cache_record *r, const struct hash_cache_record *key)
+{
+  return r->size == key->size && r->mtime_ns == key->mtime_ns && r->ctime_ns == key->ctime_ns;
+}
+
+static void
+unmap_cache ()
+{
+  if (map_base != NULL)
+    munmap (map_base, map_len);
+  free_single_pointer (map_seen);
+  map_base = NULL;
+  map_len = 0;
+  map_records = NULL;
+  map_count = 0;
+  map_seen = NULL;
+}
+
+/* Maps the cache file, if there is a valid one. Must be called with hash_cache_mutex held (or before threads exist) */
+static void
+map_cache ()
+{
+  struct stat st;
+  struct hash_cache_header *hdr;
+  int fd = open (cfg->hash_cache_file, O_RDONLY);
+
+  if (fd < 0) {
+    if (errno != ENOENT)
+      log_msg (LOG_WARNING, "Failed to open hash cache %s: %s", cfg->hash_cache_file, strerror (errno));
+    return;
+  }
+
+  if (fstat (fd, &st) < 0 || st.st_size < (off_t) sizeof (struct hash_cache_header)) {
+    log_msg (LOG_WARNING, "Hash cache %s is truncated - ignoring it", cfg->hash_cache_file);
+    close (fd);
+    return;
+  }
+
+  void *base = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (base == MAP_FAILED) {
+    log_msg (LOG_WARNING, "Failed to mmap hash cache %s: %s", cfg->hash_cache_file, strerror (errno));
+    return;
+  }
+
+  hdr = base;
+  if (memcmp (hdr->magic, HASH_CACHE_MAGIC, 4) != 0 || hdr->version != HASH_CACHE_VERSION
+      || hdr->record_size != sizeof (struct hash_cache_record)
+      || sizeof (struct hash_cache_header) + hdr->count * sizeof (struct hash_cache_record) != (guint64) st.st_size) {
+    log_msg (LOG_WARNING, "Hash cache %s is corrupt or from another version - ignoring it", cfg->hash_cache_file);
+    munmap (base, st.st_size);
+    return;
+  }
+  if (hdr->slo_threshold != cfg->slo_threshold || hdr->slo_segment_size != cfg->slo_segment_size) {
+    log_msg (LOG_INFO, "Hash cache %s was written with different SLO settings - ignoring it", cfg->hash_cache_file);
+    munmap (base, st.st_size);
+    return;
+  }
+
+  map_base = base;
+  map_len = st.st_size;
+  map_count = hdr->count;
+  map_records = (const struct hash_cache_record *) ((char *) base + sizeof (struct hash_cache_header));
+  map_seen = calloc (map_count ? map_count : 1, 1);
+  madvise (base, map_len, MADV_RANDOM);
+}
+
+void
+hash_cache_init ()
+{
+  if (cfg->hash_cache_file == NULL)
+    return;
+
+  overlay = g_hash_table_new_full (record_hash, record_equal, (GDestroyNotify) free_single_pointer, NULL);
+  map_cache ();
+  last_flush = time (NULL);
+  log_msg (LOG_INFO, "Hash cache %s loaded with %lu entries", cfg->hash_cache_file, (unsigned long) map_count);
+}
+
+/* Returns TRUE and fills in md5 if we've hashed this exact file before, and it hasn't changed since */
+int
+hash_cache_lookup (struct file_version *v, unsigned char *md5)
+{
+  struct hash_cache_record key;
+  const struct hash_cache_record *r;
+
+  if (overlay == NULL)
+    return FALSE;
+
+  record_from_version (&key, v);
+
+  pthread_mutex_lock (&hash_cache_mutex);
+  r = g_hash_table_lookup (overlay, &key);
+  if (r == NULL && flushing != NULL)
+    r = g_hash_table_lookup (flushing, &key);
+  if (r == NULL && map_records != NULL) {
+    r = bsearch (&key, map_records, map_count, sizeof (struct hash_cache_record), record_cmp);
+    if (r != NULL)
+      map_seen[r - map_records] = TRUE;
+  }
+
+  if (r != NULL && record_matches (r, &key)) {
+    memcpy (md5, r->md5, MD5_DIGEST_LENGTH);
+    hits++;
+    pthread_mutex_unlock (&hash_cache_mutex);
+    return TRUE;
+  }
+  misses++;
+  pthread_mutex_unlock (&hash_cache_mutex);
+  return FALSE;
+}
+
+void
+hash_cache_insert (struct file_version *v, unsigned char *md5)
+{
+  if (overlay == NULL)
+    return;
+
+  struct hash_cache_record *r = malloc (sizeof (struct hash_cache_record));
+  record_from_version (r, v);
+  memcpy (r->md5, md5, MD5_DIGEST_LENGTH);
+
+  pthread_mutex_lock (&hash_cache_mutex);
+  g_hash_table_replace (overlay, r, r);
+  dirty = TRUE;
+  pthread_mutex_unlock (&hash_cache_mutex);
+}
+
+static int
+write_all (int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write (fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Merges the mapped records (less any pruned ones) with pending, sorted, and writes them to the cache file.
+ * Only called with hash_cache_save_mutex held, so the mapping stays put - but not hash_cache_mutex
+ */
+static int
+write_cache (GHashTable * pending, int prune, guint64 * count)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  guint64 i, n = 0;
+  guint64 max = map_count + g_hash_table_size (pending);
+  struct hash_cache_record *records = malloc ((max ? max : 1) * sizeof (struct hash_cache_record));
+  gchar *tmp_path = NULL;
+  int fd;
+
+  /* Pending entries replace mapped ones for the same (dev, inode). A lookup racing with this can set map_seen
+   * too late to keep a record when pruning, which only costs hashing that file again
+   */
+  for (i = 0; i < map_count; i++) {
+    if (prune && !map_seen[i])
+      continue;
+    if (g_hash_table_lookup (pending, &map_records[i]))
+      continue;
+    records[n++] = map_records[i];
+  }
+  g_hash_table_iter_init (&iter, pending);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    records[n++] = *(struct hash_cache_record *) value;
+
+  qsort (records, n, sizeof (struct hash_cache_record), record_cmp);
+
+  struct hash_cache_header hdr;
+  memset (&hdr, 0, sizeof (hdr));
+  memcpy (hdr.magic, HASH_CACHE_MAGIC, 4);
+  hdr.version = HASH_CACHE_VERSION;
+  hdr.record_size = sizeof (struct hash_cache_record);
+  hdr.count = n;
+  hdr.slo_threshold = cfg->slo_threshold;
+  hdr.slo_segment_size = cfg->slo_segment_size;
+
+  Sasprintf (tmp_path, "%s.tmp.%d", cfg->hash_cache_file, (int) getpid ());
+  fd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    log_msg (LOG_WARNING, "Failed to write hash cache %s: %s", tmp_path, strerror (errno));
+    free_single_pointer (tmp_path);
+    free_single_pointer (records);
+    return -1;
+  }
+
+  if (write_all (fd, &hdr, sizeof (hdr)) < 0 || write_all (fd, records, n * sizeof (struct hash_cache_record)) < 0 || fsync (fd) < 0) {
+    log_msg (LOG_WARNING, "Failed to write hash cache %s: %s", tmp_path, strerror (errno));
+    close (fd);
+    unlink (tmp_path);
+    free_single_pointer (tmp_path);
+    free_single_pointer (records);
+    return -1;
+  }
+  close (fd);
+  free_single_pointer (records);
+
+  if (rename (tmp_path, cfg->hash_cache_file) < 0) {
+    log_msg (LOG_WARNING, "Failed to rename %s to %s: %s", tmp_path, cfg->hash_cache_file, strerror (errno));
+    unlink (tmp_path);
+    free_single_pointer (tmp_path);
+    return -1;
+  }
+  free_single_pointer (tmp_path);
+  *count = n;
+  return 0;
+}
+
+/* Must be called with hash_cache_save_mutex held. hash_cache_mutex is only taken to set the overlay aside and to
+ * swap the new file in, not while it's written
+ */
+static int
+save (int prune)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  guint64 n = 0;
+  int ret;
+
+  pthread_mutex_lock (&hash_cache_mutex);
+  if (!dirty && !prune) {
+    pthread_mutex_unlock (&hash_cache_mutex);
+    return 0;
+  }
+  flushing = overlay;
+  overlay = g_hash_table_new_full (record_hash, record_equal, (GDestroyNotify) free_single_pointer, NULL);
+  dirty = FALSE;
+  pthread_mutex_unlock (&hash_cache_mutex);
+
+  ret = write_cache (flushing, prune, &n);
+
+  pthread_mutex_lock (&hash_cache_mutex);
+  if (ret == 0) {
+    /* Everything that was set aside is on disk now, so swap it for a mapping of the new file */
+    unmap_cache ();
+    map_cache ();
+    g_hash_table_destroy (flushing);
+    last_flush = time (NULL);
+    log_msg (LOG_DEBUG, "Hash cache %s written with %lu entries", cfg->hash_cache_file, (unsigned long) n);
+  }
+  else {
+    /* Put it back for next time, behind anything hashed since */
+    g_hash_table_iter_init (&iter, flushing);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+      g_hash_table_iter_steal (&iter);
+      if (g_hash_table_lookup (overlay, key))
+	free_single_pointer (key);
+      else
+	g_hash_table_insert (overlay, key, value);
+    }
+    g_hash_table_destroy (flushing);
+    dirty = TRUE;
+  }
+  flushing = NULL;
+  pthread_mutex_unlock (&hash_cache_mutex);
+
+  return ret;
+}
+
+/* Writes the cache out. With prune set, entries that weren't looked up or added during this run are dropped,
+ * which is only correct right after a full scan of monitor_dir.
+ */
+int
+hash_cache_save (int prune)
+{
+  int ret;
+  if (overlay == NULL)
+    return 0;
+
+  pthread_mutex_lock (&hash_cache_save_mutex);
+  ret = save (prune);
+  pthread_mutex_unlock (&hash_cache_save_mutex);
+  return ret;
+}
+
+/* Called after successful uploads. Writes the cache out if it has changed and we haven't done so for a while */
+void
+hash_cache_flush_maybe ()
+{
+  int due;
+
+  if (overlay == NULL)
+    return;
+
+  /* Someone's already saving it */
+  if (pthread_mutex_trylock (&hash_cache_save_mutex) != 0)
+    return;
+  pthread_mutex_lock (&hash_cache_mutex);
+  due = dirty && time (NULL) - last_flush >= HASH_CACHE_FLUSH_INTERVAL;
+  pthread_mutex_unlock (&hash_cache_mutex);
+  if (due)
+    save (FALSE);
+  pthread_mutex_unlock (&hash_cache_save_mutex);
+}
+
+void
+hash_cache_log_stats ()
+{
+  if (overlay == NULL)
+    return;
+
+  pthread_mutex_lock (&hash_cache_mutex);
+  unsigned long total = hits + misses;
+  log_msg (LOG_INFO, "Hash cache: %lu hits, %lu misses (%.1f%% hit rate)", hits, misses, total ? 100.0 * hits / total : 0.0);
+  pthread_mutex_unlock (&hash_cache_mutex);
+}
+
+void
+hash_cache_destroy ()
+{
+  if (overlay == NULL)
+    return;
+  unmap_cache ();
+  g_hash_table_destroy (overlay);
+  overlay = NULL;
+}
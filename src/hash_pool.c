@@ -0,0 +1,78 @@
+#include "ccfsync.h"
+
+/* Hashes a batch of local files on cfg->num_hash_threads threads.
+ * The batch is sorted biggest-first, and each thread grabs the next file as it finishes the previous one, so the
+ * multi-GB files get started straight away while the remaining threads chew through the small ones.
+ */
+
+struct hash_pool {
+  GPtrArray *lfs;
+  volatile gint next;
+};
+
+static gint
+compare_size_desc (gconstpointer a, gconstpointer b)
+{
+  const local_file *la = *(local_file * const *) a;
+  const local_file *lb = *(local_file * const *) b;
+  if (la->ver.size == lb->ver.size)
+    return 0;
+  return la->ver.size > lb->ver.size ? -1 : 1;
+}
+
+static void *
+hash_worker (void *data)
+{
+  struct hash_pool *pool = data;
+  gint i;
+
+  while ((i = g_atomic_int_add (&pool->next, 1)) < (gint) pool->lfs->len) {
+    local_file *lf = g_ptr_array_index (pool->lfs, i);
+    /* On failure lf->has_hash stays FALSE, which the caller checks for */
+    hash_local_file (lf);
+  }
+  return NULL;
+}
+
+/* Fills in lf->md5 for every local_file in lfs. Files which can't be read are left with has_hash FALSE */
+void
+hash_local_files (GPtrArray * lfs)
+{
+  struct hash_pool pool;
+  int num_threads = cfg->num_hash_threads;
+  int i, rc;
+
+  if (lfs->len == 0)
+    return;
+
+  pool.lfs = lfs;
+  pool.next = 0;
+  g_ptr_array_sort (lfs, compare_size_desc);
+
+  if (num_threads > (int) lfs->len)
+    num_threads = lfs->len;
+
+  if (num_threads <= 1) {
+    hash_worker (&pool);
+    return;
+  }
+
+  pthread_t threads[num_threads];
+  for (i = 0; i < num_threads; i++) {
+    rc = pthread_create (&threads[i], NULL, hash_worker, &pool);
+    if (rc != 0) {
+      log_msg (LOG_WARNING, "Failed to spawn hash thread #%d (error code: %d) - continuing with %d threads", i, rc, i);
+      break;
+    }
+  }
+
+  /* Couldn't spawn anything, do it ourselves */
+  if (i == 0)
+    hash_worker (&pool);
+
+  num_threads = i;
+  for (i = 0; i < num_threads; i++)
+    pthread_join (threads[i], NULL);
+
+  log_msg (LOG_DEBUG, "Hashed %u files using %d threads", lfs->len, num_threads);
+}
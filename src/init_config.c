@@ -7,6 +7,12 @@
 #define FREE_SRC TRUE
 #define NO_FREE_SRC FALSE
 
+/* Indexed by HTTP_VERSION_* */
+static const char *http_version_names[] = { "default", "1.1", "2", "2-prior-knowledge" };
+
+/* Indexed by RATE_* */
+static const char *rate_limit_keys[] = { "max_upload_rate", "max_put_rate", "max_delete_rate", "max_copy_rate" };
+
 
 void
 overwrite_variable (char **dst, char *src, int free_src)
@@ -28,6 +34,25 @@ parse_error (GError * error, gchar * msg)
 }
 
 
+/* Reads the rate limits into rate_limits, which is left alone for any that aren't set. Returns FALSE with *error
+ * set if one doesn't parse
+ */
+static int
+get_rate_limits (GKeyFile * config, gint64 * rate_limits, GError ** error)
+{
+  int i;
+
+  for (i = 0; i < RATE_BUCKETS; i++) {
+    if (g_key_file_has_key (config, "main", rate_limit_keys[i], NULL)) {
+      gint64 rate = g_key_file_get_int64 (config, "main", rate_limit_keys[i], error);
+      if (!rate && *error != NULL)
+	return FALSE;
+      rate_limits[i] = rate;
+    }
+  }
+  return TRUE;
+}
+
 /* have_config determines whether the user supplied a config file or not. 
  * if user-supplied, throw warnings. If we're just looking for the default one
  * it may or may not exist, and either is fine. So exit gracefully 
@@ -196,6 +221,16 @@ parse_config (int have_config)
     overwrite_variable (&cfg->pid_file, pid_file, FREE_SRC);
   }
 
+  /* Get hash cache file */
+
+  if (g_key_file_has_key (config, "main", "hash_cache", &error)) {
+    gchar *hash_cache;
+    if ((hash_cache = g_key_file_get_string (config, "main", "hash_cache", &error)) == NULL)
+      parse_error (error, NULL);
+
+    overwrite_variable (&cfg->hash_cache_file, hash_cache, FREE_SRC);
+  }
+
   /* Get threads (same thread count for all types of threads */
   if (g_key_file_has_key (config, "main", "threads", &error)) {
     gint num_threads = g_key_file_get_integer (config, "main", "threads", &error);
@@ -230,11 +265,248 @@ parse_config (int have_config)
     cfg->num_copy_threads = num_threads;
   }
 
+  /* Get number of threads hashing local files at startup */
+  if (g_key_file_has_key (config, "main", "hash_threads", &error)) {
+    gint num_threads = g_key_file_get_integer (config, "main", "hash_threads", &error);
+    if (!num_threads && error != NULL)
+      parse_error (error, NULL);
+    cfg->num_hash_threads = num_threads;
+  }
+
+  /* Get number of concurrent container listing requests */
+  if (g_key_file_has_key (config, "main", "listing_partitions", &error)) {
+    gint partitions = g_key_file_get_integer (config, "main", "listing_partitions", &error);
+    if (!partitions && error != NULL)
+      parse_error (error, NULL);
+    cfg->listing_partitions = partitions;
+  }
+
+  /* Get reconciliation mode */
+  if (g_key_file_has_key (config, "main", "reconcile", &error)) {
+    gchar *reconcile;
+    if ((reconcile = g_key_file_get_string (config, "main", "reconcile", &error)) == NULL)
+      parse_error (error, NULL);
+
+    if (strcmp (reconcile, "merge") == 0)
+      cfg->reconcile_mode = RECONCILE_MERGE;
+    else if (strcmp (reconcile, "hash") == 0)
+      cfg->reconcile_mode = RECONCILE_HASH;
+    else {
+      printf ("Invalid value for reconcile: '%s' (expected 'hash' or 'merge')\n", reconcile);
+      exit (EXIT_FAILURE);
+    }
+    free_single_pointer (reconcile);
+  }
+
+  /* Get where filesystem events come from */
+  if (g_key_file_has_key (config, "main", "monitor_backend", &error)) {
+    gchar *backend;
+    if ((backend = g_key_file_get_string (config, "main", "monitor_backend", &error)) == NULL)
+      parse_error (error, NULL);
+
+    if (strcmp (backend, "fanotify") == 0)
+      cfg->monitor_backend = MONITOR_FANOTIFY;
+    else if (strcmp (backend, "inotify") == 0)
+      cfg->monitor_backend = MONITOR_INOTIFY;
+    else {
+      printf ("Invalid value for monitor_backend: '%s' (expected 'inotify' or 'fanotify')\n", backend);
+      exit (EXIT_FAILURE);
+    }
+    free_single_pointer (backend);
+  }
+
+  /* Get transfer engine */
+  if (g_key_file_has_key (config, "main", "transfer_engine", &error)) {
+    gchar *engine;
+    if ((engine = g_key_file_get_string (config, "main", "transfer_engine", &error)) == NULL)
+      parse_error (error, NULL);
+
+    if (strcmp (engine, "multi") == 0)
+      cfg->transfer_engine = TRANSFER_MULTI;
+    else if (strcmp (engine, "threads") == 0)
+      cfg->transfer_engine = TRANSFER_THREADS;
+    else {
+      printf ("Invalid value for transfer_engine: '%s' (expected 'threads' or 'multi')\n", engine);
+      exit (EXIT_FAILURE);
+    }
+    free_single_pointer (engine);
+  }
+
+  /* Get HTTP version for object requests */
+  if (g_key_file_has_key (config, "main", "http_version", &error)) {
+    gchar *version;
+    if ((version = g_key_file_get_string (config, "main", "http_version", &error)) == NULL)
+      parse_error (error, NULL);
+
+    if (strcmp (version, "default") == 0)
+      cfg->http_version = HTTP_VERSION_DEFAULT;
+    else if (strcmp (version, "1.1") == 0)
+      cfg->http_version = HTTP_VERSION_1_1;
+    else if (strcmp (version, "2") == 0)
+      cfg->http_version = HTTP_VERSION_2;
+    else if (strcmp (version, "2-prior-knowledge") == 0)
+      cfg->http_version = HTTP_VERSION_2_PRIOR_KNOWLEDGE;
+    else {
+      printf ("Invalid value for http_version: '%s' (expected 'default', '1.1', '2' or '2-prior-knowledge')\n", version);
+      exit (EXIT_FAILURE);
+    }
+    free_single_pointer (version);
+  }
+
+  /* Get the most HTTP/2 streams to open per connection */
+  if (g_key_file_has_key (config, "main", "http2_max_streams", &error)) {
+    gint streams = g_key_file_get_integer (config, "main", "http2_max_streams", &error);
+    if (!streams && error != NULL)
+      parse_error (error, NULL);
+    cfg->http2_max_streams = streams;
+  }
+
+  /* Get whether to use bulk delete */
+  if (g_key_file_has_key (config, "main", "bulk_delete", &error)) {
+    gboolean bulk_delete = g_key_file_get_boolean (config, "main", "bulk_delete", &error);
+    if (!bulk_delete && error != NULL)
+      parse_error (error, NULL);
+    cfg->bulk_delete = bulk_delete;
+  }
+
+  /* Get the most objects to send per bulk delete request */
+  if (g_key_file_has_key (config, "main", "bulk_delete_max", &error)) {
+    gint bulk_delete_max = g_key_file_get_integer (config, "main", "bulk_delete_max", &error);
+    if (!bulk_delete_max && error != NULL)
+      parse_error (error, NULL);
+    cfg->bulk_delete_max = bulk_delete_max;
+  }
+
+  /* Get the size above which files are uploaded as Static Large Objects */
+  if (g_key_file_has_key (config, "main", "slo_threshold", &error)) {
+    gint64 slo_threshold = g_key_file_get_int64 (config, "main", "slo_threshold", &error);
+    if (!slo_threshold && error != NULL)
+      parse_error (error, NULL);
+    cfg->slo_threshold = slo_threshold;
+  }
+
+  /* Get the SLO segment size */
+  if (g_key_file_has_key (config, "main", "slo_segment_size", &error)) {
+    gint64 slo_segment_size = g_key_file_get_int64 (config, "main", "slo_segment_size", &error);
+    if (!slo_segment_size && error != NULL)
+      parse_error (error, NULL);
+    cfg->slo_segment_size = slo_segment_size;
+  }
+
+  /* Get the number of segments of a file to upload at once */
+  if (g_key_file_has_key (config, "main", "slo_segment_threads", &error)) {
+    gint slo_segment_threads = g_key_file_get_integer (config, "main", "slo_segment_threads", &error);
+    if (!slo_segment_threads && error != NULL)
+      parse_error (error, NULL);
+    cfg->slo_segment_threads = slo_segment_threads;
+  }
+
+  /* Get the most attempts at a request before giving up on it */
+  if (g_key_file_has_key (config, "main", "retry_attempts", &error)) {
+    gint retry_attempts = g_key_file_get_integer (config, "main", "retry_attempts", &error);
+    if (!retry_attempts && error != NULL)
+      parse_error (error, NULL);
+    cfg->retry_attempts = retry_attempts;
+  }
+
+  /* Get the longest to wait between attempts */
+  if (g_key_file_has_key (config, "main", "retry_max_delay", &error)) {
+    gint retry_max_delay = g_key_file_get_integer (config, "main", "retry_max_delay", &error);
+    if (!retry_max_delay && error != NULL)
+      parse_error (error, NULL);
+    cfg->retry_max_delay = retry_max_delay;
+  }
+
+  /* Get the most requests the multi engine may have going at once */
+  if (g_key_file_has_key (config, "main", "max_inflight", &error)) {
+    gint max_inflight = g_key_file_get_integer (config, "main", "max_inflight", &error);
+    if (!max_inflight && error != NULL)
+      parse_error (error, NULL);
+    cfg->max_inflight = max_inflight;
+  }
+
+  /* Get the size of curl's upload buffer */
+  if (g_key_file_has_key (config, "main", "upload_buffer_size", &error)) {
+    gint upload_buffer_size = g_key_file_get_integer (config, "main", "upload_buffer_size", &error);
+    if (!upload_buffer_size && error != NULL)
+      parse_error (error, NULL);
+    cfg->upload_buffer_size = upload_buffer_size;
+  }
+
+  /* Get how long changes to a path are left to settle */
+  if (g_key_file_has_key (config, "main", "coalesce_quiet_period", &error)) {
+    gint coalesce_quiet_period = g_key_file_get_integer (config, "main", "coalesce_quiet_period", &error);
+    if (!coalesce_quiet_period && error != NULL)
+      parse_error (error, NULL);
+    cfg->coalesce_quiet_period = coalesce_quiet_period;
+  }
+
+  if (g_key_file_has_key (config, "main", "coalesce_max_delay", &error)) {
+    gint coalesce_max_delay = g_key_file_get_integer (config, "main", "coalesce_max_delay", &error);
+    if (!coalesce_max_delay && error != NULL)
+      parse_error (error, NULL);
+    cfg->coalesce_max_delay = coalesce_max_delay;
+  }
+
+  /* Get whether to wait for files to be closed before uploading them */
+  if (g_key_file_has_key (config, "main", "write_settle", &error)) {
+    gboolean write_settle = g_key_file_get_boolean (config, "main", "write_settle", &error);
+    if (!write_settle && error != NULL)
+      parse_error (error, NULL);
+    cfg->write_settle = write_settle;
+  }
+
+  if (g_key_file_has_key (config, "main", "write_idle_timeout", &error)) {
+    gint write_idle_timeout = g_key_file_get_integer (config, "main", "write_idle_timeout", &error);
+    if (!write_idle_timeout && error != NULL)
+      parse_error (error, NULL);
+    cfg->write_idle_timeout = write_idle_timeout;
+  }
+
+  /* Get the bandwidth and request rate limits */
+  if (!get_rate_limits (config, cfg->rate_limits, &error))
+    parse_error (error, NULL);
+
   if (error != NULL)
     g_error_free (error);
   g_key_file_free (config);
 }
 
+/* On SIGHUP: re-reads what can be changed while we're running from the config file - only the rate limits, for
+ * now. Unlike at startup, a bad value is logged and the old one kept, rather than exiting
+ */
+void
+reload_config ()
+{
+  GKeyFile *config = g_key_file_new ();
+  GError *error = NULL;
+  gint64 rate_limits[RATE_BUCKETS];
+  int i;
+
+  if (!g_key_file_load_from_file (config, cfg->config_file, G_KEY_FILE_NONE, &error)) {
+    log_msg (LOG_ERR, "Failed to reload config file %s: %s", cfg->config_file, error->message);
+    g_error_free (error);
+    g_key_file_free (config);
+    return;
+  }
+
+  /* A limit taken out of the file is lifted */
+  memset (rate_limits, 0, sizeof (rate_limits));
+  if (!get_rate_limits (config, rate_limits, &error)) {
+    log_msg (LOG_ERR, "Failed to reload config file %s: %s - keeping the old rate limits", cfg->config_file, error->message);
+    g_error_free (error);
+    g_key_file_free (config);
+    return;
+  }
+  for (i = 0; i < RATE_BUCKETS; i++) {
+    if (rate_limits[i] < 0)
+      log_msg (LOG_ERR, "Ignoring %s=%lld in %s: has to be 0 or more", rate_limit_keys[i], (long long) rate_limits[i], cfg->config_file);
+    else
+      cfg->rate_limits[i] = rate_limits[i];
+  }
+  g_key_file_free (config);
+}
+
 
 /* This *needs* to be called before signal handlers are put into place. Because we suicide() here without having
  * and pthreads joined in main() 
@@ -256,6 +528,7 @@ init_config (int argc, char *argv[])
   cfg->config_file = NULL;
   cfg->exclusion_file = NULL;
   cfg->pid_file = NULL;
+  cfg->hash_cache_file = NULL;
 
   Sasprintf (cfg->auth_endpoint, "https://identity.api.rackspacecloud.com/v2.0/tokens/");
   /* Region is not really used, since Rackspace now has global auth */
@@ -266,6 +539,30 @@ init_config (int argc, char *argv[])
   cfg->syslog = TRUE;
   cfg->verbose = FALSE;
   cfg->num_upload_threads = cfg->num_delete_threads = cfg->num_copy_threads = 5;
+  cfg->num_hash_threads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+  if (cfg->num_hash_threads < 1)
+    cfg->num_hash_threads = 1;
+  cfg->listing_partitions = 1;
+  cfg->reconcile_mode = RECONCILE_HASH;
+  cfg->transfer_engine = TRANSFER_THREADS;
+  cfg->monitor_backend = MONITOR_INOTIFY;
+  cfg->max_inflight = 64;
+  cfg->http_version = HTTP_VERSION_DEFAULT;
+  cfg->http2_max_streams = 100;
+  cfg->bulk_delete = TRUE;
+  cfg->bulk_delete_max = 0;
+  /* CF won't take a single object bigger than 5GB */
+  cfg->slo_threshold = G_GINT64_CONSTANT (5368709120);
+  cfg->slo_segment_size = 256 * 1024 * 1024;
+  cfg->slo_segment_threads = 4;
+  cfg->retry_attempts = 6;
+  cfg->retry_max_delay = 60;
+  memset (cfg->rate_limits, 0, sizeof (cfg->rate_limits));
+  cfg->upload_buffer_size = 512 * 1024;
+  cfg->coalesce_quiet_period = 1000;
+  cfg->coalesce_max_delay = 30000;
+  cfg->write_settle = TRUE;
+  cfg->write_idle_timeout = 30;
   cfg->foreground = FALSE;
   cfg->internal_connection = TRUE;
   cfg->debug = FALSE;
@@ -446,6 +743,7 @@ init_config (int argc, char *argv[])
     terminate_process ();
 
   if (cfg->verbose) {
+    int i;
     printf ("Finished parsing config and command line arguments: \n\n");
     printf ("Verbose is enabled\n");
     if (cfg->foreground)
@@ -474,9 +772,35 @@ init_config (int argc, char *argv[])
     printf ("Upload threads = %d\n", cfg->num_upload_threads);
     printf ("Delete threads = %d\n", cfg->num_delete_threads);
     printf ("Copy threads = %d\n", cfg->num_copy_threads);
+    printf ("Hash threads = %d\n", cfg->num_hash_threads);
+    printf ("Listing partitions = %d\n", cfg->listing_partitions);
+    printf ("Reconcile mode = %s\n", cfg->reconcile_mode == RECONCILE_MERGE ? "merge" : "hash");
+    printf ("Transfer engine = %s\n", cfg->transfer_engine == TRANSFER_MULTI ? "multi" : "threads");
+    printf ("Monitor backend = %s\n", cfg->monitor_backend == MONITOR_FANOTIFY ? "fanotify" : "inotify");
+    if (cfg->transfer_engine == TRANSFER_MULTI)
+      printf ("Max requests in flight = %d\n", cfg->max_inflight);
+    printf ("HTTP version = %s\n", http_version_names[cfg->http_version]);
+    printf ("Bulk delete = %s\n", cfg->bulk_delete ? "yes (if the cluster supports it)" : "no");
+    if (cfg->slo_threshold > 0)
+      printf ("Large objects = above %lld bytes, in %lld byte segments, %d at a time\n", (long long) cfg->slo_threshold,
+	      (long long) cfg->slo_segment_size, cfg->slo_segment_threads);
+    else
+      printf ("Large objects = disabled\n");
+    printf ("Retries = up to %d attempts, at most %d seconds apart\n", cfg->retry_attempts, cfg->retry_max_delay);
+    printf ("Upload buffer size = %ld\n", cfg->upload_buffer_size);
+    printf ("Changes settle for = %dms (at most %dms)\n", cfg->coalesce_quiet_period, cfg->coalesce_max_delay);
+    if (cfg->write_settle)
+      printf ("Files are uploaded = once closed, or after %d seconds without a write\n", cfg->write_idle_timeout);
+    else
+      printf ("Files are uploaded = whenever they're written to\n");
+    for (i = 0; i < RATE_BUCKETS; i++)
+      if (cfg->rate_limits[i] > 0)
+	printf ("%s = %lld\n", rate_limit_keys[i], (long long) cfg->rate_limits[i]);
     printf ("PID file = %s\n", cfg->pid_file);
     if (cfg->exclusion_file)
       printf ("Exclusions file =  %s\n", cfg->exclusion_file);
+    if (cfg->hash_cache_file)
+      printf ("Hash cache file = %s\n", cfg->hash_cache_file);
   }
 
   /* May not return if we do not have everything we need to get going */
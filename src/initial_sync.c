@@ -0,0 +1,111 @@
+#include "ccfsync.h"
+
+/* The initial sync in hash mode. The container is listed on its own thread while monitor_dir is walked, and once
+ * the listing is in, every file the walk finds from then on is checked as it's found - anything missing on CF or
+ * of a different size goes straight onto the upload queue. Whatever was walked before the listing finished is
+ * compared (compare_remote/compare_local) once both are done.
+ */
+
+struct initial_sync {
+  struct exclusions *exclusions;
+  GHashTable *cf_files;
+  struct arena *arena;
+  /* CF name -> local_file, or NULL for files already queued for upload */
+  GHashTable *local_files;
+  volatile gint remote_done;
+  gint64 start;
+  walk_dir_cb on_dir;
+  void *on_dir_data;
+  unsigned long early_uploads;
+};
+
+static void *
+list_remote (void *data)
+{
+  struct initial_sync *sync = data;
+
+  list_files_cf (&sync->cf_files, NULL, sync->exclusions, sync->arena);
+  log_phase ("remote-listing", sync->start);
+  g_atomic_int_set (&sync->remote_done, TRUE);
+  return NULL;
+}
+
+static int
+sync_dir (const gchar * path, void *data)
+{
+  struct initial_sync *sync = data;
+  return sync->on_dir != NULL ? sync->on_dir (path, sync->on_dir_data) : 0;
+}
+
+static int
+sync_file (gchar * path, struct stat *st, void *data)
+{
+  struct initial_sync *sync = data;
+  local_file *lf = build_local_file (path, cfg->monitor_dir, st);
+
+  if (g_atomic_int_get (&sync->remote_done) && !event_buffer_contains (lf->cf_name)) {
+    cf_file *cf = g_hash_table_lookup (sync->cf_files, lf->cf_name);
+    if (cf == NULL || cf->len != lf->ver.size) {
+      log_msg (LOG_DEBUG, "'%s' is missing or differs in size on remote - need uploading", lf->name);
+      /* compare_local still needs to know we have it. The upload thread frees lf, so this has to go first */
+      g_hash_table_insert (sync->local_files, g_strdup (lf->cf_name), NULL);
+      g_async_queue_push (files_to_upload, lf);
+      sync->early_uploads++;
+      return 0;
+    }
+  }
+
+  g_hash_table_insert (sync->local_files, g_strdup (lf->cf_name), lf);
+  return 0;
+}
+
+/* Every directory walked is passed to on_dir (if not NULL) before any of the files in it are looked at */
+void
+initial_sync (struct exclusions *exclusions, walk_dir_cb on_dir, void *on_dir_data)
+{
+  struct initial_sync sync;
+  pthread_t list_thread;
+  int rc;
+  gint64 start = g_get_monotonic_time (), compare_start;
+
+  sync.start = start;
+  sync.exclusions = exclusions;
+  sync.cf_files = g_hash_table_new (g_str_hash, g_str_equal);
+  sync.arena = arena_new ();
+  sync.local_files = g_hash_table_new_full (g_str_hash, g_str_equal, (GDestroyNotify) free_single_pointer, NULL);
+  sync.remote_done = FALSE;
+  sync.on_dir = on_dir;
+  sync.on_dir_data = on_dir_data;
+  sync.early_uploads = 0;
+
+  rc = pthread_create (&list_thread, NULL, list_remote, &sync);
+  if (rc != 0)
+    suicide ("Failed to spawn listing thread. Error code: %d\n", rc);
+
+  if (walk_tree (cfg->monitor_dir, exclusions, sync_dir, sync_file, &sync) < 0) {
+    log_msg (LOG_CRIT, "Failed to obtain list of local files.\n");
+    exit (EXIT_FAILURE);
+  }
+  log_msg (LOG_INFO, "Walked %u local files in %.2fs (%lu queued for upload on the way)", g_hash_table_size (sync.local_files),
+	   (g_get_monotonic_time () - start) / 1000000.0, sync.early_uploads);
+  log_phase ("local-walk", start);
+
+  pthread_join (list_thread, NULL);
+  compare_start = g_get_monotonic_time ();
+
+  /* populate GQueue files_to_upload */
+  GList *to_be_free_lf = compare_remote (sync.local_files, sync.cf_files);
+  /* populate GQueue files_to_delete */
+  compare_local (sync.cf_files, sync.local_files);
+
+  /* Now remove any lf structures we no longer need (ie. they are already synced don't need to be uploaded) */
+  free_lfs (to_be_free_lf, sync.local_files);
+  g_list_free_full (to_be_free_lf, free_single_pointer);
+  g_hash_table_destroy (sync.local_files);
+  g_hash_table_destroy (sync.cf_files);
+  arena_free (sync.arena);
+  log_phase ("compare", compare_start);
+
+  log_msg (LOG_INFO, "Initial sync done in %.2fs", (g_get_monotonic_time () - start) / 1000000.0);
+  log_phase ("initial-sync", start);
+}
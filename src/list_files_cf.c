@@ -0,0 +1,526 @@
+#include "ccfsync.h"
+#include <fcntl.h>
+
+/* Lists a container page by page without ever holding a whole page in memory.
+ *
+ * Each page is parsed as curl hands us the bytes: we only track nesting depth and string state, and buffer a
+ * single object at a time, which is handed to jansson once its closing brace arrives. When the last object of a
+ * full page has been seen we know the next marker, so the request for the next page is started while the
+ * remainder of the current one is still arriving.
+ */
+
+struct cf_lister {
+  CURLM *multi;
+  GList *pages;
+  const gchar *end_marker;
+  struct exclusions *exclusions;
+  /* Where records are allocated - NULL for the heap */
+  struct arena *arena;
+  cf_listing_cb cb;
+  void *cb_data;
+  int pipeline;
+  long objects;
+  int failed;
+};
+
+struct cf_listing_page {
+  struct cf_lister *lister;
+  CURL *curl;
+  struct curl_slist *headerlist;
+  gchar *url;
+  gchar *marker;
+  unsigned char attempts;
+  /* Parser state */
+  int depth;
+  int in_string;
+  int escaped;
+  /* The object currently being received */
+  gchar *obj;
+  size_t obj_len;
+  size_t obj_cap;
+  unsigned int objects;
+  gchar *last_name;
+  /* Set once we've asked for the page after this one */
+  int next_started;
+};
+
+static void start_page (struct cf_lister *lister, const gchar * marker, unsigned char attempts);
+
+/* Builds a cf_file from a single object of a listing, in arena if it isn't NULL. Returns NULL for entries without a name */
+cf_file *
+build_cf_file_from_json (json_t * obj, struct arena *arena)
+{
+  json_t *val;
+
+  val = json_object_get (obj, "name");
+  if (!json_is_string (val))
+    return NULL;
+
+  cf_file *f = new_cf_file (json_string_value (val), arena);
+
+  val = json_object_get (obj, "bytes");
+  f->len = json_integer_value (val);
+
+  val = json_object_get (obj, "content_type");
+  f->content_type = g_intern_string (json_is_string (val) ? json_string_value (val) : "");
+
+  /* Newer clusters list an SLO's own ETag separately (quoted), as its hash is then that of the manifest */
+  val = json_object_get (obj, "slo_etag");
+  if (json_is_string (val)) {
+    gchar *etag = g_strdup (json_string_value (val));
+    strip_char (etag, '"');
+    f->has_hash = hex_to_md5 (etag, f->md5) == 0;
+    free_single_pointer (etag);
+  }
+  else {
+    val = json_object_get (obj, "hash");
+    f->has_hash = json_is_string (val) && hex_to_md5 (json_string_value (val), f->md5) == 0;
+  }
+  /* Older clusters don't say, but anything this big we'd have uploaded as one */
+  if (json_is_string (json_object_get (obj, "slo_etag")) || slo_wanted (f->len))
+    slo_note (f->name);
+
+  return f;
+}
+
+/* A complete object has been buffered in page->obj */
+static void
+handle_listing_object (struct cf_listing_page *page)
+{
+  struct cf_lister *lister = page->lister;
+  json_error_t error;
+  json_t *obj = json_loadb (page->obj, page->obj_len, 0, &error);
+
+  page->objects++;
+  page->obj_len = 0;
+
+  if (!obj) {
+    log_msg (LOG_WARNING, "Failed to parse object in container listing: %s", error.text);
+    return;
+  }
+
+  cf_file *f = build_cf_file_from_json (obj, lister->arena);
+  json_decref (obj);
+  if (f == NULL)
+    return;
+
+  free_single_pointer (page->last_name);
+  page->last_name = g_strdup (f->name);
+
+  /* Don't do anything with files we're explicitly excluding */
+  if (regex_match (f->name, lister->exclusions)) {
+    destroy_cf_file (f, NULL);
+    return;
+  }
+  log_msg (LOG_DEBUG, "Remote file found: %s", f->name);
+
+  lister->objects++;
+  lister->cb (f, lister->cb_data);
+}
+
+static void
+append_obj (struct cf_listing_page *page, char c)
+{
+  if (page->obj_len == page->obj_cap) {
+    page->obj_cap = page->obj_cap ? page->obj_cap * 2 : 512;
+    page->obj = realloc (page->obj, page->obj_cap);
+    if (page->obj == NULL) {
+      log_msg (LOG_CRIT, "realloc() failed\n");
+      exit (EXIT_FAILURE);
+    }
+  }
+  page->obj[page->obj_len++] = c;
+}
+
+static size_t
+listing_write_data (void *ptr, size_t size, size_t nmemb, void *arg)
+{
+  struct cf_listing_page *page = arg;
+  const char *p = ptr;
+  size_t i, n = size * nmemb;
+  long http_code = 0;
+
+  /* Error bodies aren't listings, throw them away */
+  curl_easy_getinfo (page->curl, CURLINFO_RESPONSE_CODE, &http_code);
+  if (http_code != 200)
+    return n;
+
+  for (i = 0; i < n; i++) {
+    char c = p[i];
+
+    if (page->depth >= 2)
+      append_obj (page, c);
+
+    if (page->in_string) {
+      if (page->escaped)
+	page->escaped = FALSE;
+      else if (c == '\\')
+	page->escaped = TRUE;
+      else if (c == '"')
+	page->in_string = FALSE;
+      continue;
+    }
+
+    switch (c) {
+    case '"':
+      page->in_string = TRUE;
+      break;
+    case '[':
+    case '{':
+      if (page->depth++ == 1)
+	append_obj (page, c);
+      break;
+    case ']':
+    case '}':
+      if (--page->depth == 1)
+	handle_listing_object (page);
+      break;
+    default:
+      break;
+    }
+  }
+
+  return n;
+}
+
+static void
+destroy_page (struct cf_listing_page *page)
+{
+  struct cf_lister *lister = page->lister;
+  lister->pages = g_list_remove (lister->pages, page);
+  curl_multi_remove_handle (lister->multi, page->curl);
+  shared_curl_count (page->curl);
+  curl_easy_cleanup (page->curl);
+  curl_slist_free_all (page->headerlist);
+  free_single_pointer (page->obj);
+  free_single_pointer (page->url);
+  free_single_pointer (page->marker);
+  free_single_pointer (page->last_name);
+  free_single_pointer (page);
+}
+
+static void
+start_page (struct cf_lister *lister, const gchar * marker, unsigned char attempts)
+{
+  struct cf_listing_page *page = malloc (sizeof (struct cf_listing_page));
+  char *escaped;
+
+  page->lister = lister;
+  page->headerlist = NULL;
+  page->url = NULL;
+  page->marker = marker ? g_strdup (marker) : NULL;
+  page->attempts = attempts;
+  page->depth = 0;
+  page->in_string = FALSE;
+  page->escaped = FALSE;
+  page->obj = NULL;
+  page->obj_len = 0;
+  page->obj_cap = 0;
+  page->objects = 0;
+  page->last_name = NULL;
+  page->next_started = FALSE;
+
+  if ((page->curl = curl_easy_init ()) == NULL)
+    suicide ("Failed to init curl: %s\n", strerror (errno));
+  shared_curl_attach (page->curl);
+
+  Sasprintf (page->url, "%s/%s?format=json", auth->endpoint, cfg->container);
+  if (marker != NULL) {
+    escaped = curl_easy_escape (page->curl, marker, 0);
+    Sasprintf (page->url, "%s&marker=%s", page->url, escaped);
+    curl_free (escaped);
+  }
+  if (lister->end_marker != NULL) {
+    escaped = curl_easy_escape (page->curl, lister->end_marker, 0);
+    Sasprintf (page->url, "%s&end_marker=%s", page->url, escaped);
+    curl_free (escaped);
+  }
+
+  page->headerlist = curl_slist_append (page->headerlist, (const char *) "Accept: application/json");
+  page->headerlist = curl_slist_append (page->headerlist, auth->token_header);
+
+  curl_easy_setopt (page->curl, CURLOPT_HTTPHEADER, page->headerlist);
+  curl_easy_setopt (page->curl, CURLOPT_URL, page->url);
+  curl_easy_setopt (page->curl, CURLOPT_WRITEFUNCTION, listing_write_data);
+  curl_easy_setopt (page->curl, CURLOPT_WRITEDATA, page);
+  curl_easy_setopt (page->curl, CURLOPT_PRIVATE, page);
+
+  log_msg (LOG_DEBUG, "Listing container: %s", page->url);
+  lister->pages = g_list_append (lister->pages, page);
+  curl_multi_add_handle (lister->multi, page->curl);
+}
+
+/* Deals with a page whose request has completed */
+static void
+finish_page (struct cf_lister *lister, struct cf_listing_page *page, CURLcode res)
+{
+  long http_code = 0;
+  gint64 delay;
+  curl_easy_getinfo (page->curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+  if (res != CURLE_OK)
+    log_msg (LOG_ERR, "Error performing request: %s\n", curl_easy_strerror (res));
+
+  /* If we've seen a full page, the next one is already on its way and a truncated tail doesn't matter */
+  if (page->next_started) {
+    destroy_page (page);
+    return;
+  }
+
+  if (res == CURLE_OK && (http_code == 200 || http_code == 204)) {
+    if (page->objects >= CF_LISTING_LIMIT && page->last_name != NULL)
+      start_page (lister, page->last_name, 0);
+    destroy_page (page);
+    return;
+  }
+
+  if (retry_decide ("Container listing", res == CURLE_OK ? http_code : 0, 200, &page->attempts, curl_retry_after (page->curl), &delay)
+      != RETRY_AGAIN) {
+    log_msg (LOG_ERR, "Got %d back when trying to list files. Container doesn't exist? Giving up.", (int) http_code);
+    lister->failed = TRUE;
+    destroy_page (page);
+    return;
+  }
+  log_msg (LOG_WARNING, "Got %d back when trying to list files. Retrying (attempt %d of %d)...", (int) http_code, page->attempts + 1,
+	   cfg->retry_attempts);
+  /* Listing is only done up front, with nothing else for us to get on with - just wait */
+  g_usleep (delay);
+
+  /* Objects we already passed on will be passed on again - callbacks have to cope with duplicates */
+  start_page (lister, page->marker, page->attempts);
+  destroy_page (page);
+}
+
+/* Lists the objects after marker (and before end_marker, if not NULL), passing each one to cb.
+ * With pipeline set, the next page is requested as soon as the current one is known to be full, which means
+ * objects aren't necessarily delivered in order. Returns the number of objects listed, or -1 on failure.
+ */
+long
+list_files_cf_range (const gchar * marker, const gchar * end_marker, struct exclusions *exclusions, int pipeline, struct arena *arena,
+		     cf_listing_cb cb, void *cb_data)
+{
+  struct cf_lister lister;
+  int running = 0;
+  CURLMsg *msg;
+  int msgs_left;
+  GList *l;
+
+  lister.multi = curl_multi_init ();
+  lister.pages = NULL;
+  lister.end_marker = end_marker;
+  lister.exclusions = exclusions;
+  lister.arena = arena;
+  lister.cb = cb;
+  lister.cb_data = cb_data;
+  lister.pipeline = pipeline;
+  lister.objects = 0;
+  lister.failed = FALSE;
+
+  if (lister.multi == NULL)
+    suicide ("Failed to init curl: %s\n", strerror (errno));
+
+  start_page (&lister, marker, 0);
+
+  while (lister.pages != NULL) {
+    curl_multi_perform (lister.multi, &running);
+
+    while ((msg = curl_multi_info_read (lister.multi, &msgs_left))) {
+      struct cf_listing_page *page;
+      if (msg->msg != CURLMSG_DONE)
+	continue;
+      curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, (char **) &page);
+      finish_page (&lister, page, msg->data.result);
+    }
+
+    if (lister.failed)
+      break;
+
+    /* Start on the next page as soon as we know where it begins */
+    if (lister.pipeline) {
+      for (l = lister.pages; l != NULL; l = l->next) {
+	struct cf_listing_page *page = l->data;
+	if (!page->next_started && page->objects == CF_LISTING_LIMIT && page->last_name != NULL) {
+	  page->next_started = TRUE;
+	  start_page (&lister, page->last_name, 0);
+	  break;
+	}
+      }
+    }
+
+    if (lister.pages != NULL)
+      curl_multi_wait (lister.multi, NULL, 0, 1000, NULL);
+  }
+
+  while (lister.pages != NULL)
+    destroy_page (lister.pages->data);
+  curl_multi_cleanup (lister.multi);
+
+  return lister.failed ? -1 : lister.objects;
+}
+
+/* Lists everything below the directory cf_name on CF, passing each object to cb */
+void
+list_cf_dir (const gchar * cf_name, struct exclusions *exclusions, cf_listing_cb cb, void *cb_data)
+{
+  /* Everything in the directory is in the range ("dir/", "dir0") - '0' being the character after '/' */
+  gchar *marker = g_strconcat (cf_name, "/", NULL);
+  gchar *end_marker = g_strconcat (cf_name, "0", NULL);
+
+  if (list_files_cf_range (marker, end_marker, exclusions, FALSE, NULL, cb, cb_data) < 0)
+    log_msg (LOG_ERR, "Failed to list the contents of '%s' on CF - they may need deleting by hand", cf_name);
+  free_single_pointer (marker);
+  free_single_pointer (end_marker);
+}
+
+static void
+insert_cf_file (cf_file * f, void *data)
+{
+  GHashTable *cf_files = data;
+
+  /* Retried pages hand us objects we've already got */
+  if (g_hash_table_lookup (cf_files, f->name)) {
+    destroy_cf_file (f, NULL);
+    return;
+  }
+  g_hash_table_insert (cf_files, f->name, f);
+}
+
+struct listing_partition {
+  int id;
+  gchar *marker;
+  gchar *end_marker;
+  struct exclusions *exclusions;
+  struct arena *arena;
+  GHashTable *cf_files;
+  long objects;
+  gint64 elapsed;
+};
+
+static void *
+list_partition (void *data)
+{
+  struct listing_partition *part = data;
+  gint64 start = g_get_monotonic_time ();
+
+  part->objects = list_files_cf_range (part->marker, part->end_marker, part->exclusions, TRUE, part->arena, insert_cf_file, part->cf_files);
+  part->elapsed = g_get_monotonic_time () - start;
+  return NULL;
+}
+
+static gint
+compare_dir_names (gconstpointer a, gconstpointer b)
+{
+  return strcmp (*(gchar * const *) a, *(gchar * const *) b);
+}
+
+/* Returns the sorted (byte order, as CF sorts) names of the directories directly under monitor_dir */
+static GPtrArray *
+top_level_dirs ()
+{
+  GPtrArray *dirs = g_ptr_array_new_with_free_func ((GDestroyNotify) free_single_pointer);
+  struct dirent *entry;
+  DIR *dir = opendir (cfg->monitor_dir);
+
+  if (dir == NULL) {
+    log_msg (LOG_WARNING, "Failed to open directory %s for listing: %s", cfg->monitor_dir, strerror (errno));
+    return dirs;
+  }
+  while ((entry = readdir (dir))) {
+    if (strcmp (entry->d_name, ".") == 0 || strcmp (entry->d_name, "..") == 0)
+      continue;
+    if (entry->d_type == DT_DIR)
+      g_ptr_array_add (dirs, g_strdup (entry->d_name));
+    else if (entry->d_type == DT_UNKNOWN) {
+      struct stat st;
+      if (fstatat (dirfd (dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR (st.st_mode))
+	g_ptr_array_add (dirs, g_strdup (entry->d_name));
+    }
+  }
+  closedir (dir);
+  g_ptr_array_sort (dirs, compare_dir_names);
+  return dirs;
+}
+
+/* Splits the container keyspace at the top-level directories of monitor_dir and lists the ranges concurrently */
+static int
+list_files_cf_partitioned (GHashTable * cf_files, struct exclusions *exclusions, struct arena *arena)
+{
+  GPtrArray *dirs = top_level_dirs ();
+  int num_parts = cfg->listing_partitions;
+  int i, rc, failed = FALSE;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  /* Can't split finer than the number of top-level directories */
+  if (num_parts > (int) dirs->len + 1)
+    num_parts = dirs->len + 1;
+
+  struct listing_partition parts[num_parts];
+  pthread_t threads[num_parts];
+  gchar *boundaries[num_parts + 1];
+
+  boundaries[0] = NULL;
+  boundaries[num_parts] = NULL;
+  for (i = 1; i < num_parts; i++)
+    boundaries[i] = g_ptr_array_index (dirs, (guint) i * dirs->len / num_parts);
+
+  gint64 start = g_get_monotonic_time ();
+  for (i = 0; i < num_parts; i++) {
+    parts[i].id = i;
+    /* Both markers are exclusive. Starting after the directory name itself still takes in everything below it,
+     * and ending at "next/" (rather than "next") keeps an object called just "next" in the partition before it.
+     * What sorts between "next" and "next/" is listed by both partitions, which insert_cf_file() copes with.
+     * Both are whole names, so still valid UTF-8 - which CF insists on
+     */
+    parts[i].marker = boundaries[i] ? g_strdup (boundaries[i]) : NULL;
+    parts[i].end_marker = boundaries[i + 1] ? g_strconcat (boundaries[i + 1], "/", NULL) : NULL;
+    parts[i].exclusions = exclusions;
+    /* Arenas aren't thread safe - each partition gets its own, handed over to the caller's afterwards */
+    parts[i].arena = arena != NULL ? arena_new () : NULL;
+    parts[i].cf_files = g_hash_table_new (g_str_hash, g_str_equal);
+    parts[i].objects = 0;
+    parts[i].elapsed = 0;
+    rc = pthread_create (&threads[i], NULL, list_partition, &parts[i]);
+    if (rc != 0)
+      suicide ("Failed to spawn listing thread #%d. Error code: %d\n", i, rc);
+  }
+
+  for (i = 0; i < num_parts; i++) {
+    pthread_join (threads[i], NULL);
+    log_msg (LOG_INFO, "Listing partition %d ('%s' - '%s'): %ld objects in %.2fs", i,
+	     parts[i].marker ? parts[i].marker : "", parts[i].end_marker ? parts[i].end_marker : "", parts[i].objects, parts[i].elapsed / 1000000.0);
+    if (parts[i].objects < 0)
+      failed = TRUE;
+
+    /* Merge into the caller's table, dropping objects listed by both neighbouring partitions */
+    g_hash_table_iter_init (&iter, parts[i].cf_files);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+      insert_cf_file (value, cf_files);
+    g_hash_table_destroy (parts[i].cf_files);
+    if (arena != NULL)
+      arena_merge (arena, parts[i].arena);
+    free_single_pointer (parts[i].marker);
+    free_single_pointer (parts[i].end_marker);
+  }
+  log_msg (LOG_INFO, "Listed %u objects in %d partitions in %.2fs", g_hash_table_size (cf_files), num_parts, (g_get_monotonic_time () - start) / 1000000.0);
+
+  g_ptr_array_free (dirs, TRUE);
+  return failed ? -1 : 0;
+}
+
+/* Lists the whole container (or everything after marker) into cf_files, keyed on name. Records are allocated
+ * in arena, if it isn't NULL, in which case they go away with it.
+ */
+void
+list_files_cf (GHashTable ** cf_files, gchar * marker, struct exclusions *exclusions, struct arena *arena)
+{
+  if (marker == NULL && cfg->listing_partitions > 1) {
+    if (list_files_cf_partitioned (*cf_files, exclusions, arena) < 0)
+      suicide ("Something went wrong when listing files in container %s. Bailing...\n", cfg->container);
+  }
+  else if (list_files_cf_range (marker, NULL, exclusions, TRUE, arena, insert_cf_file, *cf_files) < 0)
+    suicide ("Something went wrong when listing files in container %s. Bailing...\n", cfg->container);
+
+  if (arena != NULL)
+    log_msg (LOG_DEBUG, "Listing of %u objects held in %lu bytes", g_hash_table_size (*cf_files), (unsigned long) arena_size (arena));
+}
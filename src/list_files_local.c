@@ -12,165 +12,194 @@
 
 #define HASH_CHUNK_SIZE 65000
 
-GList *
-listdir (char *name, char *parent, int level, struct exclusions * exclusions)
-{
-  DIR *dir;
-  struct dirent *entry;
-  GList *file_list = NULL;
-
-  if (!(dir = opendir (name))) {
-    log_msg (LOG_CRIT, "Failed to open directory %s for listing", name);
-    return NULL;
-  }
-  if (!(entry = readdir (dir))) {
-    log_msg (LOG_CRIT, "Failed to read directory %s", name);
-    return NULL;
-  }
-
-  do {
-
-    if (strcmp (entry->d_name, ".") == 0 || strcmp (entry->d_name, "..") == 0) {
-      continue;
-    }
-
-    gchar *fullpath = NULL;
-    Sasprintf (fullpath, "%s/%s", name, entry->d_name);
+struct local_scan {
+  gchar *base_dir;
+  GPtrArray *lfs;
+};
 
-    if (regex_match (fullpath, exclusions)) {
-      free_single_pointer (fullpath);
-      continue;
-    }
-
-    /* XFS doesn't set d_type, it's always 0 - need to stat */
-    /* if (entry->d_type == DT_DIR) { */
-    
-    struct stat st;
-    if (stat(fullpath, &st) < 0){ 
-      free_single_pointer (fullpath);
-      continue;
-    }
-    if (S_ISDIR(st.st_mode)){
-      GList *tmp = NULL;
-      tmp = listdir (fullpath, parent, level + 1, exclusions);
-      free_single_pointer (fullpath);
-
-      unsigned int i;
-      /* Copy the list we obtained from the recursion into the one we're returning */
-      for (i = 0; i < g_list_length (tmp); i++) {
-	gchar *tmp_data = g_list_nth_data (tmp, i);
-	file_list = g_list_prepend (file_list, g_strdup (tmp_data));
-	free_single_pointer (tmp_data);
-      }
-      g_list_free (tmp);
-    }
-    else {
-      file_list = g_list_prepend (file_list, fullpath);
-    }
-  } while ((entry = readdir (dir)));
-
-  closedir (dir);
-
-  return file_list;
+static int
+scan_file (gchar * path, struct stat *st, void *data)
+{
+  struct local_scan *scan = data;
+  g_ptr_array_add (scan->lfs, build_local_file (path, scan->base_dir, st));
+  return 0;
 }
 
-
+/* Returns the files in lfs (unhashed) in a hash table keyed on their CF names. Frees lfs */
 GHashTable *
-stat_local_files (GList * files, gchar * base_dir, struct exclusions * exclusions)
+index_local_files (GPtrArray * lfs)
 {
   GHashTable *local_files = g_hash_table_new_full (g_str_hash, g_str_equal, (GDestroyNotify) free_single_pointer, NULL);
   unsigned int i;
 
-  for (i = 0; i < g_list_length (files); i++) {
-    char *file = g_list_nth_data (files, i);
-    if (regex_match (file, exclusions)) {
-      continue;
-    }
-    local_file *lf = stat_local_file (file, base_dir);
-    if (lf != NULL)
-      g_hash_table_insert (local_files, g_strdup ((char *) lf->name), lf);
+  for (i = 0; i < lfs->len; i++) {
+    local_file *lf = g_ptr_array_index (lfs, i);
+    g_hash_table_insert (local_files, g_strdup (lf->cf_name), lf);
   }
+  g_ptr_array_free (lfs, TRUE);
   return local_files;
 }
 
-/* Gathers information about a single file on the filesystem */
-local_file *
-stat_local_file (gchar * file, gchar * base_dir)
+/* MD5s a file into md5 (MD5_DIGEST_LENGTH bytes). Returns -1 if the file can't be read */
+int
+hash_file (gchar * file, unsigned char *md5)
 {
-
-  local_file *lf = malloc (sizeof (local_file));
-  lf->st = malloc (sizeof (struct stat));
-  /* Turn /data/path/file into file */
-  lf->cf_name = g_strdup (file + strlen (base_dir) + 1);
-  lf->name = g_strdup ((char *) file);
-  lf->sentinel = g_strdup ("ok");
-
   int bytes;
   unsigned char data[HASH_CHUNK_SIZE];
-  unsigned char c[MD5_DIGEST_LENGTH + 1];
-  char c_buf[MD5_DIGEST_LENGTH + 1];
-  /* Because MD5.... ..... */
-  char hash_copy[MD5_DIGEST_LENGTH * 2 + 1];
-
-  memset (hash_copy, 0, sizeof (hash_copy));
 
   FILE *fp = fopen ((char *) file, "rb");
-  if (!fp) {
-    log_msg (LOG_WARNING, "Failed to read file '%s' for hashing. Do you have read permissions? Or did it live a very short life?\n", (char *) file);
-    free_single_pointer (lf->name);
-    free_single_pointer (lf->cf_name);
-    free_single_pointer (lf->st);
-    free_single_pointer (lf->sentinel);
-    free_single_pointer (lf);
-    free_single_pointer (file);
-    return NULL;
-  }
-
+  if (!fp)
+    return -1;
 
   MD5_CTX mdContext;
   MD5_Init (&mdContext);
   while ((bytes = fread (data, 1, HASH_CHUNK_SIZE, fp)) != 0)
     MD5_Update (&mdContext, data, bytes);
   fclose (fp);
-  MD5_Final (c, &mdContext);
-  c[MD5_DIGEST_LENGTH] = '\0';
+  MD5_Final (md5, &mdContext);
+  return 0;
+}
+
+/* Turns a binary MD5 into the lower-case hex form CF uses */
+void
+md5_to_hex (unsigned char *md5, char *hex)
+{
+  int j;
+  for (j = 0; j < MD5_DIGEST_LENGTH; j++)
+    snprintf (hex + j * 2, 3, "%02x", md5[j]);
+}
+
+/* Parses a 32 character hex MD5 (as found in CF listings). Returns -1 if hex isn't one */
+int
+hex_to_md5 (const gchar * hex, unsigned char *md5)
+{
   int j;
+
+  if (strlen (hex) != MD5_DIGEST_LENGTH * 2)
+    return -1;
   for (j = 0; j < MD5_DIGEST_LENGTH; j++) {
-    snprintf (c_buf, sizeof (c_buf), "%02x", c[j]);
-    strncat (hash_copy, c_buf, strlen (c_buf));
+    int hi = g_ascii_xdigit_value (hex[j * 2]);
+    int lo = g_ascii_xdigit_value (hex[j * 2 + 1]);
+    if (hi < 0 || lo < 0)
+      return -1;
+    md5[j] = (unsigned char) (hi << 4 | lo);
   }
-  lf->hash = g_strdup (hash_copy);
+  return 0;
+}
 
+void
+file_version_from_stat (struct file_version *v, struct stat *st)
+{
+  v->dev = (guint64) st->st_dev;
+  v->ino = (guint64) st->st_ino;
+  v->size = (guint64) st->st_size;
+  v->mtime_ns = (guint64) st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+  v->ctime_ns = (guint64) st->st_ctim.tv_sec * 1000000000ULL + st->st_ctim.tv_nsec;
+}
+
+/* TRUE if a file still looks the way it did when v was taken, as far as we can tell */
+int
+stat_unchanged (struct file_version *v, struct stat *st)
+{
+  struct file_version now;
+  file_version_from_stat (&now, st);
+  return memcmp (v, &now, sizeof (struct file_version)) == 0;
+}
+
+/* Builds a local_file (without a hash) from a stat() we've already done. Takes ownership of file */
+local_file *
+build_local_file (gchar * file, gchar * base_dir, struct stat *st)
+{
+  local_file *lf = malloc (sizeof (local_file) + strlen (file) + 1);
+  file_version_from_stat (&lf->ver, st);
+  strcpy (lf->name, file);
+  /* Turn /data/path/file into file */
+  lf->cf_name = lf->name + strlen (base_dir) + 1;
+  lf->type = RECORD_FILE;
+  lf->has_hash = FALSE;
+  lf->attempts = 0;
+  free_single_pointer (file);
 
-  if ((stat ((char *) file, lf->st)) < 0) {
-    log_msg (LOG_WARNING, "In stat_local_file: Failed to stat file %s: %s", lf->name, strerror (errno));
-    free_single_pointer (lf->name);
-    free_single_pointer (lf->cf_name);
-    free_single_pointer (lf->sentinel);
-    free_single_pointer (lf->hash);
-    free_single_pointer (lf->st);
-    free_single_pointer (lf);
+  return lf;
+}
+
+/* Gathers information about a single file on the filesystem, without hashing it (lf->has_hash is FALSE) */
+local_file *
+stat_local_file_nohash (gchar * file, gchar * base_dir)
+{
+  struct stat st;
+
+  if ((stat ((char *) file, &st)) < 0) {
+    log_msg (LOG_WARNING, "In stat_local_file: Failed to stat file %s: %s", file, strerror (errno));
     free_single_pointer (file);
     return NULL;
   }
-  free_single_pointer (file);
 
+  return build_local_file (file, base_dir, &st);
+}
+
+/* Fills in lf->md5, reading the file only if it has changed since we last hashed it. Returns -1 if the file can't be read.
+ * For a file that's uploaded as an SLO, that's the ETag CF gives the SLO rather than the MD5 of the file
+ */
+int
+hash_local_file (local_file * lf)
+{
+  unsigned char *c = lf->md5;
+  int rc;
+
+  if (!hash_cache_lookup (&lf->ver, c)) {
+    if (slo_wanted (lf->ver.size))
+      rc = slo_hash_file (lf->name, lf->ver.size, c);
+    else
+      rc = hash_file (lf->name, c);
+    if (rc < 0) {
+      log_msg (LOG_WARNING, "Failed to read file '%s' for hashing. Do you have read permissions? Or did it live a very short life?\n", lf->name);
+      return -1;
+    }
+
+    /* Don't cache a hash of a file that was written to while we were reading it */
+    struct stat after;
+    if (stat (lf->name, &after) == 0 && stat_unchanged (&lf->ver, &after))
+      hash_cache_insert (&lf->ver, c);
+  }
+
+  lf->has_hash = TRUE;
+  return 0;
+}
+
+/* Gathers information about a single file on the filesystem */
+local_file *
+stat_local_file (gchar * file, gchar * base_dir)
+{
+  local_file *lf = stat_local_file_nohash (file, base_dir);
+  if (lf == NULL)
+    return NULL;
+
+  if (hash_local_file (lf) < 0) {
+    destroy_local_file (lf);
+    return NULL;
+  }
   return lf;
 }
 
 
+/* Walks dir and returns every file below it (not hashed yet - compare_remote does that when it needs to), keyed
+ * on CF name.
+ */
 GHashTable *
 list_files_local (char *dir, char *monitor_dir, struct exclusions * exclusions)
 {
-  GList *files = NULL;
-  files = listdir (dir, dir, 0, exclusions);
-  if (files == NULL)
-    return NULL;
-  GHashTable *local_files = stat_local_files (files, monitor_dir, exclusions);
-  if (local_files == NULL)
-    return NULL;
+  struct local_scan scan;
 
-  g_list_free (files);
+  scan.base_dir = monitor_dir;
+  scan.lfs = g_ptr_array_new ();
 
-  return local_files;
+  if (walk_tree (dir, exclusions, NULL, scan_file, &scan) < 0) {
+    /* Whatever was found before the walk failed */
+    g_ptr_array_set_free_func (scan.lfs, (GDestroyNotify) destroy_local_file);
+    g_ptr_array_free (scan.lfs, TRUE);
+    return NULL;
+  }
+
+  return index_local_files (scan.lfs);
 }
@@ -94,3 +94,10 @@ log_msg (int level, char *fmt, ...)
   free(time_str);
   return 0;
 }
+
+/* Logs how long a startup phase took, in a fixed format that's easy to pick out of the log (see extras/bench) */
+void
+log_phase (const char *name, gint64 since)
+{
+  log_msg (LOG_INFO, "startup-phase name=%s elapsed_ms=%ld", name, (long) ((g_get_monotonic_time () - since) / 1000));
+}
@@ -56,7 +56,47 @@ validate_config ()
     validate_error ("A valid API key (-k)");
   if (cfg->pid_file == NULL)
     validate_error ("A PID file path (-p)");
-  if (cfg->num_upload_threads + cfg->num_delete_threads + cfg->num_copy_threads > 100 )
+  if (cfg->transfer_engine == TRANSFER_MULTI && cfg->max_inflight < 1)
+    validate_error ("max_inflight of at least 1");
+  if (cfg->bulk_delete_max < 0)
+    validate_error ("a bulk_delete_max of 0 or more");
+  if (cfg->http2_max_streams < 1)
+    validate_error ("http2_max_streams of at least 1");
+  if (cfg->slo_threshold < 0)
+    validate_error ("an slo_threshold of 0 or more");
+  /* CF won't take segments (other than the last) under 1MB */
+  if (cfg->slo_segment_size < 1024 * 1024 || cfg->slo_segment_size > G_GINT64_CONSTANT (5368709120))
+    validate_error ("an slo_segment_size between 1MB and 5GB");
+  if (cfg->slo_segment_threads < 1 || cfg->slo_segment_threads > MAX_THREADS)
+    validate_error ("slo_segment_threads between 1 and 10");
+  /* Attempts are counted in an unsigned char */
+  if (cfg->retry_attempts < 1 || cfg->retry_attempts > 255)
+    validate_error ("retry_attempts between 1 and 255");
+  if (cfg->retry_max_delay < 1)
+    validate_error ("a retry_max_delay of at least 1 second");
+  if (cfg->rate_limits[RATE_BYTES] < 0 || cfg->rate_limits[RATE_PUT] < 0 || cfg->rate_limits[RATE_DELETE] < 0
+      || cfg->rate_limits[RATE_COPY] < 0)
+    validate_error ("rate limits of 0 or more");
+  /* What curl will take */
+  if (cfg->upload_buffer_size < 16 * 1024 || cfg->upload_buffer_size > 2 * 1024 * 1024)
+    validate_error ("an upload_buffer_size between 16KB and 2MB");
+  if (cfg->coalesce_quiet_period < 0)
+    validate_error ("a coalesce_quiet_period of 0 or more");
+  if (cfg->coalesce_max_delay < cfg->coalesce_quiet_period)
+    validate_error ("a coalesce_max_delay no shorter than coalesce_quiet_period");
+  if (cfg->write_idle_timeout < 1)
+    validate_error ("a write_idle_timeout of at least 1 second");
+  if (cfg->http_version == HTTP_VERSION_2 || cfg->http_version == HTTP_VERSION_2_PRIOR_KNOWLEDGE) {
+    if (!(curl_version_info (CURLVERSION_NOW)->features & CURL_VERSION_HTTP2))
+      log_msg (LOG_WARNING, "Warning: libcurl was built without HTTP/2 support - falling back to HTTP/1.1");
+#if LIBCURL_VERSION_NUM < 0x073100
+    log_msg (LOG_WARNING, "Warning: ccfsyncd was built against a libcurl too old to ask for HTTP/2 - falling back to HTTP/1.1");
+#endif
+    if (cfg->transfer_engine == TRANSFER_THREADS)
+      log_msg (LOG_WARNING, "Warning: requests are only multiplexed over shared HTTP/2 connections with transfer_engine=multi. "
+	       "Each thread will still use a connection of its own");
+  }
+  if (cfg->transfer_engine == TRANSFER_THREADS && cfg->num_upload_threads + cfg->num_delete_threads + cfg->num_copy_threads > 100 )
     log_msg(LOG_WARNING, "Warning: Number of threads exceed 100. This is counter-productive, as CF will throttle you. Please consider lowering your thread count");
 
 
@@ -127,7 +167,7 @@ suicide (gchar * fmt, ...)
   if (!threaded)
     exit(EXIT_FAILURE);
 
-  /* This will run through signal handlers and exit as nicely as possible */
+  /* signal_thread() picks this up, and exits as nicely as possible */
   kill (getpid (), SIGTERM);
 }
 
@@ -138,7 +178,8 @@ get_cf_files_from_dir (gchar * dir, struct exclusions *exclusions)
 {
   GList *files = NULL;
   GHashTable *files_hash = g_hash_table_new (g_str_hash, g_str_equal);
-  list_files_cf (&files_hash, NULL, exclusions);
+  struct arena *arena = arena_new ();
+  list_files_cf (&files_hash, NULL, exclusions, arena);
   GHashTableIter iter;
   gpointer key, value;
 
@@ -147,55 +188,34 @@ get_cf_files_from_dir (gchar * dir, struct exclusions *exclusions)
     if (strncmp (key, dir, strlen ((char *) dir)) == 0) {
       files = g_list_prepend (files, g_strdup (key));
     }
-    destroy_cf_file ((cf_file *) value, key);
   }
 
   g_hash_table_destroy (files_hash);
+  arena_free (arena);
   return files;
 
 }
 
+static int
+collect_dir (const gchar * path, void *data)
+{
+  GList **dirs = data;
+  *dirs = g_list_prepend (*dirs, g_strdup (path));
+  return 0;
+}
+
+/* Returns every directory below name (but not name itself) */
 GList *
 get_dirs (gchar * name, gchar * parent)
 {
-
-  DIR *dir;
-  struct dirent *entry;
-  unsigned int i;
   GList *ret = NULL;
-  if (!(dir = opendir (name))) {
-    perror ("opendir:");
-    return NULL;
-  }
-  if (!(entry = readdir (dir))) {
-    perror ("readdir:");
-    return NULL;
-  }
-
-  do {
-    if (entry->d_type == DT_DIR) {
-      if (strcmp (entry->d_name, ".") == 0 || strcmp (entry->d_name, "..") == 0)
-	continue;
-
-      char path[PATH_MAX + 1];
-      int len = snprintf (path, sizeof (path), "%s/%s", name, entry->d_name);
-      path[len] = '\0';
-      ret = g_list_append (ret, g_strdup (path));
-
-      /* Recurse and add to our return GList */
-      GList *tmp = get_dirs (path, parent);
-      for (i = 0; i < g_list_length (tmp); i++) {
-	gchar *tmp_data = g_strdup (g_list_nth_data (tmp, i));
-	ret = g_list_prepend (ret, g_strdup (tmp_data));
-	free_single_pointer (tmp_data);
-      }
-      g_list_free_full (tmp, free_single_pointer);
-
-    }
-  } while ((entry = readdir (dir)));
-
-  closedir (dir);
 
+  walk_tree (name, NULL, collect_dir, NULL, &ret);
+  /* walk_tree() reports name itself first, which ends up last */
+  if (ret != NULL && strcmp (g_list_last (ret)->data, name) == 0) {
+    free_single_pointer (g_list_last (ret)->data);
+    ret = g_list_delete_link (ret, g_list_last (ret));
+  }
   return ret;
 }
 
@@ -206,13 +226,21 @@ get_dirs (gchar * name, gchar * parent)
 cf_file *
 build_cf_file_from_lf (gchar * name)
 {
-  cf_file *cf = malloc (sizeof (cf_file));
-  cf->name = g_strdup (name);
-  cf->sentinel = g_strdup ("ok");
-  cf->content_type = g_strdup ("dummy");
-  cf->hash = g_strdup ("dummy");
-  cf->local_path = g_strdup ("dummy");
+  return new_cf_file (name, NULL);
+}
 
+/* Allocates a cf_file called name, in arena if it isn't NULL. Everything but the name is left blank */
+cf_file *
+new_cf_file (const gchar * name, struct arena *arena)
+{
+  size_t size = sizeof (cf_file) + strlen (name) + 1;
+  cf_file *cf = arena != NULL ? arena_alloc (arena, size) : malloc (size);
+
+  memset (cf, 0, sizeof (cf_file));
+  cf->type = RECORD_FILE;
+  cf->in_arena = arena != NULL;
+  cf->content_type = "";
+  strcpy (cf->name, name);
   return cf;
 }
 
@@ -2,102 +2,189 @@
 #include <sys/types.h>
 
 #include <sys/inotify.h>
+#include <poll.h>
 
 #define EVENT_SIZE  ( sizeof (struct inotify_event) )
 #define BUF_LEN     ( 1024 * ( EVENT_SIZE + 16 ) )
 
-gboolean
-event_wd_to_dir (gpointer key, gpointer value, gpointer user_data)
+struct watch_walk {
+  int inotify_fd;
+  struct watch_index *watches;
+  int monitor_events;
+};
+
+static int
+add_watch (const gchar * dir, void *data)
 {
-  return (GPOINTER_TO_INT (value)) == GPOINTER_TO_INT (user_data);
+  struct watch_walk *ww = data;
+  int wd = watch_index_add_watch (ww->watches, ww->inotify_fd, dir, ww->monitor_events);
+  return wd < 0 ? wd : 0;
 }
 
-gchar *
-wd_to_dir (GHashTable * watches, int wd)
+int
+add_watches_recursively (char *dir, int inotify_fd, struct watch_index *watches, int monitor_events)
 {
-  GHashTableIter iter;
-  gpointer key, value;
-  pthread_mutex_lock (&watches_mutex);
-  g_hash_table_iter_init (&iter, watches);
-  while (g_hash_table_iter_next (&iter, &key, &value)) {
-    if (GPOINTER_TO_INT (value) == wd) {
-      pthread_mutex_unlock (&watches_mutex);
-      return key;
-    }
-  }
-  pthread_mutex_unlock (&watches_mutex);
-  return NULL;
-
+  struct watch_walk ww;
+  ww.inotify_fd = inotify_fd;
+  ww.watches = watches;
+  ww.monitor_events = monitor_events;
+  return walk_tree (dir, NULL, add_watch, NULL, &ww);
 }
 
+/* Sets up inotify (or fanotify) for the monitor thread. No watches are added here - the initial sync walks monitor_dir anyway,
+ * so it adds them (through monitor_add_watch) as it goes, before it looks at any of the files in a directory.
+ */
+struct monitor_dir_data *
+init_monitor (struct exclusions *exclusions)
+{
+  struct monitor_dir_data *md = malloc (sizeof (struct monitor_dir_data));
 
+  md->exclusions = exclusions;
+  md->mount_fd = -1;
+  if (cfg->monitor_backend == MONITOR_FANOTIFY) {
+    init_monitor_fanotify (md);
+    return md;
+  }
+  md->monitor_events = IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVE;
+  /* Every watch gets the same mask - handle_dir_create() and handle_dir_move() take it from here too */
+  if (cfg->write_settle)
+    md->monitor_events |= IN_CLOSE_WRITE;
+  md->watches = watch_index_new ();
+  md->fd = inotify_init ();
+  if (md->fd < 0)
+    suicide ("Failed to initialise inotify: %s", strerror (errno));
+  move_table_init ();
+  return md;
+}
 
+/* walk_dir_cb for the initial sync. data is the struct monitor_dir_data from init_monitor */
 int
-add_watches_recursively (char *dir, int inotify_fd, GHashTable ** watches, int monitor_events)
+monitor_add_watch (const gchar * dir, void *data)
 {
+  struct monitor_dir_data *md = data;
+  struct watch_walk ww;
+
+  ww.inotify_fd = md->fd;
+  ww.watches = md->watches;
+  ww.monitor_events = md->monitor_events;
+  if (add_watch (dir, &ww) < 0)
+    suicide ("Error adding inotify watch on %s: %s", dir, strerror (errno));
+  return 0;
+}
 
-  unsigned int i;
-  int wd;
-  GList *dirs = get_dirs (dir, dir);
-  dirs = g_list_prepend (dirs, g_strdup (dir));
-  for (i = 0; i < g_list_length (dirs); i++) {
-/* TODO: inotify_add_watch doesn't warn if the directory doesn't exist.. check before - also check return code for -1s */
-    gchar *tmp_dir = g_strdup ((gchar *) g_list_nth_data (dirs, i));
-    wd = inotify_add_watch (inotify_fd, tmp_dir, monitor_events);
-    if (wd < 0) {
-      return wd;
-    }
-    pthread_mutex_lock (&watches_mutex);
-    g_hash_table_insert (*watches, tmp_dir, GINT_TO_POINTER (wd));
-    pthread_mutex_unlock (&watches_mutex);
+/* Hands a directory event off to handler, in a thread of its own */
+void
+start_dir_thread (void *(*handler) (void *), struct monitor_dir_data *md, const gchar * path, const gchar * cf_path,
+		  struct move_event *me)
+{
+  struct move_thread_data *mtd = calloc (1, sizeof (struct move_thread_data));
+  pthread_t thread;
+  pthread_attr_t attr;
+  int rc;
+
+  mtd->fd = md->fd;
+  mtd->watches = md->watches;
+  mtd->events_mask = md->monitor_events;
+  mtd->exclusions = md->exclusions;
+  mtd->md = md;
+  mtd->me = me;
+  mtd->tmp_path = g_strdup (path);
+  mtd->cf_tmp_path = g_strdup (cf_path);
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  rc = pthread_create (&thread, &attr, handler, mtd);
+  pthread_attr_destroy (&attr);
+  if (rc != 0)
+    suicide ("Failed to create thread for handling directory event on %s: %s\n", path, strerror (rc));
+}
+
+/* me never got its IN_MOVED_TO, so it's been moved out of the tree - which is the same as it being deleted */
+static void
+move_expired (struct move_event *me, void *data)
+{
+  struct monitor_dir_data *md = data;
+
+  if (!me->is_dir) {
+    log_msg (LOG_DEBUG, "File moved out of the tree: %s", me->full_local_path);
+    coalesce_delete (me->cf_name);
+    destroy_move_event (me);
+    return;
   }
-  g_list_free_full (dirs, free_single_pointer);
-  return 0;
+  /* The watches went with it, and would go on reporting what happens to it under its old name */
+  watch_index_rm_tree (md->watches, md->fd, me->full_local_path);
+  start_dir_thread (handle_dir_moved_out, md, me->full_local_path, me->cf_name, me);
 }
 
-void *
-monitor_dir_inotify (void *data)
+/* While the initial sync is running, events are only recorded (see event_buffer.c). New directories still
+ * need watching straight away though, or we'd miss what happens inside them.
+ * Returns TRUE if the event was dealt with.
+ */
+static int
+buffer_event (struct monitor_dir_data *md, struct inotify_event *event, gchar * path)
 {
+  int is_dir = (event->mask & IN_ISDIR) != 0;
 
-  struct exclusions *exclusions = data;
-  GHashTable *watches = g_hash_table_new_full (g_str_hash, g_str_equal,
-					       (GDestroyNotify) free_single_pointer, NULL);
-//  GList *move_events = NULL;
-  int length, i = 0;
-  unsigned int j = 0;
-  int fd, wd;
-  char buffer[BUF_LEN];
-  int monitor_events = IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVE;
-  fd = inotify_init ();
+  /* A directory modification is a no-op either way */
+  if (is_dir && (event->mask & IN_MODIFY))
+    return FALSE;
 
-  if (fd < 0)
-    suicide ("Failed to initialise inotify: %s", strerror (errno));
+  if (!event_buffer_add (path, is_dir))
+    return FALSE;
 
+  if (is_dir && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+    add_watches_recursively (path, md->fd, md->watches, md->monitor_events);
+  return TRUE;
+}
 
-  /* Get all the existing dirs and monitor them */
+void *
+monitor_dir_inotify (void *data)
+{
 
-  if ((add_watches_recursively (cfg->monitor_dir, fd, &watches, monitor_events)) < 0) {
-    suicide ("Error recursively adding inotify watches: %s", strerror (errno));
-  }
+  struct monitor_dir_data *md = data;
+  struct exclusions *exclusions = md->exclusions;
+  struct watch_index *watches = md->watches;
+  int length, i = 0;
+  int fd = md->fd, wd = -1, ready;
+  struct pollfd pfd;
+  char buffer[BUF_LEN];
 
   while (1) {
     i = 0;
+    /* Wake up in time to expire moves that never got their other half */
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    ready = poll (&pfd, 1, move_table_timeout ());
+    if (ready < 0 && errno == EINTR)
+      continue;
+    move_table_expire (ready == 0, move_expired, md);
+    if (ready == 0)
+      continue;
     length = read (fd, buffer, BUF_LEN);
 
     if (length < 0) {
-      g_hash_table_destroy (watches);
+      watch_index_destroy (watches);
       perror ("read");
       pthread_exit (NULL);
     }
 
     while (i < length) {
       struct inotify_event *event = (struct inotify_event *) &buffer[i];
+
+      /* The watch is gone - removed by us, or its directory was deleted. Events about the directory itself have
+       * no name, which is all we care about here
+       */
+      if (event->mask & (IN_IGNORED | IN_DELETE_SELF))
+	watch_index_forget_wd (watches, event->wd);
+
       if (event->len) {
 
 	/* Translate everything into its full path */
-	gchar *event_dir = wd_to_dir (watches, event->wd);
+	gchar *event_dir = watch_index_path (watches, event->wd);
 	if (event_dir == NULL) {
-	  suicide ("event_dir is NULL for name %s and wd %d\n", event->name, event->wd);
+	  /* Queued up before its watch was removed */
+	  log_msg (LOG_DEBUG, "Ignoring event on %s for wd %d, which is no longer watched", event->name, event->wd);
+	  i += EVENT_SIZE + event->len;
 	  continue;
 	}
 
@@ -106,11 +193,19 @@ monitor_dir_inotify (void *data)
 	Sasprintf (tmp_path, "%s/%s", (char *) event_dir, event->name);
 	if (regex_match (tmp_path, exclusions)) {
 	  log_msg (LOG_DEBUG, "Ignoring event on %s due to explicit exclusion", tmp_path);
+	  free_single_pointer (event_dir);
 	  free_single_pointer (tmp_path);
 	  i += EVENT_SIZE + event->len;
 	  continue;
 	}
 	log_msg (LOG_DEBUG, "event_dir = %s, file: %s", event_dir, event->name);
+	free_single_pointer (event_dir);
+
+	if (buffer_event (md, event, tmp_path)) {
+	  free_single_pointer (tmp_path);
+	  i += EVENT_SIZE + event->len;
+	  continue;
+	}
 
 	/* This represents the relative path of the event from the dir being monitored (as is on cloud files) */
 	gchar *cf_tmp_path = g_strdup (tmp_path + strlen (cfg->monitor_dir) + 1);
@@ -120,36 +215,15 @@ monitor_dir_inotify (void *data)
 	    /* Because there's a race condition in inotify, where files can be created before we have had time to 
 	     * add the inotify watch, we need to scan any created directory, just in case it was cp -rf:ed or similar
 	     */
-	    struct move_thread_data *mtd = malloc (sizeof (struct move_thread_data));
-	    mtd->fd = fd;
-	    mtd->watches = watches;
-	    mtd->tmp_path = g_strdup (tmp_path);
-	    mtd->cf_tmp_path = g_strdup (cf_tmp_path);
-	    mtd->events_mask = monitor_events;
-	    mtd->exclusions = exclusions;
-	    mtd->ev = NULL;	//malloc(sizeof(struct inotify_event));
-
-	    pthread_t handle_dir_create_thread;
-	    pthread_attr_t attr;
-	    pthread_attr_init (&attr);
-	    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
-	    int pthread_ret = pthread_create (&handle_dir_create_thread, &attr, handle_dir_create, mtd);
-	    if (pthread_ret != 0) {
-	      suicide ("Failed to create thread for handling directory move: %s\n", strerror (errno));
-	    }
+	    start_dir_thread (handle_dir_create, md, tmp_path, cf_tmp_path, NULL);
+	  }
+	  else if (cfg->write_settle) {
+	    /* Whoever created it is probably about to write to it. If not, it's uploaded once it's closed (or idle) */
+	    coalesce_dirty (cf_tmp_path);
 	  }
 	  else {
-	    local_file *lf = stat_local_file (g_strdup (tmp_path), cfg->monitor_dir);
-	    /* There's a potential race here, where the file might be deleted nearly immediately after being created - ignore this case */
-	    if (lf != NULL) {
-
-	      pthread_mutex_lock (&files_being_uploaded_mutex);
-
-	      files_being_uploaded = g_list_prepend (files_being_uploaded, g_strdup(lf->name));
-	      g_async_queue_push (files_to_upload, lf);
-
-	      pthread_mutex_unlock (&files_being_uploaded_mutex);
-	    }
+	    /* A file that's gone again by the time it's settled is just dropped */
+	    coalesce_upload (cf_tmp_path);
 	  }
 	}
 
@@ -161,99 +235,42 @@ monitor_dir_inotify (void *data)
 	else if (event->mask & IN_MOVE) {
 
 	  log_msg (LOG_DEBUG, "%s move event on %s", event->mask & IN_ISDIR ? "Directory" : "File", tmp_path);
-	  if (event->mask & IN_ISDIR) {
-	    if (event->mask & IN_MOVED_FROM) {
-	      struct move_event *me = malloc (sizeof (struct move_event));
-
-	      me->cookie = event->cookie;
-	      me->event_name = g_strdup (event->name);
-	      me->cf_name = g_strdup (cf_tmp_path);
-	      me->full_local_path = g_strdup (tmp_path);
-
-	      pthread_mutex_lock (&move_events_mutex);
-	      move_events = g_list_prepend (move_events, me);
-	      pthread_mutex_unlock (&move_events_mutex);
-
-	    }
-
-	    //  This has the potential of taking a bit of time - esp. the call to get_cf_files_from_dir - so this needs to be in its own thread.
-	    // otherwise we may lose events! Put the move_events on a queue, have another thread do the other stuff!
-	    else if (event->mask & IN_MOVED_TO) {
-
-	      struct move_thread_data *mtd = malloc (sizeof (struct move_thread_data));
-
-	      mtd->fd = fd;
-	      mtd->watches = watches;
-	      mtd->events_mask = 0;
-	      mtd->tmp_path = g_strdup (tmp_path);
-	      mtd->cf_tmp_path = g_strdup (cf_tmp_path);
-	      mtd->ev = malloc (sizeof (struct inotify_event));
-
-	      memcpy (mtd->ev, event, sizeof (struct inotify_event));
-
-	      pthread_t handle_dir_move_thread;
-	      pthread_attr_t attr;
-	      pthread_attr_init (&attr);
-	      pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
-
-
-	      int pthread_ret = pthread_create (&handle_dir_move_thread, &attr, handle_dir_move, mtd);
-	      if (pthread_ret != 0) {
-		suicide ("Failed to create thread for handling directory move: %s\n", strerror (errno));
-	      }
-	    }
+	  if (event->mask & IN_MOVED_FROM) {
+	    /* Keep hold of where it came from until the IN_MOVED_TO with the same cookie turns up. If it doesn't,
+	     * it's been moved out of the tree, and move_expired() deals with it
+	     */
+	    struct move_event *me = malloc (sizeof (struct move_event));
+
+	    me->cookie = event->cookie;
+	    me->is_dir = (event->mask & IN_ISDIR) != 0;
+	    me->cf_name = g_strdup (cf_tmp_path);
+	    me->event_name = g_strdup (event->name);
+	    me->full_local_path = g_strdup (tmp_path);
+	    move_table_add (me);
 	  }
-
-	  /* File move */
-	  else {
-	    if (event->mask & IN_MOVED_TO) {
-	      /* Here we need to find the corresponding event cookie, put the file on the files_to_copy queue
-	       * and then delete the file in the MOVED_FROM event found in the list
-	       */
-
-	      pthread_mutex_lock (&move_events_mutex);
-
-	      for (j = 0; j < g_list_length (move_events); j++) {
-
-		struct move_event *me = g_list_nth_data (move_events, j);
-
-		if (me->cookie == event->cookie) {
-		  cf_file_copy *cfc = malloc (sizeof (cf_file_copy));
-		  cfc->old_name = g_strdup (me->cf_name);
-		  cfc->new_name = g_strdup (cf_tmp_path);
-		  cfc->sentinel = g_strdup ("ok");
-		  cfc->cf_file = build_cf_file_from_lf (me->cf_name);
-
-		  g_async_queue_push (files_to_copy, cfc);
-
-		  move_events = g_list_remove (move_events, me);
-		  log_msg (LOG_DEBUG, "File moved to: %s from: %s", tmp_path, cfc->old_name);
-		}
-
-		free_single_pointer (me->cf_name);
-		free_single_pointer (me->event_name);
-		free_single_pointer (me->full_local_path);
-		free_single_pointer (me);
-	      }
-
-	      pthread_mutex_unlock (&move_events_mutex);
-
+	  else if (event->mask & IN_MOVED_TO) {
+	    struct move_event *me = move_table_take (event->cookie);
+
+	    if (event->mask & IN_ISDIR) {
+	      //  This has the potential of taking a bit of time - esp. the call to get_cf_files_from_dir - so this needs to be in its own thread.
+	      // otherwise we may lose events!
+	      if (me != NULL)
+		start_dir_thread (handle_dir_move, md, tmp_path, cf_tmp_path, me);
+	      /* Moved in from outside - as far as we're concerned, it's new */
+	      else
+		start_dir_thread (handle_dir_create, md, tmp_path, cf_tmp_path, NULL);
 	    }
-	    else if (event->mask & IN_MOVED_FROM) {
-	      /* Put the event of the original file on a list, we need to look for 
-	       * the corresponding cookie in the IN_MOVED_TO event
-	       */
-	      struct move_event *me = malloc (sizeof (struct move_event));
-
-	      me->cookie = event->cookie;
-	      me->cf_name = g_strdup (cf_tmp_path);
-	      me->event_name = g_strdup (event->name);
-	      me->full_local_path = g_strdup (tmp_path);
-
-	      pthread_mutex_lock (&move_events_mutex);
-	      move_events = g_list_prepend (move_events, me);
-	      pthread_mutex_unlock (&move_events_mutex);
 
+	    /* File move */
+	    else if (me != NULL) {
+	      /* Have the coalescer copy the object over on CF (and delete the original) once both names have settled */
+	      log_msg (LOG_DEBUG, "File moved to: %s from: %s", tmp_path, me->cf_name);
+	      coalesce_move (me->cf_name, cf_tmp_path);
+	      destroy_move_event (me);
+	    }
+	    else {
+	      log_msg (LOG_DEBUG, "File moved in from outside: %s", tmp_path);
+	      coalesce_upload (cf_tmp_path);
 	    }
 	  }
 	}			// event->mask & IN_MOVE
@@ -268,16 +285,10 @@ monitor_dir_inotify (void *data)
 	    /* This is a no-op for us as recursive deletion also deletes files within the directory (which in turn generates separate 
 	     * inotify events. Just need to remove the watcher. 
 	     */
-	    pthread_mutex_lock (&watches_mutex);
-
-	    gpointer *tmp_wd = g_hash_table_lookup (watches, tmp_path);
-	    inotify_rm_watch (fd, GPOINTER_TO_INT (tmp_wd));
-
-	    pthread_mutex_unlock (&watches_mutex);
+	    watch_index_rm_watch (watches, fd, tmp_path);
 	  }
 	  else {
-	    cf_file *cf = build_cf_file_from_lf (cf_tmp_path);
-	    g_async_queue_push (files_to_delete, cf);
+	    coalesce_delete (cf_tmp_path);
 	  }
 	}
 
@@ -289,35 +300,22 @@ monitor_dir_inotify (void *data)
 
 	  /* A directory mofification is a NOOP for us - only care about files */
 	  if (!(event->mask & IN_ISDIR)) {
-	    /* We can get more than one of these per file change as far as the person at the keyboard is concerned,
-	     * so we need to prevent uploading the same file twice
+	    /* We can get a great many of these per file change as far as the person at the keyboard is concerned.
+	     * With write_settle they only mark the file as being written to, and IN_CLOSE_WRITE has it uploaded.
+	     * Either way, the coalescer makes sure it's only uploaded once they've stopped
 	     */
-	    if (event->mask |= IN_CLOSE_WRITE) {
-
-	      gchar *f_name = g_strdup (tmp_path);
-	      local_file *lf = stat_local_file (f_name, cfg->monitor_dir);
-
-	      if (lf != NULL) {
-
-		pthread_mutex_lock (&files_being_uploaded_mutex);
-
-                if (g_list_find_custom(files_being_uploaded, lf->name, (GCompareFunc) g_ascii_strcasecmp)){
-		  log_msg (LOG_DEBUG, "File '%s' is already being uploaded - ignoring event\n", lf->name);
-		  destroy_local_file (lf);
-                }
-		else {
-		  files_being_uploaded = g_list_prepend (files_being_uploaded, g_strdup(lf->name));
-		  g_async_queue_push (files_to_upload, lf);
-		}
-
-		pthread_mutex_unlock (&files_being_uploaded_mutex);
-		log_msg (LOG_DEBUG, "IN_CLOSE_WRITE The file %s was modified.\n", event->name);
-	      }
-	    }
-
+	    if (cfg->write_settle)
+	      coalesce_dirty (cf_tmp_path);
+	    else
+	      coalesce_upload (cf_tmp_path);
 	  }
 	}
 
+	else if (event->mask & IN_CLOSE_WRITE) {
+	  log_msg (LOG_DEBUG, "IN_CLOSE_WRITE The file %s was modified.\n", event->name);
+	  coalesce_upload (cf_tmp_path);
+	}
+
 
 	free_single_pointer (cf_tmp_path);
 	free_single_pointer (tmp_path);
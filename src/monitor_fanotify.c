@@ -0,0 +1,410 @@
+#include "ccfsync.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/fanotify.h>
+
+/* monitor_backend=fanotify: one fanotify mark on the whole filesystem monitor_dir is on, rather than an inotify
+ * watch on every directory below it. Setting it up takes the same time (and kernel memory) however many directories
+ * there are, and there's no max_user_watches to run into. Nor is there a window after a directory's created in
+ * which what happens inside it is missed - which is what handle_dir_create()'s rescan is for with inotify.
+ *
+ * With FAN_REPORT_DFID_NAME, each event says which directory it happened in (as a file handle) and the name in
+ * it. The handle is turned into a path with open_by_handle_at(), which needs CAP_DAC_READ_SEARCH as well as the
+ * CAP_SYS_ADMIN fanotify needs, and is cached until that directory (or one above it) is moved or deleted. Events on
+ * the rest of the filesystem are dropped. From there on, they're dealt with as inotify's are.
+ *
+ * The events for what's in a directory can be read after the directory itself has gone (rm -rf), when its handle
+ * can't be turned into a path any more unless it's cached. So when a directory's deleted, everything below it on CF
+ * is deleted too, as it is when a directory's moved out of the tree.
+ *
+ * A rename comes as a single FAN_RENAME event with both names (Linux 5.17 on). fanotify doesn't pair FAN_MOVED_FROM
+ * and FAN_MOVED_TO up like inotify does with its cookies, so on older kernels a file that's moved is deleted and
+ * uploaded again under its new name, rather than copied over on CF.
+ */
+
+#ifdef FAN_REPORT_DFID_NAME
+
+#define FANOTIFY_BUF_LEN (256 * 1024)
+/* Directories whose path is remembered, before starting over */
+#define FANOTIFY_DIR_CACHE_MAX 100000
+
+/* A directory (as a file handle) and a name in it, from an event's info records */
+struct fan_name {
+  struct file_handle *dir;
+  const char *name;
+};
+
+struct cached_dir {
+  /* The handle, in hex */
+  gchar *key;
+  gchar *path;
+};
+
+/* Handle (hex) -> GSequenceIter in dir_order */
+static GHashTable *dir_paths = NULL;
+/* struct cached_dir, sorted by path, so that everything below a directory can be found */
+static GSequence *dir_order = NULL;
+/* monitor_dir with any symlinks resolved, which is what the kernel hands back */
+static gchar *real_root = NULL;
+static int have_rename = FALSE;
+
+static gchar *
+handle_key (struct file_handle *fh)
+{
+  GString *key = g_string_sized_new (fh->handle_bytes * 2 + 12);
+  unsigned int i;
+
+  g_string_append_printf (key, "%x:", fh->handle_type);
+  for (i = 0; i < fh->handle_bytes; i++)
+    g_string_append_printf (key, "%02x", fh->f_handle[i]);
+  return g_string_free (key, FALSE);
+}
+
+static void
+destroy_cached_dir (struct cached_dir *cd)
+{
+  free_single_pointer (cd->key);
+  free_single_pointer (cd->path);
+  free_single_pointer (cd);
+}
+
+static gint
+cached_dir_cmp (gconstpointer a, gconstpointer b, gpointer data)
+{
+  return strcmp (((const struct cached_dir *) a)->path, ((const struct cached_dir *) b)->path);
+}
+
+static void
+uncache_dir (GSequenceIter * it)
+{
+  g_hash_table_remove (dir_paths, ((struct cached_dir *) g_sequence_get (it))->key);
+  g_sequence_remove (it);
+}
+
+/* Forgets the directory path (as the kernel has it) and everything below it. Everything below it is contiguous in
+ * dir_order: it all sorts between "path/" and "path0" - '0' being the character after '/'
+ */
+static void
+uncache_tree (const gchar * path)
+{
+  struct cached_dir probe;
+  GSequenceIter *it, *next;
+
+  probe.path = (gchar *) path;
+  if ((it = g_sequence_lookup (dir_order, &probe, cached_dir_cmp, NULL)) != NULL)
+    uncache_dir (it);
+
+  probe.path = g_strconcat (path, "/", NULL);
+  it = g_sequence_search (dir_order, &probe, cached_dir_cmp, NULL);
+  while (!g_sequence_iter_is_end (it) && g_str_has_prefix (((struct cached_dir *) g_sequence_get (it))->path, probe.path)) {
+    next = g_sequence_iter_next (it);
+    uncache_dir (it);
+    it = next;
+  }
+  free_single_pointer (probe.path);
+}
+
+/* The path of the directory fh, or NULL if it's gone */
+static gchar *
+resolve_dir (struct monitor_dir_data *md, struct file_handle *fh)
+{
+  gchar *key = handle_key (fh), proc[64];
+  char buf[PATH_MAX];
+  struct cached_dir *cd;
+  GSequenceIter *it;
+  ssize_t len;
+  int fd;
+
+  if ((it = g_hash_table_lookup (dir_paths, key)) != NULL) {
+    free_single_pointer (key);
+    return g_strdup (((struct cached_dir *) g_sequence_get (it))->path);
+  }
+
+  /* ESTALE if it's been deleted since */
+  if ((fd = open_by_handle_at (md->mount_fd, fh, O_PATH)) < 0) {
+    free_single_pointer (key);
+    return NULL;
+  }
+  snprintf (proc, sizeof (proc), "/proc/self/fd/%d", fd);
+  len = readlink (proc, buf, sizeof (buf) - 1);
+  close (fd);
+  if (len >= 0)
+    buf[len] = '\0';
+  if (len < 0 || g_str_has_suffix (buf, " (deleted)")) {
+    free_single_pointer (key);
+    return NULL;
+  }
+
+  if (g_hash_table_size (dir_paths) >= FANOTIFY_DIR_CACHE_MAX) {
+    g_hash_table_remove_all (dir_paths);
+    g_sequence_remove_range (g_sequence_get_begin_iter (dir_order), g_sequence_get_end_iter (dir_order));
+  }
+  cd = malloc (sizeof (struct cached_dir));
+  cd->key = key;
+  cd->path = g_strdup (buf);
+  g_hash_table_insert (dir_paths, key, g_sequence_insert_sorted (dir_order, cd, cached_dir_cmp, NULL));
+  return g_strdup (buf);
+}
+
+/* The full path (under cfg->monitor_dir) of what n names, or NULL if it isn't below monitor_dir */
+static gchar *
+fan_path (struct monitor_dir_data *md, struct fan_name *n)
+{
+  gchar *dir, *path = NULL;
+  size_t root_len = strlen (real_root);
+
+  if (n->dir == NULL || n->name == NULL || strcmp (n->name, ".") == 0 || (dir = resolve_dir (md, n->dir)) == NULL)
+    return NULL;
+  if (strncmp (dir, real_root, root_len) == 0 && (dir[root_len] == '\0' || dir[root_len] == '/'))
+    path = g_strconcat (cfg->monitor_dir, dir + root_len, "/", n->name, NULL);
+  free_single_pointer (dir);
+  if (path != NULL && regex_match (path, md->exclusions)) {
+    log_msg (LOG_DEBUG, "Ignoring event on %s due to explicit exclusion", path);
+    free_single_pointer (path);
+    return NULL;
+  }
+  return path;
+}
+
+static const gchar *
+cf_path (const gchar * path)
+{
+  return path + strlen (cfg->monitor_dir) + 1;
+}
+
+/* The directory at path (under cfg->monitor_dir) has been moved or deleted: forget it, and what's below it */
+static void
+uncache_path (const gchar * path)
+{
+  gchar *real = g_strconcat (real_root, "/", cf_path (path), NULL);
+
+  uncache_tree (real);
+  free_single_pointer (real);
+}
+
+/* Something at path has been written to, or turned up */
+static void
+fan_changed (struct monitor_dir_data *md, gchar * path, int is_dir, uint64_t mask)
+{
+  if (is_dir) {
+    /* Anything created in it will be reported by itself, but what it was moved in with won't */
+    if (mask & FAN_MOVED_TO)
+      start_dir_thread (handle_dir_create, md, path, cf_path (path), NULL);
+  }
+  else if ((mask & FAN_CLOSE_WRITE) || !cfg->write_settle)
+    coalesce_upload (cf_path (path));
+  else
+    coalesce_dirty (cf_path (path));
+}
+
+/* What was at path has been deleted, or moved away (out of the tree, as far as we know) */
+static void
+fan_gone (struct monitor_dir_data *md, gchar * path, int is_dir, int moved)
+{
+  struct move_event *me;
+
+  if (!is_dir) {
+    coalesce_delete (cf_path (path));
+    return;
+  }
+  /* Paths below it are stale */
+  uncache_path (path);
+  /* The deletions of what was in it may have been dropped, if they were read after it had gone */
+  me = calloc (1, sizeof (struct move_event));
+  me->is_dir = TRUE;
+  me->cf_name = g_strdup (cf_path (path));
+  me->event_name = g_strdup (strrchr (path, '/') + 1);
+  me->full_local_path = g_strdup (path);
+  start_dir_thread (moved ? handle_dir_moved_out : handle_dir_deleted, md, path, me->cf_name, me);
+}
+
+static void
+fan_renamed (struct monitor_dir_data *md, gchar * from, gchar * to, int is_dir)
+{
+  struct move_event *me;
+
+  if (is_dir && from != NULL)
+    uncache_path (from);
+
+  if (from == NULL)
+    fan_changed (md, to, is_dir, FAN_MOVED_TO | FAN_CLOSE_WRITE);
+  else if (to == NULL)
+    fan_gone (md, from, is_dir, TRUE);
+  else if (!is_dir) {
+    log_msg (LOG_DEBUG, "File moved to: %s from: %s", to, from);
+    coalesce_move (cf_path (from), cf_path (to));
+  }
+  else {
+    me = calloc (1, sizeof (struct move_event));
+    me->is_dir = TRUE;
+    me->cf_name = g_strdup (cf_path (from));
+    me->event_name = g_strdup (strrchr (from, '/') + 1);
+    me->full_local_path = g_strdup (from);
+    start_dir_thread (handle_dir_move, md, to, cf_path (to), me);
+  }
+}
+
+static void
+fan_event (struct monitor_dir_data *md, struct fanotify_event_metadata *meta)
+{
+  struct fanotify_event_info_header *hdr;
+  struct fanotify_event_info_fid *fid;
+  struct fan_name *n, name = { NULL, NULL }, old_name = { NULL, NULL }, new_name = { NULL, NULL };
+  char *p = (char *) (meta + 1), *end = (char *) meta + meta->event_len;
+  int is_dir = (meta->mask & FAN_ONDIR) != 0, buffered;
+  uint64_t gone, there;
+  gchar *path, *from, *to;
+  struct stat st;
+
+  while (p + sizeof (struct fanotify_event_info_header) <= end) {
+    hdr = (struct fanotify_event_info_header *) p;
+    if (hdr->len == 0)
+      break;
+    n = NULL;
+    if (hdr->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+      n = &name;
+#ifdef FAN_RENAME
+    else if (hdr->info_type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME)
+      n = &old_name;
+    else if (hdr->info_type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME)
+      n = &new_name;
+#endif
+    if (n != NULL) {
+      fid = (struct fanotify_event_info_fid *) hdr;
+      n->dir = (struct file_handle *) fid->handle;
+      n->name = (const char *) n->dir->f_handle + n->dir->handle_bytes;
+    }
+    p += hdr->len;
+  }
+
+#ifdef FAN_RENAME
+  if (meta->mask & FAN_RENAME) {
+    from = fan_path (md, &old_name);
+    to = fan_path (md, &new_name);
+    /* While the initial sync is running, both ends are just recorded (see event_buffer.c) */
+    buffered = from != NULL && event_buffer_add (from, is_dir);
+    if (to != NULL && event_buffer_add (to, is_dir))
+      buffered = TRUE;
+    if (!buffered && (from != NULL || to != NULL))
+      fan_renamed (md, from, to, is_dir);
+    free_single_pointer (from);
+    free_single_pointer (to);
+  }
+#endif
+
+  if (!(meta->mask & (FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_CLOSE_WRITE | FAN_MOVE)))
+    return;
+  if ((path = fan_path (md, &name)) == NULL)
+    return;
+  log_msg (LOG_DEBUG, "fanotify event 0x%llx on %s", (unsigned long long) meta->mask, path);
+  if (event_buffer_add (path, is_dir)) {
+    free_single_pointer (path);
+    return;
+  }
+
+  /* The kernel merges events on the same name that are still queued up, so one can say it was both created and
+   * deleted. Whichever happened last is what's there now
+   */
+  gone = meta->mask & (FAN_DELETE | FAN_MOVED_FROM);
+  there = meta->mask & (FAN_CREATE | FAN_MOVED_TO | FAN_MODIFY | FAN_CLOSE_WRITE);
+  if (gone && there) {
+    if (lstat (path, &st) == 0)
+      gone = 0;
+    else
+      there = 0;
+  }
+  if (gone)
+    fan_gone (md, path, is_dir, (meta->mask & FAN_MOVED_FROM) != 0);
+  else if (there)
+    fan_changed (md, path, is_dir, meta->mask);
+  free_single_pointer (path);
+}
+
+/* Sets md up with a fanotify group instead of inotify */
+void
+init_monitor_fanotify (struct monitor_dir_data *md)
+{
+  uint64_t mask = FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_ONDIR;
+
+  if (cfg->write_settle)
+    mask |= FAN_CLOSE_WRITE;
+  md->watches = NULL;
+  md->monitor_events = 0;
+
+  if ((real_root = realpath (cfg->monitor_dir, NULL)) == NULL)
+    suicide ("Failed to resolve %s: %s", cfg->monitor_dir, strerror (errno));
+  md->fd = fanotify_init (FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME, O_RDONLY | O_LARGEFILE);
+  if (md->fd < 0)
+    suicide ("Failed to initialise fanotify: %s (it needs Linux 5.9 or later, and CAP_SYS_ADMIN). Try monitor_backend=inotify",
+	     strerror (errno));
+  /* open_by_handle_at() needs something on the filesystem to go by */
+  md->mount_fd = open (cfg->monitor_dir, O_RDONLY | O_DIRECTORY);
+  if (md->mount_fd < 0)
+    suicide ("Failed to open %s: %s", cfg->monitor_dir, strerror (errno));
+
+  /* Dirent events can't be had on a mount mark, only on the whole filesystem */
+#ifdef FAN_RENAME
+  if (fanotify_mark (md->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask | FAN_RENAME, AT_FDCWD, cfg->monitor_dir) == 0)
+    have_rename = TRUE;
+  else
+#endif
+  if (fanotify_mark (md->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask | FAN_MOVE, AT_FDCWD, cfg->monitor_dir) < 0)
+    suicide ("Failed to add fanotify mark on the filesystem %s is on: %s", cfg->monitor_dir, strerror (errno));
+  if (!have_rename)
+    log_msg (LOG_INFO, "fanotify: no FAN_RENAME (needs Linux 5.17) - moved files will be uploaded again rather than copied");
+
+  /* The keys belong to dir_order's entries */
+  dir_paths = g_hash_table_new (g_str_hash, g_str_equal);
+  dir_order = g_sequence_new ((GDestroyNotify) destroy_cached_dir);
+  log_msg (LOG_INFO, "Monitoring %s with fanotify", cfg->monitor_dir);
+}
+
+void *
+monitor_dir_fanotify (void *data)
+{
+  struct monitor_dir_data *md = data;
+  struct fanotify_event_metadata *meta;
+  /* Info records hold file handles, which are aligned like the metadata */
+  static struct fanotify_event_metadata buffer[FANOTIFY_BUF_LEN / sizeof (struct fanotify_event_metadata)];
+  ssize_t length;
+
+  while (1) {
+    length = read (md->fd, buffer, sizeof (buffer));
+    if (length < 0) {
+      if (errno == EINTR)
+	continue;
+      perror ("read");
+      pthread_exit (NULL);
+    }
+
+    for (meta = buffer; FAN_EVENT_OK (meta, length); meta = FAN_EVENT_NEXT (meta, length)) {
+      if (meta->vers != FANOTIFY_METADATA_VERSION)
+	suicide ("fanotify event metadata version %d doesn't match ours (%d)", meta->vers, FANOTIFY_METADATA_VERSION);
+      if (meta->mask & FAN_Q_OVERFLOW) {
+	log_msg (LOG_WARNING, "fanotify's queue overflowed - changes have been missed, and won't be synced until the next restart");
+	continue;
+      }
+      fan_event (md, meta);
+      /* Always FAN_NOFD with FAN_REPORT_DFID_NAME, but just in case */
+      if (meta->fd >= 0)
+	close (meta->fd);
+    }
+  }
+  return NULL;
+}
+
+#else
+
+void
+init_monitor_fanotify (struct monitor_dir_data *md)
+{
+  suicide ("ccfsyncd was built without fanotify support (it needs Linux 5.9 headers or later). Use monitor_backend=inotify");
+}
+
+void *
+monitor_dir_fanotify (void *data)
+{
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,158 @@
+#include "ccfsync.h"
+
+/* Pairs inotify's IN_MOVED_FROM and IN_MOVED_TO events up by their cookie. The IN_MOVED_FROM half waits here, in a
+ * hash table keyed by cookie, for its IN_MOVED_TO. Something moved out of the tree never gets one, so every entry
+ * also goes on a timer wheel: a ring of MOVE_WHEEL_SLOTS slots MOVE_WHEEL_TICK apart, each listing the cookies due
+ * to expire in that tick. Whatever's left unpaired MOVE_PAIR_WINDOW after it turned up is handed back to the
+ * monitor, which deals with it as a deletion. While inotify's queue is backed up, the other half may just not have
+ * been read yet, so expiry then holds back for another MOVE_BACKLOG_GRACE.
+ *
+ * Only the monitor thread adds to the table and expires it, but the lock is there for the stats.
+ */
+
+/* The two halves of a rename are nearly always in the same read(), so this is generous */
+#define MOVE_PAIR_WINDOW (500 * 1000)
+#define MOVE_BACKLOG_GRACE (5 * G_USEC_PER_SEC)
+#define MOVE_WHEEL_TICK (50 * 1000)
+#define MOVE_WHEEL_SLOTS 64
+
+static pthread_mutex_t move_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* cookie -> struct move_event */
+static GHashTable *by_cookie = NULL;
+/* Cookies, by the tick they're due to expire in */
+static GQueue wheel[MOVE_WHEEL_SLOTS];
+/* The last tick expired */
+static gint64 wheel_tick = 0;
+static unsigned long moves_paired = 0;
+static unsigned long moves_unpaired = 0;
+static unsigned long moves_in = 0;
+
+void
+move_table_init ()
+{
+  int i;
+
+  by_cookie = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) destroy_move_event);
+  for (i = 0; i < MOVE_WHEEL_SLOTS; i++)
+    g_queue_init (&wheel[i]);
+  wheel_tick = g_get_monotonic_time () / MOVE_WHEEL_TICK;
+}
+
+static void
+wheel_insert (struct move_event *me)
+{
+  /* Rounded up, so that it has expired by the time its tick comes round */
+  gint64 tick = (me->expires + MOVE_WHEEL_TICK - 1) / MOVE_WHEEL_TICK;
+
+  g_queue_push_tail (&wheel[tick % MOVE_WHEEL_SLOTS], GUINT_TO_POINTER (me->cookie));
+}
+
+/* Takes me, the IN_MOVED_FROM half of a move, until its IN_MOVED_TO turns up */
+void
+move_table_add (struct move_event *me)
+{
+  guint pending;
+
+  me->expires = g_get_monotonic_time () + MOVE_PAIR_WINDOW;
+  pthread_mutex_lock (&move_table_mutex);
+  g_hash_table_replace (by_cookie, GUINT_TO_POINTER (me->cookie), me);
+  wheel_insert (me);
+  pending = g_hash_table_size (by_cookie);
+  pthread_mutex_unlock (&move_table_mutex);
+
+  if (pending % 1000 == 0)
+    log_msg (LOG_INFO, "%u moves waiting to be paired up", pending);
+}
+
+/* The IN_MOVED_FROM half of the move with cookie, which is the caller's from here on. NULL if there isn't one -
+ * whatever it is has been moved in from outside the tree
+ */
+struct move_event *
+move_table_take (unsigned int cookie)
+{
+  struct move_event *me;
+
+  pthread_mutex_lock (&move_table_mutex);
+  me = g_hash_table_lookup (by_cookie, GUINT_TO_POINTER (cookie));
+  if (me != NULL) {
+    /* Its cookie stays on the wheel, and is skipped when its tick comes round */
+    g_hash_table_steal (by_cookie, GUINT_TO_POINTER (cookie));
+    moves_paired++;
+  }
+  else
+    moves_in++;
+  pthread_mutex_unlock (&move_table_mutex);
+  return me;
+}
+
+/* Hands every move that's been waiting for longer than MOVE_PAIR_WINDOW to expired, which takes it over. idle is
+ * whether inotify's queue has been read dry
+ */
+void
+move_table_expire (int idle, void (*expired) (struct move_event *, void *), void *data)
+{
+  GQueue *slot;
+  GList *gone = NULL, *l;
+  struct move_event *me;
+  gpointer cookie;
+  gint64 now = g_get_monotonic_time () - (idle ? 0 : MOVE_BACKLOG_GRACE);
+  gint64 tick, target = now / MOVE_WHEEL_TICK;
+  guint n;
+
+  pthread_mutex_lock (&move_table_mutex);
+  /* After a long gap, once round the wheel covers everything */
+  if (target - wheel_tick > MOVE_WHEEL_SLOTS)
+    wheel_tick = target - MOVE_WHEEL_SLOTS;
+  for (tick = wheel_tick + 1; tick <= target; tick++) {
+    slot = &wheel[tick % MOVE_WHEEL_SLOTS];
+    for (n = g_queue_get_length (slot); n > 0; n--) {
+      cookie = g_queue_pop_head (slot);
+      me = g_hash_table_lookup (by_cookie, cookie);
+      /* Paired up already */
+      if (me == NULL)
+	continue;
+      /* Not due until a later time round */
+      if (me->expires > now) {
+	wheel_insert (me);
+	continue;
+      }
+      g_hash_table_steal (by_cookie, cookie);
+      moves_unpaired++;
+      gone = g_list_prepend (gone, me);
+    }
+  }
+  if (target > wheel_tick)
+    wheel_tick = target;
+  pthread_mutex_unlock (&move_table_mutex);
+
+  for (l = gone; l != NULL; l = l->next)
+    expired (l->data, data);
+  g_list_free (gone);
+}
+
+/* How long (in milliseconds) until the next tick has anything to expire, for poll(). -1 if nothing's waiting */
+int
+move_table_timeout ()
+{
+  gint64 wait;
+  int empty;
+
+  pthread_mutex_lock (&move_table_mutex);
+  empty = g_hash_table_size (by_cookie) == 0;
+  wait = (wheel_tick + 1) * MOVE_WHEEL_TICK - g_get_monotonic_time ();
+  pthread_mutex_unlock (&move_table_mutex);
+
+  if (empty)
+    return -1;
+  return wait > 0 ? (int) ((wait + 999) / 1000) : 0;
+}
+
+void
+move_table_log_stats ()
+{
+  pthread_mutex_lock (&move_table_mutex);
+  if (moves_paired > 0 || moves_unpaired > 0 || moves_in > 0)
+    log_msg (LOG_INFO, "Moves: %lu paired up, %lu moved out of the tree, %lu moved in, %u waiting to be paired up", moves_paired,
+	     moves_unpaired, moves_in, by_cookie != NULL ? g_hash_table_size (by_cookie) : 0);
+  pthread_mutex_unlock (&move_table_mutex);
+}
@@ -0,0 +1,202 @@
+#include "ccfsync.h"
+#include <signal.h>
+
+/* Process-wide limits on how hard we push CF: bytes/sec uploaded (max_upload_rate), and requests/sec for each of
+ * PUT, DELETE and COPY (max_put_rate, max_delete_rate, max_copy_rate). Each is a token bucket holding up to a
+ * second's worth, kept as GCRA: all a bucket needs is the theoretical arrival time (TAT) of the next unit at the
+ * configured rate. Taking cost units pushes TAT on by cost/rate, and whoever took them waits until TAT is no more
+ * than a second ahead of now. The lock is only held for that sum, never while waiting, so 50 workers don't queue up
+ * behind it - and a bucket without a limit isn't locked at all.
+ *
+ * Worker threads just sleep for their turn. The multi engine's event loop can't, so it asks how long it'd have to
+ * wait (rate_limit_due()), pauses or holds back the transfer until then, and only then takes what it needs.
+ *
+ * The limits can be changed without a restart: edit the config file and send us a SIGHUP.
+ */
+
+#define RATE_NS_PER_SEC G_GINT64_CONSTANT (1000000000)
+
+struct rate_bucket {
+  const char *name;
+  const char *unit;
+  pthread_mutex_t lock;
+  /* Set (atomically) if there's a limit at all */
+  volatile gint limited;
+  /* Units per second */
+  gint64 rate;
+  /* g_get_monotonic_time() in ns at which the next unit is due at rate */
+  gint64 tat;
+  /* How long anything has had to wait for this bucket, in microseconds */
+  unsigned long waits;
+  gint64 waited;
+  gint64 longest_wait;
+};
+
+/* Indexed by RATE_* */
+static struct rate_bucket buckets[RATE_BUCKETS] = {
+  {"Upload bandwidth", "bytes", PTHREAD_MUTEX_INITIALIZER, FALSE, 0, 0, 0, 0, 0},
+  {"PUT", "requests", PTHREAD_MUTEX_INITIALIZER, FALSE, 0, 0, 0, 0, 0},
+  {"DELETE", "objects", PTHREAD_MUTEX_INITIALIZER, FALSE, 0, 0, 0, 0, 0},
+  {"COPY", "requests", PTHREAD_MUTEX_INITIALIZER, FALSE, 0, 0, 0, 0, 0},
+};
+
+static void
+record_wait (struct rate_bucket *b, gint64 wait)
+{
+  b->waits++;
+  b->waited += wait;
+  if (wait > b->longest_wait)
+    b->longest_wait = wait;
+}
+
+/* Takes cost units from bucket, and returns how long (in microseconds) the caller has to wait before going ahead */
+gint64
+rate_limit_charge (int bucket, gint64 cost)
+{
+  struct rate_bucket *b = &buckets[bucket];
+  gint64 now, wait = 0;
+
+  if (!g_atomic_int_get (&b->limited) || cost <= 0)
+    return 0;
+
+  now = g_get_monotonic_time () * 1000;
+  pthread_mutex_lock (&b->lock);
+  /* The limit may have just been lifted */
+  if (b->rate <= 0) {
+    pthread_mutex_unlock (&b->lock);
+    return 0;
+  }
+  if (b->tat < now)
+    b->tat = now;
+  /* Up to a second ahead is the bucket's capacity */
+  if (b->tat - now > RATE_NS_PER_SEC)
+    wait = (b->tat - now - RATE_NS_PER_SEC) / 1000;
+  b->tat += cost * RATE_NS_PER_SEC / b->rate;
+  if (wait > 0)
+    record_wait (b, wait);
+  pthread_mutex_unlock (&b->lock);
+  return wait;
+}
+
+/* As rate_limit_charge(), but waits its turn */
+void
+rate_limit_take (int bucket, gint64 cost)
+{
+  gint64 wait = rate_limit_charge (bucket, cost);
+
+  if (wait > 0)
+    g_usleep (wait);
+}
+
+/* How long (in microseconds) until bucket has room again, without taking anything. 0 if it has room now */
+gint64
+rate_limit_due (int bucket)
+{
+  struct rate_bucket *b = &buckets[bucket];
+  gint64 now, due = 0;
+
+  if (!g_atomic_int_get (&b->limited))
+    return 0;
+
+  now = g_get_monotonic_time () * 1000;
+  pthread_mutex_lock (&b->lock);
+  if (b->tat - now > RATE_NS_PER_SEC)
+    due = (b->tat - now - RATE_NS_PER_SEC + 999) / 1000;
+  pthread_mutex_unlock (&b->lock);
+  return due;
+}
+
+/* For whoever held back by themselves after rate_limit_due(), so it's counted */
+void
+rate_limit_waited (int bucket, gint64 wait)
+{
+  struct rate_bucket *b = &buckets[bucket];
+
+  pthread_mutex_lock (&b->lock);
+  record_wait (b, wait);
+  pthread_mutex_unlock (&b->lock);
+}
+
+/* Picks up the limits in cfg->rate_limits. Anything already queued up behind an old limit starts over at the new
+ * one
+ */
+void
+rate_limit_configure ()
+{
+  struct rate_bucket *b;
+  int i;
+
+  for (i = 0; i < RATE_BUCKETS; i++) {
+    b = &buckets[i];
+    pthread_mutex_lock (&b->lock);
+    if (b->rate != cfg->rate_limits[i]) {
+      if (cfg->rate_limits[i] > 0)
+	log_msg (LOG_INFO, "%s limited to %lld %s/s", b->name, (long long) cfg->rate_limits[i], b->unit);
+      else if (b->rate > 0)
+	log_msg (LOG_INFO, "%s no longer limited", b->name);
+    }
+    b->rate = cfg->rate_limits[i];
+    b->tat = 0;
+    g_atomic_int_set (&b->limited, b->rate > 0);
+    pthread_mutex_unlock (&b->lock);
+  }
+}
+
+void
+rate_limit_log_stats ()
+{
+  struct rate_bucket *b;
+  int i;
+
+  for (i = 0; i < RATE_BUCKETS; i++) {
+    b = &buckets[i];
+    pthread_mutex_lock (&b->lock);
+    if (b->rate > 0 || b->waits > 0)
+      log_msg (LOG_INFO, "%s limit: waited %lu times, %.1fs in all, %.1fs at most", b->name, b->waits,
+	       (double) b->waited / G_USEC_PER_SEC, (double) b->longest_wait / G_USEC_PER_SEC);
+    pthread_mutex_unlock (&b->lock);
+  }
+}
+
+/* Waits for SIGHUPs, which only ever get delivered here */
+static void *
+reload_thread (void *data)
+{
+  sigset_t *set = data;
+  int sig;
+
+  while (TRUE) {
+    if (sigwait (set, &sig) != 0)
+      continue;
+    log_msg (LOG_INFO, "Caught SIGHUP - reloading the rate limits");
+    reload_config ();
+    rate_limit_configure ();
+    rate_limit_log_stats ();
+  }
+  return NULL;
+}
+
+/* Sets the limits up, and starts listening for SIGHUP. Has to be called before any other thread is started, so
+ * that they all inherit SIGHUP being blocked
+ */
+void
+rate_limit_init ()
+{
+  static sigset_t set;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int rc;
+
+  rate_limit_configure ();
+
+  sigemptyset (&set);
+  sigaddset (&set, SIGHUP);
+  pthread_sigmask (SIG_BLOCK, &set, NULL);
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  rc = pthread_create (&thread, &attr, reload_thread, &set);
+  pthread_attr_destroy (&attr);
+  if (rc != 0)
+    suicide ("Failed to spawn config reload thread. Error code: %d\n", rc);
+}
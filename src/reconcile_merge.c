@@ -0,0 +1,392 @@
+#include "ccfsync.h"
+#include <fcntl.h>
+
+/* Streaming reconciliation for trees too big to hold in two hash tables.
+ *
+ * CF returns listings sorted by name (byte order). If we walk monitor_dir in the same order, both sides can be
+ * merge-joined: whichever side has the smaller name holds a file the other one doesn't. Only the current page of
+ * the remote listing and the sorted entries of the directories on the current path are ever held in memory.
+ *
+ * To get a walk in byte order of the full path, siblings are sorted with a '/' appended to directory names:
+ * everything in "a/" sorts after "a-b" and before "a0", exactly as "a/..." does in the listing.
+ */
+
+/* Number of files with matching names hashed in one go on the hashing threads */
+#define MERGE_HASH_BATCH 1024
+
+struct sorted_entry {
+  gchar *name;
+  int is_dir;
+};
+
+struct walk_frame {
+  DIR *dir;
+  gchar *path;
+  GPtrArray *entries;
+  guint next;
+};
+
+struct sorted_walk {
+  GPtrArray *stack;
+  struct exclusions *exclusions;
+  walk_dir_cb on_dir;
+  void *data;
+};
+
+struct remote_stream {
+  GQueue queue;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  struct exclusions *exclusions;
+  int done;
+  int failed;
+};
+
+struct merge_batch {
+  GPtrArray *lfs;
+  /* cf_name -> remote MD5 (NULL if the ETag isn't one) */
+  GHashTable *remote_hashes;
+};
+
+struct merge_stats {
+  unsigned long uploads;
+  unsigned long deletes;
+  unsigned long in_sync;
+  unsigned long deferred;
+};
+
+static gint
+compare_sorted_entries (gconstpointer a, gconstpointer b)
+{
+  const struct sorted_entry *ea = *(struct sorted_entry * const *) a;
+  const struct sorted_entry *eb = *(struct sorted_entry * const *) b;
+  return strcmp (ea->name, eb->name);
+}
+
+static void
+destroy_sorted_entry (gpointer item)
+{
+  struct sorted_entry *e = item;
+  free_single_pointer (e->name);
+  free_single_pointer (e);
+}
+
+/* Reads and sorts a directory, and puts it on top of the stack. Takes ownership of fd and path */
+static void
+push_frame (struct sorted_walk *w, int fd, gchar * path)
+{
+  struct dirent *entry;
+  struct stat st;
+  struct walk_frame *frame;
+  DIR *dir = fdopendir (fd);
+
+  if (dir == NULL) {
+    log_msg (LOG_WARNING, "Failed to open directory %s for listing: %s", path, strerror (errno));
+    close (fd);
+    free_single_pointer (path);
+    return;
+  }
+
+  if (w->on_dir != NULL)
+    w->on_dir (path, w->data);
+
+  frame = malloc (sizeof (struct walk_frame));
+  frame->dir = dir;
+  frame->path = path;
+  frame->entries = g_ptr_array_new_with_free_func (destroy_sorted_entry);
+  frame->next = 0;
+
+  while ((entry = readdir (dir))) {
+    int is_dir;
+
+    if (strcmp (entry->d_name, ".") == 0 || strcmp (entry->d_name, "..") == 0)
+      continue;
+
+    if (w->exclusions != NULL) {
+      gchar *fullpath = NULL;
+      Sasprintf (fullpath, "%s/%s", path, entry->d_name);
+      int excluded = regex_match (fullpath, w->exclusions);
+      free_single_pointer (fullpath);
+      if (excluded)
+	continue;
+    }
+
+    if (entry->d_type == DT_DIR)
+      is_dir = TRUE;
+    else if (entry->d_type == DT_REG)
+      is_dir = FALSE;
+    else if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+      if (fstatat (dirfd (dir), entry->d_name, &st, 0) < 0 || (!S_ISDIR (st.st_mode) && !S_ISREG (st.st_mode)))
+	continue;
+      is_dir = S_ISDIR (st.st_mode);
+    }
+    else
+      continue;
+
+    struct sorted_entry *e = malloc (sizeof (struct sorted_entry));
+    e->is_dir = is_dir;
+    e->name = is_dir ? g_strconcat (entry->d_name, "/", NULL) : g_strdup (entry->d_name);
+    g_ptr_array_add (frame->entries, e);
+  }
+
+  g_ptr_array_sort (frame->entries, compare_sorted_entries);
+  g_ptr_array_add (w->stack, frame);
+}
+
+static void
+pop_frame (struct sorted_walk *w)
+{
+  struct walk_frame *frame = g_ptr_array_index (w->stack, w->stack->len - 1);
+  g_ptr_array_set_size (w->stack, w->stack->len - 1);
+  closedir (frame->dir);
+  g_ptr_array_free (frame->entries, TRUE);
+  free_single_pointer (frame->path);
+  free_single_pointer (frame);
+}
+
+/* Returns the next local file in CF listing order (unhashed), or NULL when the walk is over */
+static local_file *
+next_local_file (struct sorted_walk *w)
+{
+  struct stat st;
+
+  while (w->stack->len > 0) {
+    struct walk_frame *frame = g_ptr_array_index (w->stack, w->stack->len - 1);
+    if (frame->next == frame->entries->len) {
+      pop_frame (w);
+      continue;
+    }
+
+    struct sorted_entry *e = g_ptr_array_index (frame->entries, frame->next++);
+    gchar *fullpath = NULL;
+
+    if (e->is_dir) {
+      Sasprintf (fullpath, "%s/%.*s", frame->path, (int) strlen (e->name) - 1, e->name);
+      int child = openat (dirfd (frame->dir), e->name, O_RDONLY | O_DIRECTORY);
+      if (child < 0) {
+	log_msg (LOG_WARNING, "Failed to open directory %s for listing: %s", fullpath, strerror (errno));
+	free_single_pointer (fullpath);
+	continue;
+      }
+      push_frame (w, child, fullpath);
+      continue;
+    }
+
+    if (fstatat (dirfd (frame->dir), e->name, &st, 0) < 0 || !S_ISREG (st.st_mode))
+      continue;
+    Sasprintf (fullpath, "%s/%s", frame->path, e->name);
+    return build_local_file (fullpath, cfg->monitor_dir, &st);
+  }
+  return NULL;
+}
+
+static void
+push_remote (cf_file * f, void *data)
+{
+  struct remote_stream *rs = data;
+
+  pthread_mutex_lock (&rs->lock);
+  /* Holding back the listing (and with it, the socket) is what keeps memory bounded */
+  while (g_queue_get_length (&rs->queue) >= CF_LISTING_LIMIT)
+    pthread_cond_wait (&rs->not_full, &rs->lock);
+  g_queue_push_tail (&rs->queue, f);
+  pthread_cond_signal (&rs->not_empty);
+  pthread_mutex_unlock (&rs->lock);
+}
+
+static void *
+list_remote (void *data)
+{
+  struct remote_stream *rs = data;
+  /* No pipelining - pages have to arrive in order. No arena either, records are freed as we go */
+  long ret = list_files_cf_range (NULL, NULL, rs->exclusions, FALSE, NULL, push_remote, rs);
+
+  pthread_mutex_lock (&rs->lock);
+  rs->done = TRUE;
+  rs->failed = ret < 0;
+  pthread_cond_signal (&rs->not_empty);
+  pthread_mutex_unlock (&rs->lock);
+  return NULL;
+}
+
+/* Returns the next remote file in listing order, or NULL once the listing is over */
+static cf_file *
+next_remote_file (struct remote_stream *rs, gchar ** last_name)
+{
+  cf_file *f;
+
+  while (1) {
+    pthread_mutex_lock (&rs->lock);
+    while (g_queue_is_empty (&rs->queue) && !rs->done)
+      pthread_cond_wait (&rs->not_empty, &rs->lock);
+    f = g_queue_pop_head (&rs->queue);
+    pthread_cond_signal (&rs->not_full);
+    pthread_mutex_unlock (&rs->lock);
+
+    if (f == NULL)
+      return NULL;
+
+    /* A retried page repeats objects we've already seen */
+    if (*last_name != NULL && strcmp (f->name, *last_name) <= 0) {
+      destroy_cf_file (f, NULL);
+      continue;
+    }
+    free_single_pointer (*last_name);
+    *last_name = g_strdup (f->name);
+    return f;
+  }
+}
+
+static void
+flush_batch (struct merge_batch *batch, struct merge_stats *stats)
+{
+  unsigned int i;
+
+  hash_local_files (batch->lfs);
+  for (i = 0; i < batch->lfs->len; i++) {
+    local_file *lf = g_ptr_array_index (batch->lfs, i);
+    unsigned char *remote_md5 = g_hash_table_lookup (batch->remote_hashes, lf->cf_name);
+
+    if (!lf->has_hash) {
+      destroy_local_file (lf);
+    }
+    else if (remote_md5 == NULL || memcmp (lf->md5, remote_md5, MD5_DIGEST_LENGTH) != 0) {
+      log_msg (LOG_DEBUG, "Hash mismatch between local '%s' and remote - need re-uploading!", lf->name);
+      g_async_queue_push (files_to_upload, lf);
+      stats->uploads++;
+    }
+    else {
+      destroy_local_file (lf);
+      stats->in_sync++;
+    }
+  }
+  g_ptr_array_set_size (batch->lfs, 0);
+  g_hash_table_remove_all (batch->remote_hashes);
+}
+
+/* Merge-joins monitor_dir against the container, pushing files onto the upload and delete queues as
+ * differences are found. Every directory walked is passed to on_dir (if not NULL).
+ */
+void
+reconcile_merge (struct exclusions *exclusions, walk_dir_cb on_dir, void *on_dir_data)
+{
+  struct sorted_walk w;
+  struct remote_stream rs;
+  struct merge_batch batch;
+  struct merge_stats stats = { 0, 0, 0, 0 };
+  pthread_t list_thread;
+  gchar *last_name = NULL;
+  local_file *lf;
+  cf_file *cf;
+  int rc, fd;
+  gint64 start = g_get_monotonic_time ();
+
+  g_queue_init (&rs.queue);
+  pthread_mutex_init (&rs.lock, NULL);
+  pthread_cond_init (&rs.not_empty, NULL);
+  pthread_cond_init (&rs.not_full, NULL);
+  rs.exclusions = exclusions;
+  rs.done = FALSE;
+  rs.failed = FALSE;
+
+  rc = pthread_create (&list_thread, NULL, list_remote, &rs);
+  if (rc != 0)
+    suicide ("Failed to spawn listing thread. Error code: %d\n", rc);
+
+  w.stack = g_ptr_array_new ();
+  w.exclusions = exclusions;
+  w.on_dir = on_dir;
+  w.data = on_dir_data;
+  if ((fd = open (cfg->monitor_dir, O_RDONLY | O_DIRECTORY)) < 0)
+    suicide ("Failed to open directory %s for listing: %s", cfg->monitor_dir, strerror (errno));
+  push_frame (&w, fd, g_strdup (cfg->monitor_dir));
+
+  batch.lfs = g_ptr_array_new ();
+  batch.remote_hashes = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) free_single_pointer);
+
+  lf = next_local_file (&w);
+  cf = next_remote_file (&rs, &last_name);
+
+  while (lf != NULL || cf != NULL) {
+    /* The listing broke off. What's left of the walk can't be told apart from files missing remotely */
+    if (cf == NULL && rs.failed)
+      break;
+
+    int cmp = lf == NULL ? 1 : cf == NULL ? -1 : strcmp (lf->cf_name, cf->name);
+
+    /* Anything changed since we started is left to event_buffer_flush() */
+    if (cmp <= 0 && event_buffer_contains (lf->cf_name)) {
+      destroy_local_file (lf);
+      lf = next_local_file (&w);
+      if (cmp == 0) {
+	destroy_cf_file (cf, NULL);
+	cf = next_remote_file (&rs, &last_name);
+      }
+      stats.deferred++;
+    }
+    else if (cmp > 0 && event_buffer_contains (cf->name)) {
+      destroy_cf_file (cf, NULL);
+      cf = next_remote_file (&rs, &last_name);
+      stats.deferred++;
+    }
+    else if (cmp < 0) {
+      log_msg (LOG_DEBUG, "NOT found in remote: '%s' - need uploading", lf->cf_name);
+      g_async_queue_push (files_to_upload, lf);
+      stats.uploads++;
+      lf = next_local_file (&w);
+    }
+    else if (cmp > 0) {
+      log_msg (LOG_DEBUG, "Found file on remote NOT found in local: '%s' - deleting", cf->name);
+      g_async_queue_push (files_to_delete, cf);
+      stats.deletes++;
+      cf = next_remote_file (&rs, &last_name);
+    }
+    else if (cf->len != lf->ver.size) {
+      log_msg (LOG_DEBUG, "Size mismatch between local '%s' and remote - need re-uploading!", lf->name);
+      g_async_queue_push (files_to_upload, lf);
+      stats.uploads++;
+      destroy_cf_file (cf, NULL);
+      lf = next_local_file (&w);
+      cf = next_remote_file (&rs, &last_name);
+    }
+    else {
+      /* Same name and size on both sides - compare hashes once we have a batch worth hashing */
+      unsigned char *remote_md5 = NULL;
+      if (cf->has_hash) {
+	/* Not g_memdup(), which is deprecated since GLib 2.68 */
+	remote_md5 = malloc (MD5_DIGEST_LENGTH);
+	memcpy (remote_md5, cf->md5, MD5_DIGEST_LENGTH);
+      }
+      g_hash_table_insert (batch.remote_hashes, (gpointer) lf->cf_name, remote_md5);
+      g_ptr_array_add (batch.lfs, lf);
+      if (batch.lfs->len == MERGE_HASH_BATCH)
+	flush_batch (&batch, &stats);
+      destroy_cf_file (cf, NULL);
+      lf = next_local_file (&w);
+      cf = next_remote_file (&rs, &last_name);
+    }
+  }
+  if (lf != NULL)
+    destroy_local_file (lf);
+  while (w.stack->len > 0)
+    pop_frame (&w);
+  flush_batch (&batch, &stats);
+
+  pthread_join (list_thread, NULL);
+  if (rs.failed)
+    suicide ("Something went wrong when listing files in container %s. Bailing...\n", cfg->container);
+  else {
+    log_msg (LOG_INFO, "Merge reconciliation done in %.2fs: %lu to upload, %lu to delete, %lu in sync, %lu changed meanwhile",
+	     (g_get_monotonic_time () - start) / 1000000.0, stats.uploads, stats.deletes, stats.in_sync, stats.deferred);
+    log_phase ("merge", start);
+  }
+
+  g_ptr_array_free (batch.lfs, TRUE);
+  g_hash_table_destroy (batch.remote_hashes);
+  g_ptr_array_free (w.stack, TRUE);
+  free_single_pointer (last_name);
+  pthread_mutex_destroy (&rs.lock);
+  pthread_cond_destroy (&rs.not_empty);
+  pthread_cond_destroy (&rs.not_full);
+}
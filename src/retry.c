@@ -0,0 +1,213 @@
+#include "ccfsync.h"
+#include <time.h>
+
+/* Retry policy shared by everything that talks to CF.
+ *
+ * A failed request is sorted into one of: retry it, reauthenticate and then retry it, or give up on it
+ * (retry_classify()). Retries back off exponentially with full jitter - a random delay between nothing and
+ * min(retry_max_delay, RETRY_BASE_DELAY * 2^attempts) - so when CF throttles a burst with 429s or 503s, the workers
+ * spread out rather than all coming back a second later in lock-step. A Retry-After from CF is honoured, up to
+ * retry_max_delay. A record is given up on after retry_attempts goes.
+ *
+ * The worker threads don't sleep through the delay. They hand the record to the delay queue here, whose thread puts
+ * it back on its work queue once it's due, and get on with something else meanwhile.
+ */
+
+#define RETRY_BASE_DELAY (G_USEC_PER_SEC / 2)
+
+struct delayed_record {
+  /* g_get_monotonic_time() when it's due back on queue */
+  gint64 due;
+  GAsyncQueue *queue;
+  gpointer record;
+  GDestroyNotify destroy;
+};
+
+static pthread_mutex_t retry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t retry_cond;
+/* Soonest due first */
+static GQueue *delayed = NULL;
+static int retry_stopped = FALSE;
+static unsigned long retries_scheduled = 0;
+
+/* What to do about a request that came back with http_code (0 if it never got a response, -1 if it couldn't be
+ * made at all)
+ */
+int
+retry_classify (long http_code)
+{
+  if (http_code >= 200 && http_code < 300)
+    return RETRY_DONE;
+  if (http_code == 401)
+    return RETRY_REAUTH;
+  if (http_code < 0)
+    return RETRY_FATAL;
+
+  switch (http_code) {
+  case 0:
+    /* Connection level failure */
+  case 408:
+  case 409:
+    /* 422: what CF received didn't match the ETag - the file has probably changed since we hashed it */
+  case 422:
+  case 425:
+  case 429:
+    /* Rackspace's rate limiting */
+  case 498:
+  case 499:
+    return RETRY_AGAIN;
+  default:
+    return http_code >= 500 ? RETRY_AGAIN : RETRY_FATAL;
+  }
+}
+
+/* How long to wait before the attempts'th retry, in microseconds. retry_after is CF's Retry-After (in seconds, 0
+ * if there wasn't one)
+ */
+gint64
+retry_delay (int attempts, long retry_after)
+{
+  gint64 cap = (gint64) cfg->retry_max_delay * G_USEC_PER_SEC;
+  gint64 ceiling = RETRY_BASE_DELAY << MIN (MAX (attempts - 1, 0), 30);
+  gint64 delay;
+
+  if (ceiling > cap)
+    ceiling = cap;
+  delay = (gint64) (g_random_double () * ceiling);
+  if (retry_after > 0 && retry_after * G_USEC_PER_SEC > delay)
+    delay = MIN (retry_after * G_USEC_PER_SEC, cap);
+  return delay;
+}
+
+/* Decides what happens after a request for a record came back with http_code, expected being success.
+ * Reauthenticates on a 401, and counts the attempt against *attempts. Returns RETRY_DONE, RETRY_FATAL, or
+ * RETRY_AGAIN with *delay set to how long to wait (in microseconds)
+ */
+int
+retry_decide (const gchar * who, long http_code, long expected, unsigned char *attempts, long retry_after, gint64 * delay)
+{
+  int action;
+
+  if (http_code == expected)
+    return RETRY_DONE;
+  action = retry_classify (http_code);
+  /* Some other 2xx isn't what we asked for - try again */
+  if (action == RETRY_DONE)
+    action = RETRY_AGAIN;
+  if (action == RETRY_REAUTH) {
+    reauthenticate (who);
+    action = RETRY_AGAIN;
+  }
+  if (action == RETRY_AGAIN && ++*attempts >= cfg->retry_attempts) {
+    log_msg (LOG_DEBUG, "%s: Giving up after %d attempts", who, *attempts);
+    action = RETRY_FATAL;
+  }
+  if (action == RETRY_AGAIN) {
+    *delay = retry_delay (*attempts, retry_after);
+    log_msg (LOG_DEBUG, "%s: HTTP %ld - retrying in %.1fs (attempt %d of %d)", who, http_code, (double) *delay / G_USEC_PER_SEC,
+	     *attempts + 1, cfg->retry_attempts);
+  }
+  return action;
+}
+
+static gint
+due_cmp (gconstpointer a, gconstpointer b, gpointer data)
+{
+  const struct delayed_record *x = a, *y = b;
+  return x->due < y->due ? -1 : x->due > y->due;
+}
+
+/* Puts record back on queue after delay microseconds. If we're exiting, it's destroyed instead */
+void
+retry_later (GAsyncQueue * queue, gpointer record, gint64 delay, GDestroyNotify destroy)
+{
+  struct delayed_record *d;
+
+  pthread_mutex_lock (&retry_mutex);
+  if (retry_stopped || delayed == NULL) {
+    pthread_mutex_unlock (&retry_mutex);
+    destroy (record);
+    return;
+  }
+  d = malloc (sizeof (struct delayed_record));
+  d->due = g_get_monotonic_time () + delay;
+  d->queue = queue;
+  d->record = record;
+  d->destroy = destroy;
+  g_queue_insert_sorted (delayed, d, due_cmp, NULL);
+  if (++retries_scheduled % 1000 == 0)
+    log_msg (LOG_INFO, "%lu retries scheduled so far, %u waiting", retries_scheduled, g_queue_get_length (delayed));
+  pthread_cond_signal (&retry_cond);
+  pthread_mutex_unlock (&retry_mutex);
+}
+
+static void *
+retry_thread (void *data)
+{
+  struct delayed_record *d;
+  struct timespec ts;
+
+  pthread_mutex_lock (&retry_mutex);
+  while (!retry_stopped) {
+    d = g_queue_peek_head (delayed);
+    if (d == NULL) {
+      pthread_cond_wait (&retry_cond, &retry_mutex);
+      continue;
+    }
+    if (d->due > g_get_monotonic_time ()) {
+      /* g_get_monotonic_time() is CLOCK_MONOTONIC, which retry_cond waits on */
+      ts.tv_sec = d->due / G_USEC_PER_SEC;
+      ts.tv_nsec = (d->due % G_USEC_PER_SEC) * 1000;
+      pthread_cond_timedwait (&retry_cond, &retry_mutex, &ts);
+      continue;
+    }
+    g_queue_pop_head (delayed);
+    g_async_queue_push (d->queue, d->record);
+    free_single_pointer (d);
+  }
+  pthread_mutex_unlock (&retry_mutex);
+  return NULL;
+}
+
+void
+retry_init ()
+{
+  pthread_condattr_t attr;
+  pthread_attr_t thread_attr;
+  pthread_t thread;
+  int rc;
+
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&retry_cond, &attr);
+  pthread_condattr_destroy (&attr);
+  delayed = g_queue_new ();
+
+  pthread_attr_init (&thread_attr);
+  pthread_attr_setdetachstate (&thread_attr, PTHREAD_CREATE_DETACHED);
+  rc = pthread_create (&thread, &thread_attr, retry_thread, NULL);
+  pthread_attr_destroy (&thread_attr);
+  if (rc != 0)
+    suicide ("Failed to spawn retry thread. Error code: %d\n", rc);
+}
+
+/* We're exiting: anything still waiting for a retry is dropped, like everything else that's queued */
+void
+retry_stop ()
+{
+  struct delayed_record *d;
+  guint dropped;
+
+  pthread_mutex_lock (&retry_mutex);
+  retry_stopped = TRUE;
+  dropped = delayed != NULL ? g_queue_get_length (delayed) : 0;
+  while (delayed != NULL && (d = g_queue_pop_head (delayed)) != NULL) {
+    d->destroy (d->record);
+    free_single_pointer (d);
+  }
+  pthread_cond_signal (&retry_cond);
+  pthread_mutex_unlock (&retry_mutex);
+
+  if (dropped > 0)
+    log_msg (LOG_INFO, "Dropped %u records that were waiting to be retried", dropped);
+}
@@ -1,12 +1,10 @@
 #include "ccfsync.h"
+#include <signal.h>
 
-void
-signal_ignore (int sig)
-{
-  log_msg (LOG_DEBUG, "Ignoring signal %d", sig);
-  return;
-
-}
+/* SIGINT, SIGTERM and SIGQUIT are blocked in every thread, and taken by signal_thread() with sigwait() instead of
+ * being handled by whichever thread they happen to interrupt. Shutting down takes locks (the coalescer's and
+ * retry.c's) that the interrupted thread could be holding.
+ */
 
 void
 signal_handler (int sig)
@@ -26,39 +24,39 @@ signal_handler (int sig)
    * will throw a fit if we don't 
    */
   int i;
+  /* The multi engine has a single thread reading each queue */
+  int multi = cfg->transfer_engine == TRANSFER_MULTI;
 
   if (sig == SIGINT || sig == SIGTERM) {
+    /* Before draining, since dropping a delayed copy puts its original back on files_to_delete */
+    coalesce_stop ();
+    retry_stop ();
     drain_queue (files_to_upload);
     drain_queue (files_to_delete);
     drain_queue (files_to_copy);
 
     /* Kill the upload threads */
-    for (i = 0; i < cfg->num_upload_threads; i++) {
-      local_file *lf = malloc (sizeof (local_file));
-      lf->st = malloc (sizeof (struct stat));
-      lf->cf_name = g_strdup ("dummy");
-      lf->hash = g_strdup ("dummy");
-      lf->name = g_strdup ("dummy");
-      lf->sentinel = g_strdup ("exit");
+    for (i = 0; i < (multi ? 1 : cfg->num_upload_threads); i++) {
+      local_file *lf = calloc (1, sizeof (local_file) + 1);
+      lf->cf_name = lf->name;
+      lf->type = RECORD_EXIT;
       g_async_queue_push (files_to_upload, lf);
     }
 
     /* Kill the delete threads */
-    for (i = 0; i < cfg->num_delete_threads; i++) {
-      cf_file *cf = malloc (sizeof (cf_file));
-      cf->sentinel = g_strdup ("exit");
-      cf->content_type = g_strdup ("dummy");
-      cf->hash = g_strdup ("dummy");
-      cf->local_path = g_strdup ("dummy");
+    for (i = 0; i < (multi ? 1 : cfg->num_delete_threads); i++) {
+      cf_file *cf = new_cf_file ("", NULL);
+      cf->type = RECORD_EXIT;
       g_async_queue_push (files_to_delete, cf);
     }
 
     /* Kill the copy threads */
-    for (i = 0; i < cfg->num_copy_threads; i++) {
+    for (i = 0; i < (multi ? 1 : cfg->num_copy_threads); i++) {
       cf_file_copy *cfc = malloc (sizeof (cf_file_copy));
       cfc->old_name = g_strdup ("dummy");
       cfc->new_name = g_strdup ("dummy");
-      cfc->sentinel = g_strdup ("exit");
+      cfc->type = RECORD_EXIT;
+      cfc->attempts = 0;
       cfc->cf_file = NULL;
       g_async_queue_push (files_to_copy, cfc);
     }
@@ -70,3 +68,45 @@ signal_handler (int sig)
   /* Once all the threads which are joined from main() dies, we'll quit */
 
 }
+
+static void *
+signal_thread (void *data)
+{
+  sigset_t *set = data;
+  int sig;
+
+  while (TRUE) {
+    if (sigwait (set, &sig) != 0)
+      continue;
+    signal_handler (sig);
+  }
+  return NULL;
+}
+
+/* Has to be called before any other thread is started, so that they all inherit the signals being blocked */
+void
+signals_init ()
+{
+  static sigset_t set;
+  sigset_t all, old;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int rc;
+
+  sigemptyset (&set);
+  sigaddset (&set, SIGINT);
+  sigaddset (&set, SIGTERM);
+  sigaddset (&set, SIGQUIT);
+  pthread_sigmask (SIG_BLOCK, &set, NULL);
+
+  /* Everything blocked in the thread itself, so it can't end up with a signal meant for another one (SIGHUP) */
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  rc = pthread_create (&thread, &attr, signal_thread, &set);
+  pthread_attr_destroy (&attr);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  if (rc != 0)
+    suicide ("Failed to spawn signal handling thread. Error code: %d\n", rc);
+}
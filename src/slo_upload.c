@@ -0,0 +1,676 @@
+#include "ccfsync.h"
+#include <fcntl.h>
+#include <openssl/md5.h>
+
+/* Files bigger than slo_threshold are uploaded as Static Large Objects: the file is cut into slo_segment_size
+ * pieces, which are read with pread() and PUT concurrently by slo_segment_threads workers into
+ * <container>_segments, each retried on its own. Once they're all up, a manifest listing them is PUT in place of
+ * the object.
+ *
+ * CF reports the ETag of an SLO as the MD5 of its segments' (hex) MD5s strung together, not the MD5 of the
+ * content. slo_hash_file() works the same thing out locally, and hash_local_file() uses it for any file we'd
+ * upload this way, so comparing against the container listing works as it does for everything else.
+ *
+ * Segments are named <object>/slo/<mtime>/<size>/<segment size>/<index>, so a re-upload of a changed file never
+ * touches the segments of the manifest that's live. Once the new manifest is up, every other segment under
+ * <object>/slo/ (the replaced manifest's) is deleted. Deleting an object we know to be an SLO - from uploading it,
+ * or from a listing - is done with ?multipart-manifest=delete, which takes its segments with it (see delete_file.c).
+ *
+ * Segment (and manifest) retries follow the usual policy (see retry.c), but are waited out here: the rest of the
+ * file's segments carry on meanwhile.
+ */
+
+/* CF won't take a manifest with more segments than this, so bigger files get bigger segments */
+#define SLO_MAX_SEGMENTS 1000
+#define SLO_HASH_CHUNK_SIZE 65536
+
+struct slo_segment {
+  goffset offset;
+  goffset size;
+  unsigned char md5[MD5_DIGEST_LENGTH];
+};
+
+struct slo_upload {
+  local_file *lf;
+  int fd;
+  /* Segment names, without the index */
+  gchar *prefix;
+  struct slo_segment *segments;
+  guint count;
+  pthread_mutex_t lock;
+  /* Next segment for a worker to pick up */
+  guint next;
+  int failed;
+};
+
+struct slo_worker {
+  struct slo_upload *slo;
+  int thid;
+};
+
+/* What curl reads a segment through */
+struct segment_source {
+  int fd;
+  goffset offset;
+  goffset left;
+  MD5_CTX md5;
+};
+
+static pthread_mutex_t segments_container_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int segments_container_ready = FALSE;
+
+/* Names of the objects we know (or, going by their size in a listing, expect) to be SLOs */
+static pthread_mutex_t slo_objects_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *slo_objects = NULL;
+
+/* Whether a file of size bytes is uploaded (and hashed) as an SLO */
+int
+slo_wanted (guint64 size)
+{
+  return cfg->slo_threshold > 0 && size > (guint64) cfg->slo_threshold;
+}
+
+void
+slo_note (const gchar * name)
+{
+  pthread_mutex_lock (&slo_objects_mutex);
+  if (slo_objects == NULL)
+    slo_objects = g_hash_table_new_full (g_str_hash, g_str_equal, (GDestroyNotify) free_single_pointer, NULL);
+  if (!g_hash_table_lookup_extended (slo_objects, name, NULL, NULL))
+    g_hash_table_insert (slo_objects, g_strdup (name), NULL);
+  pthread_mutex_unlock (&slo_objects_mutex);
+}
+
+void
+slo_forget (const gchar * name)
+{
+  pthread_mutex_lock (&slo_objects_mutex);
+  if (slo_objects != NULL)
+    g_hash_table_remove (slo_objects, name);
+  pthread_mutex_unlock (&slo_objects_mutex);
+}
+
+/* Whether name is an SLO, as far as we know - deleting it has to take its segments too */
+int
+slo_known (const gchar * name)
+{
+  int known;
+
+  pthread_mutex_lock (&slo_objects_mutex);
+  known = slo_objects != NULL && g_hash_table_lookup_extended (slo_objects, name, NULL, NULL);
+  pthread_mutex_unlock (&slo_objects_mutex);
+  return known;
+}
+
+/* The segment size used for a file of size bytes */
+static goffset
+slo_segment_size (guint64 size)
+{
+  goffset segment_size = cfg->slo_segment_size;
+
+  if ((size + segment_size - 1) / segment_size > SLO_MAX_SEGMENTS)
+    segment_size = (size + SLO_MAX_SEGMENTS - 1) / SLO_MAX_SEGMENTS;
+  return segment_size;
+}
+
+/* Works out the ETag CF will give file as an SLO, into md5. Returns -1 if the file can't be read */
+int
+slo_hash_file (gchar * file, guint64 size, unsigned char *md5)
+{
+  unsigned char data[SLO_HASH_CHUNK_SIZE];
+  unsigned char segment_md5[MD5_DIGEST_LENGTH];
+  char hex[MD5_DIGEST_LENGTH * 2 + 1];
+  goffset segment_size = slo_segment_size (size);
+  goffset left = 0;
+  MD5_CTX slo_ctx, segment_ctx;
+  size_t bytes;
+
+  FILE *fp = fopen (file, "rb");
+  if (!fp)
+    return -1;
+
+  MD5_Init (&slo_ctx);
+  while (TRUE) {
+    if (left == 0) {
+      MD5_Init (&segment_ctx);
+      left = segment_size;
+    }
+    bytes = fread (data, 1, MIN ((goffset) sizeof (data), left), fp);
+    if (bytes == 0)
+      break;
+    MD5_Update (&segment_ctx, data, bytes);
+    left -= bytes;
+    if (left == 0) {
+      MD5_Final (segment_md5, &segment_ctx);
+      md5_to_hex (segment_md5, hex);
+      MD5_Update (&slo_ctx, hex, MD5_DIGEST_LENGTH * 2);
+    }
+  }
+  if (ferror (fp)) {
+    fclose (fp);
+    return -1;
+  }
+  fclose (fp);
+
+  /* A last segment that's shorter than the rest */
+  if (left != segment_size) {
+    MD5_Final (segment_md5, &segment_ctx);
+    md5_to_hex (segment_md5, hex);
+    MD5_Update (&slo_ctx, hex, MD5_DIGEST_LENGTH * 2);
+  }
+  MD5_Final (md5, &slo_ctx);
+  return 0;
+}
+
+/* Makes sure <container>_segments exists. It's only created once per run. Returns the HTTP code - 201 or 202 if
+ * it's there
+ */
+static long
+ensure_segments_container (struct worker_conn *wc)
+{
+  CURL *curl;
+  CURLcode res;
+  long http_code = 0;
+  gchar *url = NULL;
+  struct curl_slist *headers;
+  unsigned char attempts = 0;
+  gint64 delay;
+
+  pthread_mutex_lock (&segments_container_mutex);
+  while (!segments_container_ready) {
+    if ((curl = worker_conn_get (wc)) == NULL)
+      break;
+    Sasprintf (url, "%s/%s_segments", auth->endpoint, cfg->container);
+    headers = curl_slist_append (NULL, auth->token_header);
+    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt (curl, CURLOPT_URL, url);
+    curl_easy_setopt (curl, CURLOPT_CUSTOMREQUEST, "PUT");
+    curl_easy_setopt (curl, CURLOPT_POSTFIELDS, "");
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, curl_devnull);
+    rate_limit_take (RATE_PUT, 1);
+    res = curl_easy_perform (curl);
+    if (res != CURLE_OK || curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &http_code) != CURLE_OK)
+      http_code = 0;
+    worker_conn_done (wc, res);
+    curl_slist_free_all (headers);
+    free_single_pointer (url);
+    url = NULL;
+
+    if (http_code == 201 || http_code == 202) {
+      log_msg (LOG_DEBUG, "Segment container %s_segments is ready", cfg->container);
+      segments_container_ready = TRUE;
+    }
+    else if (retry_decide (worker_conn_name (wc), http_code, 201, &attempts, worker_conn_retry_after (wc), &delay) == RETRY_AGAIN)
+      g_usleep (delay);
+    else {
+      log_msg (LOG_WARNING, "Failed to create segment container %s_segments: HTTP %ld", cfg->container, http_code);
+      break;
+    }
+  }
+  if (segments_container_ready)
+    http_code = 201;
+  pthread_mutex_unlock (&segments_container_mutex);
+  return http_code;
+}
+
+static size_t
+read_segment (char *buffer, size_t size, size_t nitems, void *data)
+{
+  struct segment_source *src = data;
+  ssize_t n;
+
+  if (src->left == 0)
+    return 0;
+  n = pread (src->fd, buffer, MIN ((goffset) (size * nitems), src->left), src->offset);
+  /* A file that's shrunk since we stat()ed it can't make the segment up */
+  if (n <= 0)
+    return CURL_READFUNC_ABORT;
+  MD5_Update (&src->md5, buffer, n);
+  src->offset += n;
+  src->left -= n;
+  rate_limit_take (RATE_BYTES, n);
+  return n;
+}
+
+/* PUTs a single segment. Returns the HTTP code */
+static long
+put_segment (struct worker_conn *wc, struct slo_upload *slo, guint index, int thid)
+{
+  struct slo_segment *seg = &slo->segments[index];
+  struct segment_source src;
+  struct curl_slist *headers;
+  CURL *curl;
+  CURLcode res;
+  long http_code = 0;
+  gchar *url = NULL, *prefix;
+
+  if ((curl = worker_conn_get (wc)) == NULL)
+    return 0;
+
+  src.fd = slo->fd;
+  src.offset = seg->offset;
+  src.left = seg->size;
+  MD5_Init (&src.md5);
+
+  prefix = g_uri_escape_string (slo->prefix, "/", FALSE);
+  Sasprintf (url, "%s/%s_segments/%s/%08u", auth->endpoint, cfg->container, prefix, index);
+  free_single_pointer (prefix);
+  headers = curl_slist_append (NULL, auth->token_header);
+  curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+  curl_easy_setopt (curl, CURLOPT_UPLOAD, 1L);
+  curl_easy_setopt (curl, CURLOPT_URL, url);
+  curl_easy_setopt (curl, CURLOPT_READFUNCTION, read_segment);
+  curl_easy_setopt (curl, CURLOPT_READDATA, &src);
+  curl_easy_setopt (curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t) seg->size);
+  curl_set_upload_buffer (curl);
+  curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, curl_devnull);
+
+  rate_limit_take (RATE_PUT, 1);
+  res = curl_easy_perform (curl);
+  if (res != CURLE_OK || curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &http_code) != CURLE_OK)
+    http_code = 0;
+  if (res != CURLE_OK)
+    log_msg (LOG_ERR, "Segment thread %d: Request failed: %s", thid, curl_easy_strerror (res));
+  worker_conn_done (wc, res);
+
+  if (http_code == 201)
+    MD5_Final (seg->md5, &src.md5);
+  curl_slist_free_all (headers);
+  free_single_pointer (url);
+  return http_code;
+}
+
+/* Takes segments off slo until there are none left (or one has failed for good), uploading each with retries */
+static void *
+segment_worker (void *data)
+{
+  struct slo_worker *w = data;
+  struct slo_upload *slo = w->slo;
+  struct worker_conn *wc = worker_conn_new ("Segment", w->thid);
+  guint index;
+  long http_code;
+  unsigned char attempts;
+  gint64 delay;
+
+  while (TRUE) {
+    pthread_mutex_lock (&slo->lock);
+    index = slo->next++;
+    if (slo->failed)
+      index = slo->count;
+    pthread_mutex_unlock (&slo->lock);
+    if (index >= slo->count)
+      break;
+
+    attempts = 0;
+    while (TRUE) {
+      http_code = put_segment (wc, slo, index, w->thid);
+      log_msg (LOG_DEBUG, "Segment thread %d: HTTP return code %ld for segment %u of '%s'", w->thid, http_code, index,
+	       slo->lf->name);
+      if (retry_decide (worker_conn_name (wc), http_code, 201, &attempts, worker_conn_retry_after (wc), &delay) != RETRY_AGAIN)
+	break;
+      g_usleep (delay);
+    }
+
+    if (http_code != 201) {
+      log_msg (LOG_ERR, "Segment thread %d: Segment %u of '%s' failed to upload! HTTP return code: %ld", w->thid, index,
+	       slo->lf->name, http_code);
+      pthread_mutex_lock (&slo->lock);
+      slo->failed = TRUE;
+      pthread_mutex_unlock (&slo->lock);
+      break;
+    }
+  }
+
+  worker_conn_free (wc);
+  return NULL;
+}
+
+/* The manifest listing every segment, as CF wants it for ?multipart-manifest=put */
+static gchar *
+build_manifest (struct slo_upload *slo)
+{
+  json_t *manifest = json_array ();
+  char hex[MD5_DIGEST_LENGTH * 2 + 1];
+  gchar *path = NULL, *body;
+  guint i;
+
+  for (i = 0; i < slo->count; i++) {
+    json_t *seg = json_object ();
+    Sasprintf (path, "/%s_segments/%s/%08u", cfg->container, slo->prefix, i);
+    md5_to_hex (slo->segments[i].md5, hex);
+    json_object_set_new (seg, "path", json_string (path));
+    json_object_set_new (seg, "etag", json_string (hex));
+    json_object_set_new (seg, "size_bytes", json_integer (slo->segments[i].size));
+    json_array_append_new (manifest, seg);
+  }
+  free_single_pointer (path);
+  body = json_dumps (manifest, JSON_COMPACT);
+  json_decref (manifest);
+  return body;
+}
+
+/* PUTs the manifest, with retries. Returns the last HTTP code */
+static long
+put_manifest (struct worker_conn *wc, struct slo_upload *slo, int thid)
+{
+  gchar *body = build_manifest (slo);
+  gchar *object = g_uri_escape_string (slo->lf->cf_name, "/", FALSE);
+  gchar *url = NULL;
+  struct curl_slist *headers;
+  CURL *curl;
+  CURLcode res;
+  long http_code = 0;
+  unsigned char attempts = 0;
+  gint64 delay;
+
+  while (TRUE) {
+    if ((curl = worker_conn_get (wc)) == NULL) {
+      http_code = -1;
+      break;
+    }
+    Sasprintf (url, "%s/%s/%s?multipart-manifest=put", auth->endpoint, cfg->container, object);
+    headers = curl_slist_append (NULL, auth->token_header);
+    /* Leave CF to work the content type out from the name, as it does for everything else we upload */
+    headers = curl_slist_append (headers, "Content-Type:");
+    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt (curl, CURLOPT_URL, url);
+    curl_easy_setopt (curl, CURLOPT_CUSTOMREQUEST, "PUT");
+    curl_easy_setopt (curl, CURLOPT_POSTFIELDS, body);
+    curl_easy_setopt (curl, CURLOPT_POSTFIELDSIZE, (long) strlen (body));
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, curl_devnull);
+
+    rate_limit_take (RATE_PUT, 1);
+    res = curl_easy_perform (curl);
+    if (res != CURLE_OK || curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &http_code) != CURLE_OK)
+      http_code = 0;
+    worker_conn_done (wc, res);
+    curl_slist_free_all (headers);
+    free_single_pointer (url);
+    url = NULL;
+
+    log_msg (LOG_DEBUG, "Upload thread %d: HTTP return code %ld for the manifest of '%s'", thid, http_code, slo->lf->name);
+    if (retry_decide (worker_conn_name (wc), http_code, 201, &attempts, worker_conn_retry_after (wc), &delay) != RETRY_AGAIN)
+      break;
+    g_usleep (delay);
+  }
+
+  free (body);
+  free_single_pointer (object);
+  return http_code;
+}
+
+/* Lists the segments in <container>_segments whose names start with prefix, with retries. Returns their names, or
+ * NULL if the listing failed
+ */
+static GPtrArray *
+list_segments (struct worker_conn *wc, const gchar * prefix)
+{
+  GPtrArray *names = g_ptr_array_new ();
+  gchar *escaped = g_uri_escape_string (prefix, NULL, FALSE);
+  gchar *marker = NULL, *url = NULL;
+  struct curl_slist *headers;
+  struct string resp;
+  CURL *curl;
+  CURLcode res;
+  json_t *root, *name;
+  json_error_t error;
+  long http_code;
+  unsigned char attempts = 0;
+  gint64 delay;
+  size_t i, count;
+
+  g_ptr_array_set_free_func (names, (GDestroyNotify) free_single_pointer);
+  while (TRUE) {
+    if ((curl = worker_conn_get (wc)) == NULL)
+      break;
+    Sasprintf (url, "%s/%s_segments?format=json&limit=%d&prefix=%s", auth->endpoint, cfg->container, CF_LISTING_LIMIT, escaped);
+    if (marker != NULL) {
+      gchar *escaped_marker = g_uri_escape_string (marker, NULL, FALSE);
+      Sasprintf (url, "%s&marker=%s", url, escaped_marker);
+      free_single_pointer (escaped_marker);
+    }
+    init_string (&resp);
+    headers = curl_slist_append (NULL, auth->token_header);
+    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt (curl, CURLOPT_URL, url);
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, write_data);
+    curl_easy_setopt (curl, CURLOPT_WRITEDATA, &resp);
+    res = curl_easy_perform (curl);
+    if (res != CURLE_OK || curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &http_code) != CURLE_OK)
+      http_code = 0;
+    worker_conn_done (wc, res);
+    curl_slist_free_all (headers);
+    free_single_pointer (url);
+    url = NULL;
+
+    /* Nothing (left) to list */
+    if (http_code == 204 || http_code == 404) {
+      free_single_pointer (resp.data);
+      break;
+    }
+    if (http_code == 200) {
+      if ((root = json_loads (resp.data, 0, &error)) == NULL || !json_is_array (root)) {
+	log_msg (LOG_WARNING, "Malformed listing of %s_segments: %s", cfg->container, root == NULL ? error.text : "not an array");
+	json_decref (root);
+	free_single_pointer (resp.data);
+	break;
+      }
+      count = json_array_size (root);
+      for (i = 0; i < count; i++)
+	if (json_is_string (name = json_object_get (json_array_get (root, i), "name")))
+	  g_ptr_array_add (names, g_strdup (json_string_value (name)));
+      json_decref (root);
+      free_single_pointer (resp.data);
+      if (count < CF_LISTING_LIMIT || names->len == 0) {
+	free_single_pointer (marker);
+	free_single_pointer (escaped);
+	return names;
+      }
+      free_single_pointer (marker);
+      marker = g_strdup (g_ptr_array_index (names, names->len - 1));
+      attempts = 0;
+      continue;
+    }
+    free_single_pointer (resp.data);
+    if (retry_decide (worker_conn_name (wc), http_code, 200, &attempts, worker_conn_retry_after (wc), &delay) != RETRY_AGAIN) {
+      log_msg (LOG_WARNING, "Failed to list %s_segments: HTTP %ld", cfg->container, http_code);
+      g_ptr_array_free (names, TRUE);
+      names = NULL;
+      break;
+    }
+    g_usleep (delay);
+  }
+
+  free_single_pointer (marker);
+  free_single_pointer (escaped);
+  return names;
+}
+
+/* Deletes a segment from <container>_segments, with retries. Returns the last HTTP code */
+static long
+delete_segment (struct worker_conn *wc, const gchar * name)
+{
+  gchar *object = g_uri_escape_string (name, "/", FALSE);
+  gchar *url = NULL;
+  struct curl_slist *headers;
+  CURL *curl;
+  CURLcode res;
+  long http_code = 0;
+  unsigned char attempts = 0;
+  gint64 delay;
+
+  Sasprintf (url, "%s/%s_segments/%s", auth->endpoint, cfg->container, object);
+  while ((curl = worker_conn_get (wc)) != NULL) {
+    delete_request_setup (curl, &headers, auth->token_header, url, NULL);
+    rate_limit_take (RATE_DELETE, 1);
+    res = curl_easy_perform (curl);
+    if (res != CURLE_OK || curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &http_code) != CURLE_OK)
+      http_code = 0;
+    worker_conn_done (wc, res);
+    curl_slist_free_all (headers);
+
+    /* Already gone is as good as deleted */
+    if (http_code == 404)
+      http_code = 204;
+    if (retry_decide (worker_conn_name (wc), http_code, 204, &attempts, worker_conn_retry_after (wc), &delay) != RETRY_AGAIN)
+      break;
+    g_usleep (delay);
+  }
+  free_single_pointer (url);
+  free_single_pointer (object);
+  return http_code;
+}
+
+/* Whether name (past "<object>/slo/") is how we name a segment: <mtime>/<size>/<segment size>/<index>. Anything
+ * else under there belongs to another object - one called "<object>/slo/...", a file in a directory since
+ */
+static int
+is_segment_name (const gchar * name)
+{
+  int slashes = 0;
+
+  if (!g_ascii_isdigit (name[0]))
+    return FALSE;
+  for (; *name != '\0'; name++)
+    if (*name == '/')
+      slashes++;
+  return slashes == 3;
+}
+
+/* The new manifest for slo->lf is up. Deletes the segments of whatever it replaced */
+static void
+delete_old_segments (struct worker_conn *wc, struct slo_upload *slo, int thid)
+{
+  gchar *base = g_strconcat (slo->lf->cf_name, "/slo/", NULL);
+  gchar *live = g_strconcat (slo->prefix, "/", NULL);
+  GPtrArray *names = list_segments (wc, base);
+  const gchar *name;
+  guint i, deleted = 0, failed = 0;
+
+  if (names == NULL)
+    log_msg (LOG_WARNING, "Upload thread %d: Couldn't list the old segments of '%s' - they may need deleting by hand", thid,
+	     slo->lf->cf_name);
+  for (i = 0; names != NULL && i < names->len; i++) {
+    name = g_ptr_array_index (names, i);
+    if (g_str_has_prefix (name, live) || !is_segment_name (name + strlen (base)))
+      continue;
+    if (delete_segment (wc, name) == 204)
+      deleted++;
+    else
+      failed++;
+  }
+  if (deleted > 0 || failed > 0)
+    log_msg (failed > 0 ? LOG_WARNING : LOG_DEBUG, "Upload thread %d: Deleted %u old segments of '%s' (%u failed)", thid, deleted,
+	     slo->lf->cf_name, failed);
+
+  if (names != NULL)
+    g_ptr_array_free (names, TRUE);
+  free_single_pointer (base);
+  free_single_pointer (live);
+}
+
+/* Keep the ETag of what we've just put up, unless the file changed under us while we sent it */
+static void
+set_slo_hash (struct slo_upload *slo)
+{
+  local_file *lf = slo->lf;
+  char hex[MD5_DIGEST_LENGTH * 2 + 1];
+  unsigned char c[MD5_DIGEST_LENGTH];
+  struct stat after;
+  MD5_CTX ctx;
+  guint i;
+
+  if (lf->has_hash)
+    return;
+  if (fstat (slo->fd, &after) < 0 || !stat_unchanged (&lf->ver, &after))
+    return;
+
+  MD5_Init (&ctx);
+  for (i = 0; i < slo->count; i++) {
+    md5_to_hex (slo->segments[i].md5, hex);
+    MD5_Update (&ctx, hex, MD5_DIGEST_LENGTH * 2);
+  }
+  MD5_Final (c, &ctx);
+
+  memcpy (lf->md5, c, MD5_DIGEST_LENGTH);
+  lf->has_hash = TRUE;
+  hash_cache_insert (&lf->ver, c);
+}
+
+/* Uploads lf as an SLO, on behalf of upload thread thid (whose connection wc is used for everything but the
+ * segments). Blocks until it's all done. Returns 201 if it made it, otherwise the HTTP code (or -1) that stopped it
+ */
+int
+upload_slo (struct worker_conn *wc, local_file * lf, int thid)
+{
+  struct slo_upload slo;
+  struct slo_worker *workers;
+  pthread_t *threads;
+  goffset segment_size = slo_segment_size (lf->ver.size);
+  int nthreads, i, rc;
+  long http_code = -1;
+
+  memset (&slo, 0, sizeof (slo));
+  slo.lf = lf;
+  if ((slo.fd = open (lf->name, O_RDONLY)) < 0) {
+    log_msg (LOG_WARNING, "Failed to open '%s' for reading: %s\n", lf->name, strerror (errno));
+    return -1;
+  }
+  /* Each segment is read start to finish, if not the file as a whole */
+  posix_fadvise (slo.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  http_code = ensure_segments_container (wc);
+  if (http_code != 201) {
+    close (slo.fd);
+    return http_code;
+  }
+  http_code = -1;
+
+  slo.count = (lf->ver.size + segment_size - 1) / segment_size;
+  slo.segments = calloc (slo.count, sizeof (struct slo_segment));
+  for (i = 0; i < (int) slo.count; i++) {
+    slo.segments[i].offset = i * segment_size;
+    slo.segments[i].size = MIN (segment_size, (goffset) lf->ver.size - slo.segments[i].offset);
+  }
+  Sasprintf (slo.prefix, "%s/slo/%llu.%09llu/%llu/%lld", lf->cf_name, (unsigned long long) lf->ver.mtime_ns / 1000000000ULL,
+	     (unsigned long long) lf->ver.mtime_ns % 1000000000ULL, (unsigned long long) lf->ver.size, (long long) segment_size);
+  pthread_mutex_init (&slo.lock, NULL);
+
+  nthreads = MIN (cfg->slo_segment_threads, (int) slo.count);
+  log_msg (LOG_INFO, "Upload thread %d: Uploading '%s' as %u segments of up to %lld bytes, %d at a time", thid, lf->name,
+	   slo.count, (long long) segment_size, nthreads);
+
+  threads = calloc (nthreads, sizeof (pthread_t));
+  workers = calloc (nthreads, sizeof (struct slo_worker));
+  for (i = 0; i < nthreads; i++) {
+    workers[i].slo = &slo;
+    workers[i].thid = i;
+    if ((rc = pthread_create (&threads[i], NULL, segment_worker, &workers[i])) != 0) {
+      log_msg (LOG_ERR, "Failed to spawn segment thread. Error code: %d", rc);
+      break;
+    }
+  }
+  /* Whatever threads we did get carry on until every segment's done */
+  nthreads = i;
+  for (i = 0; i < nthreads; i++)
+    pthread_join (threads[i], NULL);
+
+  if (nthreads > 0 && !slo.failed && slo.next >= slo.count) {
+    http_code = put_manifest (wc, &slo, thid);
+    if (http_code == 201) {
+      set_slo_hash (&slo);
+      upload_remember (lf);
+      slo_note (lf->cf_name);
+      delete_old_segments (wc, &slo, thid);
+    }
+  }
+
+  pthread_mutex_destroy (&slo.lock);
+  free_single_pointer (threads);
+  free_single_pointer (workers);
+  free_single_pointer (slo.segments);
+  free_single_pointer (slo.prefix);
+  posix_fadvise (slo.fd, 0, 0, POSIX_FADV_DONTNEED);
+  close (slo.fd);
+  return http_code;
+}
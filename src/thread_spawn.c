@@ -8,6 +8,12 @@ spawn_threads ()
   /* Threads handling uploads */
   int i, rc;
 
+  /* One event loop does the lot */
+  if (cfg->transfer_engine == TRANSFER_MULTI) {
+    transfer_multi_start (&thread_inventory->multi_thread);
+    return thread_inventory;
+  }
+
   int total_num_threads = cfg->num_upload_threads + cfg->num_delete_threads + cfg->num_copy_threads;
   /* Threads themselves will free these as they exit */
   thread_data *td[total_num_threads];
@@ -55,6 +61,13 @@ void
 wait_threads (struct thread_inventory *thread_inventory)
 {
   int i;
+
+  if (cfg->transfer_engine == TRANSFER_MULTI) {
+    pthread_join (thread_inventory->multi_thread, NULL);
+    log_msg (LOG_DEBUG, "Transfer event loop has exited...");
+    return;
+  }
+
   for (i = 0; i < cfg->num_upload_threads; i++) {
     pthread_join (thread_inventory->upload_thread[i], NULL);
     log_msg (LOG_DEBUG, "Upload thread %d has exited...", i);
@@ -0,0 +1,786 @@
+#include "ccfsync.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* transfer_engine=multi: uploads, deletes and copies are all driven from one thread, running curl's multi interface
+ * on top of epoll, rather than every request tying up a thread in curl_easy_perform(). Up to max_inflight requests
+ * can be going at once.
+ *
+ * The rest of the daemon still puts work on files_to_upload, files_to_delete and files_to_copy. A feeder thread per
+ * queue pops records off it, and hands them to the event loop (waking it through an eventfd) as long as there's
+ * room for another request. Requests are set up and finished with the same functions the worker threads use, and
+ * failures are retried by the same policy (see retry.c). A transfer waiting for a retry stays here, holding its
+ * slot, rather than going back on its queue.
+ *
+ * With bulk delete, the delete feeder gathers deletions into batches (see bulk_delete.c), each sent as a single
+ * transfer. Objects in a batch that fail are then deleted one at a time.
+ *
+ * Files big enough to go up as Static Large Objects each get a thread of their own instead, running upload_slo()
+ * just as an upload thread would - it uploads the segments in parallel itself. They still take a slot.
+ *
+ * The rate limits (see rate_limit.c) can't be waited for here. A transfer over its request limit is held back on
+ * the delayed list until it's due, and an upload over the bandwidth limit is paused from its read callback and
+ * resumed once there's room.
+ */
+
+#define MULTI_MAX_EVENTS 64
+
+enum transfer_kind {
+  TRANSFER_UPLOAD = 0,
+  TRANSFER_DELETE,
+  TRANSFER_COPY,
+  TRANSFER_KINDS
+};
+
+static const char *transfer_names[TRANSFER_KINDS] = { "upload", "delete", "copy" };
+static const int transfer_rate_limits[TRANSFER_KINDS] = { RATE_PUT, RATE_DELETE, RATE_COPY };
+
+struct multi_engine;
+
+struct transfer {
+  struct multi_engine *engine;
+  enum transfer_kind kind;
+  /* local_file, cf_file or cf_file_copy, depending on kind */
+  gpointer record;
+  /* cf_files to bulk delete, in place of record */
+  GPtrArray *batch;
+  gchar *body;
+  struct string resp;
+  CURL *curl;
+  struct curl_slist *headers;
+  gchar *url;
+  gchar *dest_header;
+  struct upload_source src;
+  /* Deleting an SLO with ?multipart-manifest=delete, whose outcome is in resp */
+  int slo_delete;
+  /* What upload_slo() returned, for large files */
+  int slo_code;
+  unsigned char attempts;
+  /* CF's Retry-After for the last go, in seconds */
+  long retry_after;
+  /* When a failed transfer is next due a go */
+  gint64 retry_at;
+  /* When an upload paused for the bandwidth limit is to carry on - 0 if it isn't paused */
+  gint64 resume_at;
+};
+
+struct multi_engine {
+  CURLM *multi;
+  int epfd;
+  int wakefd;
+  /* When curl next wants CURL_SOCKET_TIMEOUT, or -1 */
+  gint64 timer_at;
+  /* Idle easy handles, kept so their settings don't have to be rebuilt from scratch */
+  GPtrArray *idle_handles;
+  /* Transfers waiting for their retry, soonest first. Only touched by the event loop */
+  GQueue delayed;
+  /* Uploads paused for the bandwidth limit, soonest to resume first. Likewise */
+  GQueue paused;
+  int running;
+  unsigned long done[TRANSFER_KINDS];
+  unsigned long failed[TRANSFER_KINDS];
+  unsigned int peak_inflight;
+  int logged_http_version;
+
+  /* Everything below is shared with the feeders */
+  pthread_mutex_t lock;
+  pthread_cond_t room;
+  /* Transfers handed over by the feeders, not started yet */
+  GQueue incoming;
+  /* Large file uploads whose threads are done with them */
+  GQueue slo_done;
+  int slo_uploads;
+  /* Transfers the feeders have handed over and the loop hasn't finished with (incoming, delayed or running) */
+  unsigned int slots;
+  int feeders;
+  pthread_t feeder_threads[TRANSFER_KINDS];
+};
+
+struct feeder {
+  struct multi_engine *engine;
+  enum transfer_kind kind;
+  GAsyncQueue *queue;
+};
+
+static void
+wake (struct multi_engine *e)
+{
+  uint64_t one = 1;
+  if (write (e->wakefd, &one, sizeof (one)) < 0 && errno != EAGAIN)
+    log_msg (LOG_ERR, "Multi engine: Failed to wake the event loop: %s", strerror (errno));
+}
+
+static int
+is_exit_record (enum transfer_kind kind, gpointer record)
+{
+  switch (kind) {
+  case TRANSFER_UPLOAD:
+    return ((local_file *) record)->type == RECORD_EXIT;
+  case TRANSFER_DELETE:
+    return ((cf_file *) record)->type == RECORD_EXIT;
+  default:
+    return ((cf_file_copy *) record)->type == RECORD_EXIT;
+  }
+}
+
+static void
+destroy_record (enum transfer_kind kind, gpointer record)
+{
+  switch (kind) {
+  case TRANSFER_UPLOAD:
+    destroy_local_file (record);
+    break;
+  case TRANSFER_DELETE:
+    destroy_cf_file (record, NULL);
+    break;
+  default:
+    destroy_cf_file_copy (record);
+    break;
+  }
+}
+
+struct slo_job {
+  struct multi_engine *engine;
+  struct transfer *t;
+  int thid;
+};
+
+static void *
+slo_run (void *data)
+{
+  struct slo_job *job = data;
+  struct multi_engine *e = job->engine;
+  struct worker_conn *wc = worker_conn_new ("Large upload", job->thid);
+
+  job->t->slo_code = upload_slo (wc, job->t->record, job->thid);
+  worker_conn_free (wc);
+
+  pthread_mutex_lock (&e->lock);
+  g_queue_push_tail (&e->slo_done, job->t);
+  pthread_mutex_unlock (&e->lock);
+  wake (e);
+  free_single_pointer (job);
+  return NULL;
+}
+
+/* Hands t (a large file, already holding a slot) to a thread of its own */
+static void
+slo_start (struct multi_engine *e, struct transfer *t)
+{
+  struct slo_job *job = malloc (sizeof (struct slo_job));
+  pthread_attr_t attr;
+  pthread_t thread;
+  int rc;
+
+  job->engine = e;
+  job->t = t;
+  pthread_mutex_lock (&e->lock);
+  job->thid = e->slo_uploads++;
+  pthread_mutex_unlock (&e->lock);
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  if ((rc = pthread_create (&thread, &attr, slo_run, job)) != 0) {
+    log_msg (LOG_ERR, "Multi engine: Failed to spawn a thread for '%s'. Error code: %d", ((local_file *) t->record)->name, rc);
+    t->slo_code = -1;
+    pthread_mutex_lock (&e->lock);
+    g_queue_push_tail (&e->slo_done, t);
+    pthread_mutex_unlock (&e->lock);
+    wake (e);
+    free_single_pointer (job);
+  }
+  pthread_attr_destroy (&attr);
+}
+
+/* Blocks on popping a queue, and hands each record to the event loop once there's room for it */
+static void *
+feed (void *data)
+{
+  struct feeder *f = data;
+  struct multi_engine *e = f->engine;
+
+  /* What stopped the last batch short, if it wasn't an exit record */
+  gpointer next = NULL;
+
+  while (1) {
+    gpointer record = next != NULL ? next : g_async_queue_pop (f->queue);
+    gpointer exit_record = NULL;
+    GPtrArray *batch = NULL;
+
+    next = NULL;
+
+    /* An exit record is put on the queue when we're asked to exit */
+    if (is_exit_record (f->kind, record)) {
+      exit_record = record;
+      record = NULL;
+    }
+    else if (f->kind == TRANSFER_UPLOAD && upload_unchanged (record)) {
+      upload_release (record);
+      continue;
+    }
+    /* SLOs are deleted on their own, to take their segments with them */
+    else if (f->kind == TRANSFER_DELETE && bulk_delete_enabled () && !slo_known (((cf_file *) record)->name)) {
+      upload_forget (((cf_file *) record)->name);
+      batch = g_ptr_array_new ();
+      next = bulk_delete_collect (f->queue, record, batch);
+      if (next != NULL && is_exit_record (f->kind, next)) {
+	exit_record = next;
+	next = NULL;
+      }
+      if (batch->len == 1) {
+	g_ptr_array_free (batch, TRUE);
+	batch = NULL;
+      }
+    }
+    else if (f->kind == TRANSFER_DELETE)
+      upload_forget (((cf_file *) record)->name);
+    else if (f->kind == TRANSFER_COPY)
+      upload_forget (((cf_file_copy *) record)->new_name);
+
+    if (record != NULL) {
+      struct transfer *t = calloc (1, sizeof (struct transfer));
+      int large = f->kind == TRANSFER_UPLOAD && slo_wanted (((local_file *) record)->ver.size);
+      t->kind = f->kind;
+      t->record = batch == NULL ? record : NULL;
+      t->batch = batch;
+
+      pthread_mutex_lock (&e->lock);
+      while (e->slots >= (unsigned int) cfg->max_inflight)
+	pthread_cond_wait (&e->room, &e->lock);
+      e->slots++;
+      if (!large)
+	g_queue_push_tail (&e->incoming, t);
+      pthread_mutex_unlock (&e->lock);
+      if (large)
+	slo_start (e, t);
+      else
+	wake (e);
+    }
+
+    if (exit_record != NULL) {
+      log_msg (LOG_DEBUG, "Multi engine: %s feeder asked to exit...", transfer_names[f->kind]);
+      destroy_record (f->kind, exit_record);
+      pthread_mutex_lock (&e->lock);
+      e->feeders--;
+      pthread_mutex_unlock (&e->lock);
+      wake (e);
+      free_single_pointer (f);
+      return NULL;
+    }
+  }
+}
+
+static int
+socket_cb (CURL * easy, curl_socket_t s, int what, void *userp, void *socketp)
+{
+  struct multi_engine *e = userp;
+  struct epoll_event ev;
+
+  if (what == CURL_POLL_REMOVE) {
+    epoll_ctl (e->epfd, EPOLL_CTL_DEL, s, NULL);
+    return 0;
+  }
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = (what & CURL_POLL_IN ? EPOLLIN : 0) | (what & CURL_POLL_OUT ? EPOLLOUT : 0);
+  ev.data.fd = s;
+  if (epoll_ctl (e->epfd, EPOLL_CTL_MOD, s, &ev) < 0 && (errno != ENOENT || epoll_ctl (e->epfd, EPOLL_CTL_ADD, s, &ev) < 0))
+    log_msg (LOG_ERR, "Multi engine: Failed to watch socket %d: %s", s, strerror (errno));
+  return 0;
+}
+
+static int
+timer_cb (CURLM * multi, long timeout_ms, void *userp)
+{
+  struct multi_engine *e = userp;
+  e->timer_at = timeout_ms < 0 ? -1 : g_get_monotonic_time () + timeout_ms * 1000;
+  return 0;
+}
+
+static const gchar *
+record_name (struct transfer *t)
+{
+  switch (t->kind) {
+  case TRANSFER_UPLOAD:
+    return ((local_file *) t->record)->name;
+  case TRANSFER_DELETE:
+    return t->batch != NULL ? "(bulk delete batch)" : ((cf_file *) t->record)->name;
+  default:
+    return ((cf_file_copy *) t->record)->old_name;
+  }
+}
+
+/* Gives the slot back, and lets a feeder fill it */
+static void
+transfer_free (struct multi_engine *e, struct transfer *t)
+{
+  free_single_pointer (t->url);
+  free_single_pointer (t->dest_header);
+  free_single_pointer (t->body);
+  free_single_pointer (t->resp.data);
+  if (t->batch != NULL)
+    g_ptr_array_free (t->batch, TRUE);
+  free_single_pointer (t);
+
+  pthread_mutex_lock (&e->lock);
+  e->slots--;
+  pthread_cond_broadcast (&e->room);
+  pthread_mutex_unlock (&e->lock);
+}
+
+/* The record's finished with, whether it made it or not */
+static void
+transfer_release (struct multi_engine *e, struct transfer *t, int succeeded)
+{
+  if (succeeded) {
+    e->done[t->kind]++;
+    log_msg (LOG_DEBUG, "Multi engine: %s of '%s' successful", transfer_names[t->kind], record_name (t));
+  }
+  else {
+    e->failed[t->kind]++;
+    log_msg (LOG_ERR, "Multi engine: WARNING: %s of '%s' failed!", transfer_names[t->kind], record_name (t));
+  }
+
+  switch (t->kind) {
+  case TRANSFER_UPLOAD:
+    if (succeeded)
+      hash_cache_flush_maybe ();
+    upload_release (t->record);
+    break;
+  case TRANSFER_DELETE:
+    destroy_cf_file (t->record, NULL);
+    break;
+  default:
+    copy_release (t->record);
+    break;
+  }
+  transfer_free (e, t);
+}
+
+static void transfer_start (struct multi_engine *e, struct transfer *t);
+
+/* Deletes each of cfs on its own, taking the slots it needs to regardless of max_inflight */
+static void
+delete_individually (struct multi_engine *e, GPtrArray * cfs)
+{
+  guint i;
+
+  pthread_mutex_lock (&e->lock);
+  e->slots += cfs->len;
+  pthread_mutex_unlock (&e->lock);
+
+  for (i = 0; i < cfs->len; i++) {
+    struct transfer *t = calloc (1, sizeof (struct transfer));
+    t->kind = TRANSFER_DELETE;
+    t->record = g_ptr_array_index (cfs, i);
+    transfer_start (e, t);
+  }
+  g_ptr_array_set_size (cfs, 0);
+}
+
+static gint
+retry_at_cmp (gconstpointer a, gconstpointer b, gpointer data)
+{
+  const struct transfer *x = a, *y = b;
+  return x->retry_at < y->retry_at ? -1 : x->retry_at > y->retry_at;
+}
+
+static gint
+resume_at_cmp (gconstpointer a, gconstpointer b, gpointer data)
+{
+  const struct transfer *x = a, *y = b;
+  return x->resume_at < y->resume_at ? -1 : x->resume_at > y->resume_at;
+}
+
+/* Reads an upload's file, pausing the transfer instead whenever we're over the bandwidth limit */
+static size_t
+multi_read (char *buffer, size_t size, size_t nitems, void *data)
+{
+  struct transfer *t = data;
+  gint64 due = rate_limit_due (RATE_BYTES);
+  size_t n;
+
+  if (due > 0) {
+    rate_limit_waited (RATE_BYTES, due);
+    t->resume_at = g_get_monotonic_time () + due;
+    g_queue_insert_sorted (&t->engine->paused, t, resume_at_cmp, NULL);
+    return CURL_READFUNC_PAUSE;
+  }
+  n = read_and_hash (buffer, size, nitems, &t->src);
+  if (n != CURL_READFUNC_ABORT)
+    rate_limit_charge (RATE_BYTES, n);
+  return n;
+}
+
+/* Deals with t after a failed go, as retry_decide() said: action is RETRY_AGAIN (due again in delay microseconds)
+ * or RETRY_FATAL
+ */
+static void
+transfer_retry (struct multi_engine *e, struct transfer *t, int action, gint64 delay)
+{
+  if (action != RETRY_AGAIN) {
+    if (t->batch == NULL) {
+      transfer_release (e, t, FALSE);
+      return;
+    }
+    log_msg (LOG_WARNING, "Multi engine: Bulk delete failed - deleting %u objects one at a time", t->batch->len);
+    delete_individually (e, t->batch);
+    transfer_free (e, t);
+    return;
+  }
+  t->retry_at = g_get_monotonic_time () + delay;
+  g_queue_insert_sorted (&e->delayed, t, retry_at_cmp, NULL);
+}
+
+static void
+transfer_start (struct multi_engine *e, struct transfer *t)
+{
+  cf_file_copy *cfc;
+  gint64 delay;
+
+  t->engine = e;
+  /* A retry goes with the file as it is now, not as it was when it was queued */
+  if (t->kind == TRANSFER_UPLOAD && t->attempts > 0 && !upload_refresh (t->record)) {
+    log_msg (LOG_DEBUG, "Multi engine: '%s' has gone since the last attempt - not retrying", record_name (t));
+    upload_release (t->record);
+    transfer_free (e, t);
+    return;
+  }
+
+  /* Over the request limit - come back once it's our turn */
+  if ((delay = rate_limit_due (transfer_rate_limits[t->kind])) > 0) {
+    rate_limit_waited (transfer_rate_limits[t->kind], delay);
+    t->retry_at = g_get_monotonic_time () + delay;
+    g_queue_insert_sorted (&e->delayed, t, retry_at_cmp, NULL);
+    return;
+  }
+  rate_limit_charge (transfer_rate_limits[t->kind], t->batch != NULL ? t->batch->len : 1);
+
+  t->curl = e->idle_handles->len > 0 ? g_ptr_array_remove_index_fast (e->idle_handles, e->idle_handles->len - 1) : curl_easy_init ();
+  if (t->curl == NULL) {
+    log_msg (LOG_ERR, "Multi engine: Failed to initialise curl!");
+    /* As if the connection had failed */
+    transfer_retry (e, t, retry_decide ("Multi engine", 0, 201, &t->attempts, 0, &delay), delay);
+    return;
+  }
+
+  shared_curl_attach (t->curl);
+  free_single_pointer (t->url);
+  t->url = NULL;
+  switch (t->kind) {
+  case TRANSFER_UPLOAD:
+    Sasprintf (t->url, "%s/%s/%s", auth->endpoint, cfg->container, ((local_file *) t->record)->cf_name);
+    if (upload_request_setup (t->curl, &t->src, &t->headers, auth->token_header, t->url, t->record) < 0) {
+      g_ptr_array_add (e->idle_handles, t->curl);
+      t->curl = NULL;
+      transfer_release (e, t, FALSE);
+      return;
+    }
+    curl_easy_setopt (t->curl, CURLOPT_READFUNCTION, multi_read);
+    curl_easy_setopt (t->curl, CURLOPT_READDATA, t);
+    break;
+  case TRANSFER_DELETE:
+    if (t->batch != NULL) {
+      if (t->body == NULL)
+	t->body = bulk_delete_body (t->batch);
+      free_single_pointer (t->resp.data);
+      init_string (&t->resp);
+      bulk_delete_request_setup (t->curl, &t->headers, &t->url, auth->token_header, t->body, &t->resp);
+      break;
+    }
+    t->slo_delete = slo_known (((cf_file *) t->record)->name);
+    Sasprintf (t->url, "%s/%s/%s%s", auth->endpoint, cfg->container, ((cf_file *) t->record)->name,
+	       t->slo_delete ? "?multipart-manifest=delete" : "");
+    if (t->slo_delete) {
+      free_single_pointer (t->resp.data);
+      init_string (&t->resp);
+    }
+    delete_request_setup (t->curl, &t->headers, auth->token_header, t->url, t->slo_delete ? &t->resp : NULL);
+    break;
+  default:
+    cfc = t->record;
+    free_single_pointer (t->dest_header);
+    t->dest_header = NULL;
+    Sasprintf (t->url, "%s/%s/%s", auth->endpoint, cfg->container, cfc->old_name);
+    Sasprintf (t->dest_header, "%s%s/%s", "Destination: ", cfg->container, cfc->new_name);
+    copy_request_setup (t->curl, &t->headers, auth->token_header, t->url, t->dest_header);
+    break;
+  }
+  log_msg (LOG_DEBUG, "Multi engine: Starting %s of '%s' (%s)", transfer_names[t->kind], record_name (t), t->url);
+
+  curl_set_http_version (t->curl);
+  curl_easy_setopt (t->curl, CURLOPT_PRIVATE, t);
+  curl_multi_add_handle (e->multi, t->curl);
+  e->running++;
+  if ((unsigned int) e->running > e->peak_inflight)
+    e->peak_inflight = e->running;
+}
+
+static void
+batch_finished (struct multi_engine *e, struct transfer *t, long http_code)
+{
+  GPtrArray *failed = g_ptr_array_new ();
+  guint sent = t->batch->len;
+  int result = bulk_delete_finish (t->batch, http_code, &t->resp, failed);
+  gint64 delay;
+
+  if (result == BULK_DELETE_DONE) {
+    e->done[TRANSFER_DELETE] += sent - failed->len;
+    delete_individually (e, failed);
+    transfer_free (e, t);
+  }
+  else {
+    /* A 200 with a failed status in the body is still worth another go */
+    if (result == BULK_DELETE_AUTH)
+      http_code = 401;
+    else if (http_code == 200)
+      http_code = 0;
+    transfer_retry (e, t, retry_decide ("Multi engine", http_code, 200, &t->attempts, t->retry_after, &delay), delay);
+  }
+  g_ptr_array_free (failed, TRUE);
+}
+
+static void
+transfer_finished (struct multi_engine *e, struct transfer *t, CURLcode res)
+{
+  long http_code = 0;
+  long expected = t->kind == TRANSFER_DELETE ? 204 : 201;
+  gint64 delay;
+
+  if (res == CURLE_OK) {
+    curl_easy_getinfo (t->curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (!e->logged_http_version) {
+      log_http_version (t->curl, "Multi engine");
+      e->logged_http_version = TRUE;
+    }
+  }
+  else
+    log_msg (LOG_ERR, "Multi engine: %s of '%s' failed: %s", transfer_names[t->kind], record_name (t), curl_easy_strerror (res));
+
+  curl_multi_remove_handle (e->multi, t->curl);
+  shared_curl_count (t->curl);
+  if (t->resume_at != 0) {
+    g_queue_remove (&e->paused, t);
+    t->resume_at = 0;
+  }
+  t->retry_after = curl_retry_after (t->curl);
+  e->running--;
+  if (t->kind == TRANSFER_UPLOAD)
+    http_code = upload_request_finish (t->record, &t->src, t->headers, http_code);
+  else
+    curl_slist_free_all (t->headers);
+  t->headers = NULL;
+
+  curl_easy_reset (t->curl);
+  g_ptr_array_add (e->idle_handles, t->curl);
+  t->curl = NULL;
+
+  log_msg (LOG_DEBUG, "Multi engine: HTTP return code %ld for %s of '%s'", http_code, transfer_names[t->kind], record_name (t));
+  if (t->batch != NULL) {
+    batch_finished (e, t, http_code);
+    return;
+  }
+  if (t->kind == TRANSFER_DELETE && t->slo_delete)
+    http_code = delete_manifest_result (((cf_file *) t->record)->name, http_code, &t->resp);
+  /* Already gone is as good as deleted */
+  if (t->kind == TRANSFER_DELETE && http_code == 404)
+    http_code = expected;
+  if (http_code == expected)
+    transfer_release (e, t, TRUE);
+  else
+    transfer_retry (e, t, retry_decide ("Multi engine", http_code, expected, &t->attempts, t->retry_after, &delay), delay);
+}
+
+static void
+check_finished (struct multi_engine *e)
+{
+  CURLMsg *msg;
+  int left;
+  struct transfer *t;
+
+  while ((msg = curl_multi_info_read (e->multi, &left)) != NULL) {
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+    curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, (char **) &t);
+    transfer_finished (e, t, msg->data.result);
+  }
+}
+
+/* Starts whatever the feeders have handed over, and any retries that are due. Also finishes off large file
+ * uploads whose threads are done
+ */
+static void
+start_transfers (struct multi_engine *e)
+{
+  GQueue incoming, slo_done;
+  struct transfer *t;
+  gint64 now = g_get_monotonic_time ();
+
+  pthread_mutex_lock (&e->lock);
+  incoming = e->incoming;
+  g_queue_init (&e->incoming);
+  slo_done = e->slo_done;
+  g_queue_init (&e->slo_done);
+  pthread_mutex_unlock (&e->lock);
+
+  while ((t = g_queue_pop_head (&slo_done)) != NULL)
+    transfer_release (e, t, t->slo_code == 201);
+
+  while ((t = g_queue_pop_head (&incoming)) != NULL)
+    transfer_start (e, t);
+
+  while ((t = g_queue_peek_head (&e->delayed)) != NULL && t->retry_at <= now)
+    transfer_start (e, g_queue_pop_head (&e->delayed));
+
+  /* Unpausing can call multi_read() straight away, which may pause it again */
+  while ((t = g_queue_peek_head (&e->paused)) != NULL && t->resume_at <= now) {
+    g_queue_pop_head (&e->paused);
+    t->resume_at = 0;
+    curl_easy_pause (t->curl, CURLPAUSE_CONT);
+  }
+}
+
+/* How long epoll_wait() can sleep for before curl, a retry or a paused upload needs us */
+static int
+next_timeout (struct multi_engine *e)
+{
+  gint64 wake_at = e->timer_at;
+  struct transfer *t = g_queue_peek_head (&e->delayed);
+
+  if (t != NULL && (wake_at < 0 || t->retry_at < wake_at))
+    wake_at = t->retry_at;
+  t = g_queue_peek_head (&e->paused);
+  if (t != NULL && (wake_at < 0 || t->resume_at < wake_at))
+    wake_at = t->resume_at;
+  if (wake_at < 0)
+    return -1;
+  wake_at -= g_get_monotonic_time ();
+  return wake_at <= 0 ? 0 : (int) ((wake_at + 999) / 1000);
+}
+
+static int
+finished (struct multi_engine *e)
+{
+  int ret;
+  pthread_mutex_lock (&e->lock);
+  ret = e->feeders == 0 && e->slots == 0;
+  pthread_mutex_unlock (&e->lock);
+  return ret;
+}
+
+static void *
+multi_loop (void *data)
+{
+  struct multi_engine *e = data;
+  struct epoll_event events[MULTI_MAX_EVENTS];
+  int i, n, k;
+  uint64_t count;
+
+  log_msg (LOG_DEBUG, "Multi engine: event loop started, up to %d requests in flight", cfg->max_inflight);
+
+  while (!finished (e)) {
+    n = epoll_wait (e->epfd, events, MULTI_MAX_EVENTS, next_timeout (e));
+    if (n < 0 && errno != EINTR)
+      log_msg (LOG_ERR, "Multi engine: epoll_wait() failed: %s", strerror (errno));
+
+    for (i = 0; i < n; i++) {
+      if (events[i].data.fd == e->wakefd) {
+	if (read (e->wakefd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+	  log_msg (LOG_ERR, "Multi engine: Failed reading the wakeup fd: %s", strerror (errno));
+	continue;
+      }
+      int flags = (events[i].events & EPOLLIN ? CURL_CSELECT_IN : 0) | (events[i].events & EPOLLOUT ? CURL_CSELECT_OUT : 0) |
+	(events[i].events & (EPOLLERR | EPOLLHUP) ? CURL_CSELECT_ERR : 0);
+      curl_multi_socket_action (e->multi, events[i].data.fd, flags, &k);
+    }
+
+    if (e->timer_at >= 0 && g_get_monotonic_time () >= e->timer_at) {
+      e->timer_at = -1;
+      curl_multi_socket_action (e->multi, CURL_SOCKET_TIMEOUT, 0, &k);
+    }
+
+    check_finished (e);
+    start_transfers (e);
+  }
+
+  for (i = 0; i < TRANSFER_KINDS; i++)
+    pthread_join (e->feeder_threads[i], NULL);
+  log_msg (LOG_INFO, "Multi engine: %lu uploads, %lu deletes and %lu copies done (%lu, %lu and %lu failed), at most %u at once",
+	   e->done[TRANSFER_UPLOAD], e->done[TRANSFER_DELETE], e->done[TRANSFER_COPY], e->failed[TRANSFER_UPLOAD],
+	   e->failed[TRANSFER_DELETE], e->failed[TRANSFER_COPY], e->peak_inflight);
+
+  g_ptr_array_free (e->idle_handles, TRUE);
+  curl_multi_cleanup (e->multi);
+  close (e->epfd);
+  close (e->wakefd);
+  pthread_mutex_destroy (&e->lock);
+  pthread_cond_destroy (&e->room);
+  free_single_pointer (e);
+  return NULL;
+}
+
+/* Starts the event loop and its feeders. *thread returns once the feeders have all been sent an exit record, and
+ * every transfer they'd already handed over is done
+ */
+void
+transfer_multi_start (pthread_t * thread)
+{
+  struct multi_engine *e = calloc (1, sizeof (struct multi_engine));
+  GAsyncQueue *queues[TRANSFER_KINDS] = { files_to_upload, files_to_delete, files_to_copy };
+  struct epoll_event ev;
+  int i, rc;
+
+  if ((e->multi = curl_multi_init ()) == NULL)
+    suicide ("Failed to initialise curl multi interface");
+  if ((e->epfd = epoll_create1 (EPOLL_CLOEXEC)) < 0)
+    suicide ("Failed to create epoll instance: %s", strerror (errno));
+  if ((e->wakefd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    suicide ("Failed to create eventfd: %s", strerror (errno));
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = e->wakefd;
+  if (epoll_ctl (e->epfd, EPOLL_CTL_ADD, e->wakefd, &ev) < 0)
+    suicide ("Failed to add eventfd to epoll: %s", strerror (errno));
+
+  curl_multi_setopt (e->multi, CURLMOPT_SOCKETFUNCTION, socket_cb);
+  curl_multi_setopt (e->multi, CURLMOPT_SOCKETDATA, e);
+  curl_multi_setopt (e->multi, CURLMOPT_TIMERFUNCTION, timer_cb);
+  curl_multi_setopt (e->multi, CURLMOPT_TIMERDATA, e);
+  /* Keep a connection around for every request we might have going */
+  curl_multi_setopt (e->multi, CURLMOPT_MAXCONNECTS, (long) cfg->max_inflight);
+
+  if (cfg->http_version == HTTP_VERSION_2 || cfg->http_version == HTTP_VERSION_2_PRIOR_KNOWLEDGE) {
+    /* Run as many requests as the server allows over each HTTP/2 connection, rather than one apiece */
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    curl_multi_setopt (e->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x074300
+    curl_multi_setopt (e->multi, CURLMOPT_MAX_CONCURRENT_STREAMS, (long) cfg->http2_max_streams);
+#endif
+  }
+
+  e->timer_at = -1;
+  e->idle_handles = g_ptr_array_new_with_free_func ((GDestroyNotify) curl_easy_cleanup);
+  g_queue_init (&e->delayed);
+  g_queue_init (&e->paused);
+  g_queue_init (&e->incoming);
+  g_queue_init (&e->slo_done);
+  pthread_mutex_init (&e->lock, NULL);
+  pthread_cond_init (&e->room, NULL);
+  e->feeders = TRANSFER_KINDS;
+
+  for (i = 0; i < TRANSFER_KINDS; i++) {
+    struct feeder *f = malloc (sizeof (struct feeder));
+    f->engine = e;
+    f->kind = i;
+    f->queue = queues[i];
+    rc = pthread_create (&e->feeder_threads[i], NULL, feed, f);
+    if (rc != 0)
+      suicide ("Failed to spawn %s feeder thread. Error code: %d\n", transfer_names[i], rc);
+  }
+
+  rc = pthread_create (thread, NULL, multi_loop, e);
+  if (rc != 0)
+    suicide ("Failed to spawn transfer event loop thread. Error code: %d\n", rc);
+}
@@ -1,54 +1,266 @@
 #include "ccfsync.h"
 #include <pthread.h>
+#include <fcntl.h>
 #include <openssl/crypto.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/md5.h>
 
-int
-do_upload (gchar * token_header, gchar * cf_url, gchar * file, curl_off_t file_len, int thid)
+/* The MD5 of what's actually sent is worked out as curl reads the file, and checked against the ETag CF answers with.
+ * Reads go straight into curl's upload buffer (see curl_set_upload_buffer()) rather than through stdio's
+ */
+size_t
+read_and_hash (char *buffer, size_t size, size_t nitems, void *data)
 {
+  struct upload_source *src = data;
+  ssize_t n;
 
-  FILE *src = fopen (file, "rb");
-  if (src == NULL) {
-    log_msg (LOG_WARNING, "Upload thread %d: Failed to open file for reading in upload_file(): %s\n", thid, strerror (errno));
-    return -1;
+  do
+    n = pread (src->fd, buffer, size * nitems, src->offset);
+  while (n < 0 && errno == EINTR);
+  if (n < 0)
+    return CURL_READFUNC_ABORT;
+  MD5_Update (&src->md5, buffer, n);
+  src->offset += n;
+  return n;
+}
+
+/* Upload threads wait for the bandwidth limit right here. The multi engine reads through its own callback */
+static size_t
+read_limited (char *buffer, size_t size, size_t nitems, void *data)
+{
+  size_t n = read_and_hash (buffer, size, nitems, data);
+
+  if (n != CURL_READFUNC_ABORT)
+    rate_limit_take (RATE_BYTES, n);
+  return n;
+}
+
+/* Picks the ETag out of the response headers */
+static size_t
+read_etag (char *buffer, size_t size, size_t nitems, void *data)
+{
+  struct upload_source *src = data;
+  size_t len = size * nitems, i, n = 0;
+
+  if (len > 5 && g_ascii_strncasecmp (buffer, "etag:", 5) == 0) {
+    for (i = 5; i < len && n < sizeof (src->etag) - 1; i++)
+      if (g_ascii_isxdigit (buffer[i]))
+	src->etag[n++] = g_ascii_tolower (buffer[i]);
+    src->etag[n] = '\0';
   }
+  return len;
+}
 
-  CURL *curl;
-  CURLcode res;
-  long http_code;
-  struct curl_slist *headerlist = NULL;
+/* Set once the first upload has gone through, so we only log the time to it once */
+static volatile gint first_upload_done = FALSE;
+
+/* cf_name -> MD5 of what we last uploaded there, so rewrites that don't change anything aren't sent again */
+static pthread_mutex_t last_uploaded_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *last_uploaded = NULL;
+static unsigned long skipped_uploads = 0;
+
+/* TRUE if lf is what we last uploaded to its object. Events only ever queue files unhashed, and a rewrite changes
+ * the mtime, so the file is hashed here - but only if we've sent something to its object before
+ */
+int
+upload_unchanged (local_file * lf)
+{
+  unsigned char *md5;
+  int known, unchanged = FALSE;
+
+  pthread_mutex_lock (&last_uploaded_mutex);
+  known = last_uploaded != NULL && g_hash_table_lookup (last_uploaded, lf->cf_name) != NULL;
+  pthread_mutex_unlock (&last_uploaded_mutex);
+  if (!known || (!lf->has_hash && hash_local_file (lf) < 0))
+    return FALSE;
 
-  if ((curl = curl_easy_init ()) == NULL) {
-    log_msg (LOG_ERR, "Upload thread %d: Failed to initialise curl!", thid);
+  pthread_mutex_lock (&last_uploaded_mutex);
+  if (last_uploaded != NULL && (md5 = g_hash_table_lookup (last_uploaded, lf->cf_name)) != NULL
+      && memcmp (md5, lf->md5, MD5_DIGEST_LENGTH) == 0)
+    unchanged = TRUE;
+  if (unchanged && ++skipped_uploads % 1000 == 0)
+    log_msg (LOG_INFO, "Skipped %lu uploads of files that hadn't changed since we last sent them", skipped_uploads);
+  pthread_mutex_unlock (&last_uploaded_mutex);
+
+  if (unchanged)
+    log_msg (LOG_DEBUG, "'%s' is what we last uploaded - not sending it again", lf->name);
+  return unchanged;
+}
+
+void
+upload_remember (local_file * lf)
+{
+  unsigned char *md5;
+
+  if (!lf->has_hash)
+    return;
+  md5 = malloc (MD5_DIGEST_LENGTH);
+  memcpy (md5, lf->md5, MD5_DIGEST_LENGTH);
+  pthread_mutex_lock (&last_uploaded_mutex);
+  if (last_uploaded == NULL)
+    last_uploaded = g_hash_table_new_full (g_str_hash, g_str_equal, (GDestroyNotify) free_single_pointer, (GDestroyNotify) free_single_pointer);
+  g_hash_table_replace (last_uploaded, g_strdup (lf->cf_name), md5);
+  pthread_mutex_unlock (&last_uploaded_mutex);
+}
+
+/* The object's about to be deleted, or copied over, so we no longer know what's in it */
+void
+upload_forget (const gchar * cf_name)
+{
+  pthread_mutex_lock (&last_uploaded_mutex);
+  if (last_uploaded != NULL)
+    g_hash_table_remove (last_uploaded, cf_name);
+  pthread_mutex_unlock (&last_uploaded_mutex);
+}
+
+/* We've got the hash of what we sent for free - keep it, unless the file changed under us while we sent it */
+static void
+set_uploaded_hash (local_file * lf, struct upload_source *src, unsigned char *c)
+{
+  struct stat after;
+
+  if (lf->has_hash)
+    return;
+  if (fstat (src->fd, &after) < 0 || !stat_unchanged (&lf->ver, &after))
+    return;
+
+  memcpy (lf->md5, c, MD5_DIGEST_LENGTH);
+  lf->has_hash = TRUE;
+  hash_cache_insert (&lf->ver, c);
+}
+
+/* Sets curl up to PUT lf to cf_url. Used by both transfer engines - src and *headers must outlive the request,
+ * and are released by upload_request_finish(). Returns -1 if the file can't be opened
+ */
+int
+upload_request_setup (CURL * curl, struct upload_source *src, struct curl_slist **headers, const gchar * token_header,
+		      const gchar * cf_url, local_file * lf)
+{
+  src->fd = open (lf->name, O_RDONLY);
+  if (src->fd < 0) {
+    log_msg (LOG_WARNING, "Failed to open '%s' for reading: %s\n", lf->name, strerror (errno));
     return -1;
   }
+  posix_fadvise (src->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  src->offset = 0;
+  MD5_Init (&src->md5);
+  src->etag[0] = '\0';
 
-  headerlist = curl_slist_append (headerlist, token_header);
-  curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headerlist);
+  *headers = curl_slist_append (NULL, token_header);
+  /* With the hash already known (upload_unchanged() works it out for an object we've sent to before), CF checks
+   * what it received against it and refuses the upload (422) if they differ. Otherwise we check its ETag afterwards
+   */
+  if (lf->has_hash && !slo_wanted (lf->ver.size)) {
+    char hex[MD5_DIGEST_LENGTH * 2 + 1];
+    gchar *etag_header = NULL;
+    md5_to_hex (lf->md5, hex);
+    Sasprintf (etag_header, "ETag: %s", hex);
+    *headers = curl_slist_append (*headers, etag_header);
+    free_single_pointer (etag_header);
+  }
+  curl_easy_setopt (curl, CURLOPT_HTTPHEADER, *headers);
   curl_easy_setopt (curl, CURLOPT_UPLOAD, 1L);
   curl_easy_setopt (curl, CURLOPT_PUT, 1L);
   curl_easy_setopt (curl, CURLOPT_URL, cf_url);
+  curl_easy_setopt (curl, CURLOPT_READFUNCTION, read_limited);
   curl_easy_setopt (curl, CURLOPT_READDATA, src);
   if (!cfg->debug)
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_devnull);
-  curl_easy_setopt (curl, CURLOPT_INFILESIZE_LARGE, file_len);
+  curl_easy_setopt (curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t) lf->ver.size);
+  curl_set_upload_buffer (curl);
+  curl_easy_setopt (curl, CURLOPT_HEADERFUNCTION, read_etag);
+  curl_easy_setopt (curl, CURLOPT_HEADERDATA, src);
+  return 0;
+}
 
+/* Releases what upload_request_setup() set up, and returns the request's outcome: http_code, or 422 if CF has
+ * something other than what we sent
+ */
+long
+upload_request_finish (local_file * lf, struct upload_source *src, struct curl_slist *headers, long http_code)
+{
+  unsigned char sent[MD5_DIGEST_LENGTH];
+  char hex[MD5_DIGEST_LENGTH * 2 + 1];
+
+  MD5_Final (sent, &src->md5);
+  md5_to_hex (sent, hex);
+  if (http_code == 201 && src->etag[0] != '\0' && strcmp (src->etag, hex) != 0) {
+    log_msg (LOG_WARNING, "CF stored '%s' with ETag %s, but we sent %s - uploading it again", lf->name, src->etag, hex);
+    http_code = 422;
+  }
+
+  if (http_code == 201) {
+    set_uploaded_hash (lf, src, sent);
+    upload_remember (lf);
+    if (g_atomic_int_compare_and_exchange (&first_upload_done, FALSE, TRUE))
+      log_phase ("first-upload", startup_time);
+  }
+  else if (http_code == 422 && lf->has_hash) {
+    /* Most likely the file was written to after it was hashed. Work the hash out as it's sent next time */
+    log_msg (LOG_INFO, "'%s' didn't match its hash on upload - it has probably changed since", lf->name);
+    lf->has_hash = FALSE;
+  }
+  /* Nothing else here will read it again soon - don't crowd out someone else's page cache */
+  posix_fadvise (src->fd, 0, 0, POSIX_FADV_DONTNEED);
+  close (src->fd);
+  curl_slist_free_all (headers);
+  return http_code;
+}
+
+/* Done with lf, one way or another. If it's changed since it was queued, the coalescer queues it again */
+void
+upload_release (local_file * lf)
+{
+  coalesce_done (lf->cf_name);
+  log_msg (LOG_DEBUG, "Destroying file '%s'\n", lf->cf_name);
+  destroy_local_file (lf);
+}
+
+int
+do_upload (struct worker_conn *wc, gchar * token_header, gchar * cf_url, local_file * lf, int thid)
+{
+  struct upload_source src;
+  CURL *curl;
+  CURLcode res;
+  long http_code;
+  struct curl_slist *headerlist = NULL;
+
+  if ((curl = worker_conn_get (wc)) == NULL)
+    return -1;
+  if (upload_request_setup (curl, &src, &headerlist, token_header, cf_url, lf) < 0)
+    return -1;
+
+  rate_limit_take (RATE_PUT, 1);
   res = curl_easy_perform (curl);
-  curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &http_code);
+  if (curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &http_code) != CURLE_OK)
+    http_code = 0;
   if (res != CURLE_OK)
     log_msg (LOG_ERR, "Upload thread %d: Request failed: %s\n", thid, curl_easy_strerror (res));
 
-  fclose (src);
-  curl_slist_free_all (headerlist);
-  curl_easy_cleanup (curl);
-
-  /* This is to work around a memory-leak in curl */
-  ERR_remove_thread_state (NULL);
+  http_code = upload_request_finish (lf, &src, headerlist, res == CURLE_OK ? http_code : 0);
+  worker_conn_done (wc, res);
 
   return http_code;
 }
 
+/* A retry may come round a while after the file was queued. Picks up any changes made since, so what's sent
+ * is what's there now. Returns FALSE if the file has gone (its deletion will be along separately)
+ */
+int
+upload_refresh (local_file * lf)
+{
+  struct stat st;
+
+  if (stat (lf->name, &st) < 0 || !S_ISREG (st.st_mode))
+    return FALSE;
+  if (!stat_unchanged (&lf->ver, &st)) {
+    file_version_from_stat (&lf->ver, &st);
+    lf->has_hash = FALSE;
+  }
+  return TRUE;
+}
+
 /* Blocks on popping the queue containing files to upload 
  * takes a struct upload_thread_data containing the auth struct and container name
 */
@@ -57,33 +269,41 @@ upload_file (void *data)
 {
 
   thread_data *thd = (thread_data *) data;
+  struct worker_conn *wc = worker_conn_new ("Upload", thd->thread_id);
 
   log_msg (LOG_DEBUG, "Upload thread: %d spawned", thd->thread_id);
 
   while (1) {
 
-    int retries = 5;
     int http_code = 0;
-    unsigned int i;
-    int was_uploaded = FALSE;
+    int action;
+    gint64 delay;
 
     local_file *lf = g_async_queue_pop (files_to_upload);
 
-    /* A sentinel-event is put on the queue when we're asked to exit. Kill the thread when we hit one of those */
-    if (lf->sentinel != NULL) {
-      if (strncmp (lf->sentinel, "exit", strlen ("exit")) == 0) {
-	destroy_local_file (lf);
-	log_msg (LOG_DEBUG, "Upload thread %d: asked to exit...\n", thd->thread_id);
-	free_single_pointer (thd);
-	pthread_exit (EXIT_SUCCESS);
-      }
+    /* An exit record is put on the queue when we're asked to exit. Kill the thread when we hit one of those */
+    if (lf->type == RECORD_EXIT) {
+      destroy_local_file (lf);
+      log_msg (LOG_DEBUG, "Upload thread %d: asked to exit...\n", thd->thread_id);
+      worker_conn_free (wc);
+      free_single_pointer (thd);
+      pthread_exit (EXIT_SUCCESS);
     }
 
-    gchar *cf_url = NULL;
-    gchar *token_header = NULL;
+    if (lf->attempts > 0 && !upload_refresh (lf)) {
+      log_msg (LOG_DEBUG, "Upload thread %d: '%s' has gone since the last attempt - not retrying", thd->thread_id, lf->name);
+      upload_release (lf);
+      continue;
+    }
 
+    gchar *cf_url = NULL;
 
-    do {
+    if (upload_unchanged (lf))
+      http_code = 201;
+    /* Large files are split into segments, which are retried on their own */
+    else if (slo_wanted (lf->ver.size))
+      http_code = upload_slo (wc, lf, thd->thread_id);
+    else {
       Sasprintf (cf_url, "%s/%s/%s", auth->endpoint, cfg->container, lf->cf_name);
 
       log_msg (LOG_DEBUG, "\n\nUpload thread %d: Uploading '%s'", thd->thread_id, lf->name);
@@ -91,64 +311,26 @@ upload_file (void *data)
       log_msg (LOG_DEBUG, "Upload thread %d: Using url: %s", thd->thread_id, cf_url);
       log_msg (LOG_DEBUG, "Upload thread %d: CF file is: %s", thd->thread_id, lf->cf_name);
 
-      http_code = do_upload (auth->token_header, cf_url, lf->name, (curl_off_t) lf->st->st_size, thd->thread_id);
+      http_code = do_upload (wc, auth->token_header, cf_url, lf, thd->thread_id);
       log_msg (LOG_DEBUG, "Upload thread %d: HTTP return code: %d", thd->thread_id, http_code);
-      
-      if (http_code == 201) {
-	was_uploaded = TRUE;
-        free_single_pointer (cf_url);
-	break;
-      }
-      else if (http_code == 401) {
-	log_msg (LOG_INFO, "Upload thread %d: Authentication error - token expired? Reauthenticating\n", thd->thread_id);
-
-	if (pthread_mutex_trylock (&auth_in_progress_mutex)) {
-	  doAuth (REAUTH);
-	  pthread_mutex_unlock (&auth_in_progress_mutex);
-	  log_msg (LOG_DEBUG, "Upload thread %d: Got new token: '%s'", thd->thread_id, auth->token);
-	}
-	else {
-	  log_msg (LOG_DEBUG, "Upload thread %d: Another thread is authenticating - sleeping 1 second and re-trying upload", thd->thread_id);
-	}
-      }
-      else {
-	log_msg (LOG_DEBUG, "Upload thread %d: Unhandled HTTP return code in file upload: %d file: %s", thd->thread_id, http_code, lf->name);
-      }
-
       free_single_pointer (cf_url);
-      cf_url = NULL;
-      sleep (1);
+    }
 
-    } while (retries-- > 0);
+    action = retry_decide (worker_conn_name (wc), http_code, 201, &lf->attempts, worker_conn_retry_after (wc), &delay);
+    if (action == RETRY_AGAIN) {
+      /* Stays in flight as far as the coalescer's concerned until it's done with for good */
+      retry_later (files_to_upload, lf, delay, (GDestroyNotify) upload_release);
+      continue;
+    }
 
-    if (!was_uploaded) {
+    if (action == RETRY_FATAL) {
       log_msg (LOG_ERR, "Upload thread: %d: WARNING: File '%s' failed to upload! HTTP return code: %d", thd->thread_id, lf->name, http_code);
     }
-    else
+    else {
       log_msg (LOG_DEBUG, "Upload thread: %d: Upload of '%s' successful", thd->thread_id, lf->name);
-
-    /* Remove the file from the list holding files waiting to be uploaded.
-     * This will enable the file to be uploaded again from this point.
-     * files_being_uploaded contains a pointer to the same struct as in the files_to_upload
-     * queue. So we can only free once.
-     */
-    int free_lf = TRUE;
-    pthread_mutex_lock (&files_being_uploaded_mutex);
-    
-    for (i = 0; i < g_list_length (files_being_uploaded); i++) {
-
-      char *tmp_lf = g_list_nth_data (files_being_uploaded, i);
-
-      if (strncmp (tmp_lf, lf->name, strlen (tmp_lf)) == 0) {
-	files_being_uploaded = g_list_remove (files_being_uploaded, tmp_lf);
-        free_single_pointer(tmp_lf);
-	break;
-      }
-
+      hash_cache_flush_maybe ();
     }
-    pthread_mutex_unlock (&files_being_uploaded_mutex);
 
-    log_msg (LOG_DEBUG, "Destroying file '%s'\n", lf->cf_name);
-    destroy_local_file(lf);
+    upload_release (lf);
   }
 }
@@ -0,0 +1,124 @@
+#include "ccfsync.h"
+#include <fcntl.h>
+
+/* Walks a directory tree once, handing every directory and every regular file to the callbacks.
+ *
+ * Directories are opened relative to their parent's fd and files are stat()ed with fstatat(), so the kernel
+ * never has to resolve a full path. d_type is trusted when the filesystem fills it in - only DT_UNKNOWN (XFS
+ * without ftype, some network filesystems) and symlinks need a stat() to find out what they are.
+ */
+
+struct walk {
+  struct exclusions *exclusions;
+  walk_dir_cb on_dir;
+  walk_file_cb on_file;
+  void *data;
+  /* Set when a callback asks us to stop */
+  int aborted;
+};
+
+/* Takes ownership of fd */
+static void
+walk_dir (struct walk *w, int fd, const gchar * path)
+{
+  DIR *dir;
+  struct dirent *entry;
+  struct stat st;
+
+  if ((dir = fdopendir (fd)) == NULL) {
+    log_msg (LOG_WARNING, "Failed to open directory %s for listing: %s", path, strerror (errno));
+    close (fd);
+    return;
+  }
+
+  if (w->on_dir != NULL && w->on_dir (path, w->data) < 0) {
+    w->aborted = TRUE;
+    closedir (dir);
+    return;
+  }
+
+  while (!w->aborted && (entry = readdir (dir))) {
+    int is_dir;
+
+    if (strcmp (entry->d_name, ".") == 0 || strcmp (entry->d_name, "..") == 0)
+      continue;
+
+    gchar *fullpath = NULL;
+    Sasprintf (fullpath, "%s/%s", path, entry->d_name);
+
+    if (w->exclusions != NULL && regex_match (fullpath, w->exclusions)) {
+      free_single_pointer (fullpath);
+      continue;
+    }
+
+    switch (entry->d_type) {
+    case DT_DIR:
+      is_dir = TRUE;
+      break;
+    case DT_REG:
+      is_dir = FALSE;
+      /* Only need the stat() if someone wants to know about files */
+      if (w->on_file != NULL && fstatat (dirfd (dir), entry->d_name, &st, 0) < 0) {
+	free_single_pointer (fullpath);
+	continue;
+      }
+      break;
+    case DT_UNKNOWN:
+    case DT_LNK:
+      if (fstatat (dirfd (dir), entry->d_name, &st, 0) < 0 || (!S_ISDIR (st.st_mode) && !S_ISREG (st.st_mode))) {
+	free_single_pointer (fullpath);
+	continue;
+      }
+      is_dir = S_ISDIR (st.st_mode);
+      break;
+    default:
+      /* FIFOs, sockets and devices aren't something we can sync */
+      free_single_pointer (fullpath);
+      continue;
+    }
+
+    if (is_dir) {
+      int child = openat (dirfd (dir), entry->d_name, O_RDONLY | O_DIRECTORY);
+      if (child < 0)
+	log_msg (LOG_WARNING, "Failed to open directory %s for listing: %s", fullpath, strerror (errno));
+      else
+	walk_dir (w, child, fullpath);
+      free_single_pointer (fullpath);
+    }
+    else if (w->on_file != NULL) {
+      /* on_file takes ownership of fullpath */
+      if (w->on_file (fullpath, &st, w->data) < 0)
+	w->aborted = TRUE;
+    }
+    else
+      free_single_pointer (fullpath);
+  }
+
+  closedir (dir);
+}
+
+/* Walks root, calling on_dir (with root itself first) for every directory and on_file for every regular file.
+ * Either callback may be NULL, and either may return < 0 to stop the walk. on_file is given ownership of the
+ * path it's called with. Paths matching exclusions (if not NULL) are skipped, and so is everything below
+ * excluded directories. Returns -1 if root can't be read or the walk was stopped.
+ */
+int
+walk_tree (const gchar * root, struct exclusions *exclusions, walk_dir_cb on_dir, walk_file_cb on_file, void *data)
+{
+  struct walk w;
+  int fd = open (root, O_RDONLY | O_DIRECTORY);
+
+  if (fd < 0) {
+    log_msg (LOG_CRIT, "Failed to open directory %s for listing: %s", root, strerror (errno));
+    return -1;
+  }
+
+  w.exclusions = exclusions;
+  w.on_dir = on_dir;
+  w.on_file = on_file;
+  w.data = data;
+  w.aborted = FALSE;
+  walk_dir (&w, fd, root);
+
+  return w.aborted ? -1 : 0;
+}
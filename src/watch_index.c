@@ -0,0 +1,165 @@
+#include "ccfsync.h"
+#include <sys/inotify.h>
+
+/* Which directory each inotify watch is on, both ways round: the monitor looks every event's wd up, and the
+ * directory create/move threads look watches up by path to remove them. Either is a hash lookup.
+ *
+ * The monitor thread only ever reads, so it takes the lock shared and doesn't wait on the create/move threads
+ * unless one of them is changing a watch right then. Lookups by wd hand back a copy of the path, since the entry
+ * can go as soon as the lock's dropped.
+ */
+
+struct watch_index {
+  pthread_rwlock_t lock;
+  /* path -> wd */
+  GHashTable *by_path;
+  /* wd -> path. The paths are by_path's keys */
+  GHashTable *by_wd;
+};
+
+struct watch_index *
+watch_index_new ()
+{
+  struct watch_index *wi = malloc (sizeof (struct watch_index));
+
+  pthread_rwlock_init (&wi->lock, NULL);
+  wi->by_path = g_hash_table_new_full (g_str_hash, g_str_equal, (GDestroyNotify) free_single_pointer, NULL);
+  wi->by_wd = g_hash_table_new (g_direct_hash, g_direct_equal);
+  return wi;
+}
+
+void
+watch_index_destroy (struct watch_index *wi)
+{
+  g_hash_table_destroy (wi->by_wd);
+  g_hash_table_destroy (wi->by_path);
+  pthread_rwlock_destroy (&wi->lock);
+  free_single_pointer (wi);
+}
+
+/* Drops path and wd from both sides, whatever they're paired with. Takes the write lock */
+static void
+forget_path (struct watch_index *wi, const gchar * path)
+{
+  gpointer key, value;
+
+  if (g_hash_table_lookup_extended (wi->by_path, path, &key, &value)) {
+    if (g_hash_table_lookup (wi->by_wd, value) == key)
+      g_hash_table_remove (wi->by_wd, value);
+    g_hash_table_remove (wi->by_path, path);
+  }
+}
+
+static void
+forget_wd (struct watch_index *wi, int wd)
+{
+  gchar *path = g_hash_table_lookup (wi->by_wd, GINT_TO_POINTER (wd));
+
+  if (path != NULL) {
+    g_hash_table_remove (wi->by_wd, GINT_TO_POINTER (wd));
+    /* The path may be watched under a newer wd by now */
+    if (GPOINTER_TO_INT (g_hash_table_lookup (wi->by_path, path)) == wd)
+      g_hash_table_remove (wi->by_path, path);
+  }
+}
+
+/* Adds a watch on path and records it. The lock is held across both, or an event on the new watch could be looked
+ * up before we know its directory. Returns the wd, or -1 with errno set
+ */
+int
+watch_index_add_watch (struct watch_index *wi, int fd, const gchar * path, int mask)
+{
+  gchar *key;
+  int wd;
+
+  pthread_rwlock_wrlock (&wi->lock);
+  wd = inotify_add_watch (fd, path, mask);
+  if (wd >= 0) {
+    /* inotify hands back the same wd for a directory that's already watched, possibly under another name */
+    forget_wd (wi, wd);
+    forget_path (wi, path);
+    key = g_strdup (path);
+    g_hash_table_insert (wi->by_path, key, GINT_TO_POINTER (wd));
+    g_hash_table_insert (wi->by_wd, GINT_TO_POINTER (wd), key);
+  }
+  pthread_rwlock_unlock (&wi->lock);
+  return wd;
+}
+
+/* Removes the watch on path, if there is one. Returns the wd it had, or -1 */
+int
+watch_index_rm_watch (struct watch_index *wi, int fd, const gchar * path)
+{
+  gpointer value;
+  int wd = -1;
+
+  pthread_rwlock_wrlock (&wi->lock);
+  if (g_hash_table_lookup_extended (wi->by_path, path, NULL, &value)) {
+    wd = GPOINTER_TO_INT (value);
+    /* Fails if the kernel's already dropped it (the directory's gone) - we only care that it's gone */
+    inotify_rm_watch (fd, wd);
+    forget_wd (wi, wd);
+  }
+  pthread_rwlock_unlock (&wi->lock);
+  return wd;
+}
+
+/* For IN_IGNORED: the kernel has dropped wd, because it was removed or its directory was deleted */
+void
+watch_index_forget_wd (struct watch_index *wi, int wd)
+{
+  pthread_rwlock_wrlock (&wi->lock);
+  forget_wd (wi, wd);
+  pthread_rwlock_unlock (&wi->lock);
+}
+
+/* A copy of the path watched by wd (for the caller to free), or NULL if it isn't watched any more */
+gchar *
+watch_index_path (struct watch_index *wi, int wd)
+{
+  gchar *path;
+
+  pthread_rwlock_rdlock (&wi->lock);
+  path = g_strdup (g_hash_table_lookup (wi->by_wd, GINT_TO_POINTER (wd)));
+  pthread_rwlock_unlock (&wi->lock);
+  return path;
+}
+
+/* Removes the watches on path and every directory below it. Returns how many there were */
+guint
+watch_index_rm_tree (struct watch_index *wi, int fd, const gchar * path)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  GPtrArray *wds = g_ptr_array_new ();
+  size_t len = strlen (path);
+  guint i, n;
+  int wd;
+
+  pthread_rwlock_wrlock (&wi->lock);
+  g_hash_table_iter_init (&iter, wi->by_path);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    if (strncmp (key, path, len) == 0 && (((gchar *) key)[len] == '\0' || ((gchar *) key)[len] == '/'))
+      g_ptr_array_add (wds, value);
+  }
+  for (i = 0; i < wds->len; i++) {
+    wd = GPOINTER_TO_INT (g_ptr_array_index (wds, i));
+    inotify_rm_watch (fd, wd);
+    forget_wd (wi, wd);
+  }
+  pthread_rwlock_unlock (&wi->lock);
+  n = wds->len;
+  g_ptr_array_free (wds, TRUE);
+  return n;
+}
+
+guint
+watch_index_size (struct watch_index *wi)
+{
+  guint size;
+
+  pthread_rwlock_rdlock (&wi->lock);
+  size = g_hash_table_size (wi->by_wd);
+  pthread_rwlock_unlock (&wi->lock);
+  return size;
+}